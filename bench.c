@@ -0,0 +1,233 @@
+/**
+ * HTTP/2 end-to-end benchmark
+ *
+ * Runs a client and a server connection on the same process and event_base,
+ * linked by the in-process loopback (or by a socketpair, with -u), and
+ * measures how fast frames go from one to the other.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+
+#include "util.h"
+#include "timer.h"
+#include "http2.h"
+#include "loopback.h"
+
+/* Extension frame type, ignored and discarded by receivers */
+#define BENCH_FRAME_TYPE 0xb0
+
+#define BENCH_FRAMES_DEFAULT 1000000
+#define BENCH_SIZE_DEFAULT 64
+#define BENCH_RUNS_DEFAULT 5
+#define BENCH_WINDOW_DEFAULT 64
+
+static char bench_payload[HTTP2_FRAME_MAX_SIZE_DEFAULT];
+
+static int bench_pair(struct event_base *, int, struct http2_connection **,
+    struct http2_connection **);
+static int bench_run(struct event_base *, int, long, size_t, long, double *);
+static void bench_payload_free(void *);
+static int bench_cmp(const void *, const void *);
+static void usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	struct event_base *evbase;
+	double *results;
+	long nframes = BENCH_FRAMES_DEFAULT;
+	long window = BENCH_WINDOW_DEFAULT;
+	size_t size = BENCH_SIZE_DEFAULT;
+	int nruns = BENCH_RUNS_DEFAULT;
+	int usesocket = 0;
+	int i;
+	int ch;
+
+	/* Parse arguments */
+	while ((ch = getopt(argc, argv, "hn:r:s:uw:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nframes = atol(optarg);
+			break;
+		case 'r':
+			nruns = atoi(optarg);
+			break;
+		case 's':
+			size = atol(optarg);
+			break;
+		case 'u':
+			usesocket = 1;
+			break;
+		case 'w':
+			window = atol(optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	if (nframes <= 0 || nruns <= 0 || window <= 0 ||
+	    size > sizeof(bench_payload))
+		usage();
+
+	printf("HTTP/2 benchmark: %ld frames of %zu bytes, window of %ld, "
+	    "over %s\n", nframes, size, window,
+	    usesocket ? "socketpair" : "loopback");
+
+	evbase = event_base_new();
+	if (evbase == NULL) {
+		prterr("event_base_new: failure.");
+		exit(1);
+	}
+
+	results = calloc(nruns, sizeof(*results));
+	if (results == NULL) {
+		prterrno("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < nruns; i++) {
+		if (bench_run(evbase, usesocket, nframes, size, window,
+		    &results[i]) < 0) {
+			prterr("bench_run: failure.");
+			exit(1);
+		}
+		printf("run %d: %.0f frames/s, %.1f ns/frame\n", i + 1,
+		    1e9 / results[i], results[i]);
+	}
+
+	/* Median is the figure to compare between builds */
+	qsort(results, nruns, sizeof(*results), bench_cmp);
+	printf("min %.1f ns/frame, median %.1f ns/frame (%.0f frames/s)\n",
+	    results[0], results[nruns / 2], 1e9 / results[nruns / 2]);
+
+	free(results);
+	event_base_free(evbase);
+
+	return 0;
+}
+
+static int
+bench_pair(struct event_base *evbase, int usesocket,
+    struct http2_connection **client, struct http2_connection **server)
+{
+	int fds[2];
+
+	if (!usesocket)
+		return loopback_new(evbase, evbase, client, server);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		prterrno("socketpair");
+		return -1;
+	}
+	evutil_make_socket_nonblocking(fds[0]);
+	evutil_make_socket_nonblocking(fds[1]);
+
+	*client = http2_connection_new(fds[0], evbase);
+	if (*client == NULL) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	*server = http2_connection_new(fds[1], evbase);
+	if (*server == NULL) {
+		http2_connection_free(*client);
+		close(fds[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Sends nframes frames from client to server, keeping at most window of them
+ * on the way, and sets result to the mean time per frame in nanoseconds.
+ */
+static int
+bench_run(struct event_base *evbase, int usesocket, long nframes, size_t size,
+    long window, double *result)
+{
+	struct http2_connection *client, *server;
+	struct timespec start, end;
+	long sent;
+
+	if (bench_pair(evbase, usesocket, &client, &server) < 0) {
+		prterr("bench_pair: failure.");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	sent = 0;
+	while (server->cn_nrxframes < nframes) {
+		while (sent < nframes &&
+		    sent - (long)server->cn_nrxframes < window) {
+			struct http2_frame *fr;
+
+			fr = http2_frame_new(client);
+			if (fr == NULL) {
+				prterr("http2_frame_new: failure.");
+				return -1;
+			}
+			fr->fr_type = BENCH_FRAME_TYPE;
+			fr->fr_length = size;
+			fr->fr_buf = bench_payload;
+			fr->fr_buffree = bench_payload_free;
+
+			if (http2_frame_send(fr) < 0) {
+				prterr("http2_frame_send: failure.");
+				return -1;
+			}
+			sent++;
+		}
+
+		if (event_base_loop(evbase, EVLOOP_ONCE) < 0) {
+			prterr("event_base_loop: failure.");
+			return -1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*result = ((end.tv_sec - start.tv_sec) * 1e9 +
+	    (end.tv_nsec - start.tv_nsec)) / nframes;
+
+	http2_connection_free(client);
+	http2_connection_free(server);
+
+	return 0;
+}
+
+/**
+ * Payload is shared by all frames.
+ */
+static void
+bench_payload_free(void *arg)
+{
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-u] [-n frames] [-r runs] [-s size] "
+	    "[-w window]\n", __progname);
+	exit(1);
+}
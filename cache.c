@@ -0,0 +1,1011 @@
+/**
+ * In-memory response cache
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+#include "util.h"
+#include "compress.h"
+#include "hpack.h"
+#include "timer.h"
+#include "http2.h"
+#include "worker.h"
+
+#include "cache.h"
+
+static size_t cache_key_serialize(struct cache_key *, char *, size_t);
+static uint64_t cache_hash(const char *, size_t);
+static time_t cache_now(void);
+
+static unsigned cache_read_enter(struct cache *);
+static void cache_read_exit(struct cache *, unsigned);
+
+static struct cache_entry *cache_find(struct cache *, const char *, size_t);
+static struct cache_entry *cache_find_locked(struct cache *, const char *,
+    size_t);
+static int cache_store(struct cache *, char *, size_t, int, uint64_t *,
+    struct hpack_field *, int, const char *, size_t, int);
+
+static struct cache_entry *cache_entry_new(const char *, size_t,
+    struct hpack_field *, int, const char *, size_t, int);
+static void cache_entry_release(void *);
+
+static int cache_compressible(struct hpack_field *, int, size_t);
+static int cache_vary(struct hpack_field *, int, struct hpack_field *,
+    char **);
+static size_t cache_key_variant(char *, size_t, int);
+static void cache_variants(struct cache *, const char *, size_t, uint64_t,
+    struct hpack_field *, int, const char *, size_t, int);
+static int cache_variants_submit(struct cache *, const char *, size_t,
+    uint64_t, struct hpack_field *, int, const char *, size_t, int);
+static void cache_variants_work(struct worker_job *);
+static void cache_variants_done(struct worker_job *);
+
+static void cache_link(struct cache *, struct cache_entry *);
+static void cache_remove(struct cache *, struct cache_entry *);
+static void cache_evict(struct cache *, size_t);
+static void cache_reclaim(struct cache *);
+
+/* Whether header field has the given (lowercase) name */
+#define CACHE_FIELD_IS(hf, name) \
+	((hf)->hf_namelen == sizeof(name) - 1 && \
+	memcmp((hf)->hf_name, name, sizeof(name) - 1) == 0)
+
+/* Room taken by a variant's suffix on a serialized key */
+#define CACHE_KEY_VARIANT_SIZE (sizeof("content-encoding") + 8)
+
+/* Variants' compression, done on cache's worker pool */
+struct cache_variants_job {
+	struct worker_job vj_job;
+	struct cache *vj_cache;
+	char *vj_key;
+	size_t vj_keylen;
+	uint64_t vj_gen; /* of the identity response */
+	struct hpack_field *vj_fields;
+	int vj_nfields;
+	char *vj_body;
+	size_t vj_bodylen;
+	int vj_ttl;
+};
+
+/**
+ * nbuckets is rounded up to a power of 2; maxsize bounds the memory used by
+ * entries, in bytes.
+ */
+struct cache *
+cache_new(size_t nbuckets, size_t maxsize)
+{
+	struct cache *c;
+	size_t n;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		prterrno("calloc");
+		return NULL;
+	}
+
+	for (n = 1; n < nbuckets; n <<= 1)
+		;
+	c->c_buckets = calloc(n, sizeof(*c->c_buckets));
+	if (c->c_buckets == NULL) {
+		prterrno("calloc");
+		free(c);
+		return NULL;
+	}
+	c->c_nbuckets = n;
+	c->c_maxsize = maxsize;
+
+	atomic_init(&c->c_readers[0], 0);
+	atomic_init(&c->c_readers[1], 0);
+	atomic_init(&c->c_epoch, 0);
+	atomic_init(&c->c_reclaim, 0);
+	pthread_mutex_init(&c->c_lock, NULL);
+
+	return c;
+}
+
+/**
+ * No lookups may be running. Entries still referenced (e.g. by frames not yet
+ * sent) are freed when their last user releases them.
+ */
+void
+cache_free(struct cache *c)
+{
+	int i;
+
+	if (c == NULL)
+		return;
+
+	while (c->c_clock != NULL)
+		cache_remove(c, c->c_clock);
+
+	for (i = 0; i < 2; i++) {
+		while (c->c_retired[i] != NULL) {
+			struct cache_entry *next;
+
+			next = c->c_retired[i]->ce_next_retired;
+			cache_entry_unref(c->c_retired[i]);
+			c->c_retired[i] = next;
+		}
+	}
+
+	pthread_mutex_destroy(&c->c_lock);
+	free(c->c_buckets);
+	free(c);
+}
+
+/**
+ * Sets worker pool where variants are compressed. It must be freed before the
+ * cache. Without a pool, no variants are stored.
+ */
+void
+cache_set_pool(struct cache *c, struct worker_pool *pool)
+{
+	c->c_pool = pool;
+}
+
+/**
+ * Returns a referenced entry, to be released with cache_entry_unref(), or NULL
+ * if there is no fresh response for key. The best variant ck_accept allows is
+ * returned, falling back to the identity response.
+ */
+struct cache_entry *
+cache_lookup(struct cache *c, struct cache_key *key)
+{
+	struct cache_entry *ce;
+	char stackbuf[512];
+	char *keybuf;
+	size_t keylen;
+	int encs[COMPRESS_NENCODINGS];
+	int nencs;
+	int i;
+
+	/* Serializes key, on stack whenever it fits */
+	keylen = cache_key_serialize(key, NULL, 0);
+	keybuf = stackbuf;
+	if (keylen + CACHE_KEY_VARIANT_SIZE > sizeof(stackbuf)) {
+		keybuf = malloc(keylen + CACHE_KEY_VARIANT_SIZE);
+		if (keybuf == NULL) {
+			prterrno("malloc");
+			return NULL;
+		}
+	}
+	cache_key_serialize(key, keybuf, keylen);
+
+	ce = NULL;
+	nencs = 0;
+	if (key->ck_accept != NULL)
+		nencs = compress_negotiate(key->ck_accept, encs);
+	for (i = 0; i < nencs && ce == NULL; i++)
+		ce = cache_find(c, keybuf,
+		    cache_key_variant(keybuf, keylen, encs[i]));
+	if (ce == NULL)
+		ce = cache_find(c, keybuf, keylen);
+
+	if (keybuf != stackbuf)
+		free(keybuf);
+
+	/* Lookup is over, hence quiescent: releases retired entries, unless a
+	 * writer is busy (it will do so itself) */
+	if (atomic_load_explicit(&c->c_reclaim, memory_order_relaxed) &&
+	    pthread_mutex_trylock(&c->c_lock) == 0) {
+		cache_reclaim(c);
+		pthread_mutex_unlock(&c->c_lock);
+	}
+
+	return ce;
+}
+
+/**
+ * Stores a response with header list hf (including :status) and body, valid
+ * for ttl seconds. A response previously stored for the same key is replaced,
+ * variants included. Returns -1 if it cannot be stored (e.g. it is larger than
+ * the cache).
+ */
+int
+cache_insert(struct cache *c, struct cache_key *key, struct hpack_field *hf,
+    int nfields, const char *body, size_t bodylen, int ttl)
+{
+	struct hpack_field *fields;
+	char *keybuf, *vary;
+	size_t keylen;
+	uint64_t gen;
+	int r;
+
+	keylen = cache_key_serialize(key, NULL, 0);
+	keybuf = malloc(keylen + CACHE_KEY_VARIANT_SIZE);
+	if (keybuf == NULL) {
+		prterrno("malloc");
+		return -1;
+	}
+	cache_key_serialize(key, keybuf, keylen);
+
+	if (c->c_pool == NULL || !cache_compressible(hf, nfields, bodylen)) {
+		r = cache_store(c, keybuf, keylen, COMPRESS_IDENTITY, &gen, hf,
+		    nfields, body, bodylen, ttl);
+		free(keybuf);
+		return r;
+	}
+
+	/* Identity response tells it varies on accept-encoding as well, and so
+	 * do variants, which get the same fields */
+	fields = calloc(nfields + 1, sizeof(*fields));
+	if (fields == NULL) {
+		prterrno("calloc");
+		free(keybuf);
+		return -1;
+	}
+	nfields = cache_vary(hf, nfields, fields, &vary);
+	if (nfields < 0) {
+		prterr("cache_vary: failure.");
+		free(fields);
+		free(keybuf);
+		return -1;
+	}
+
+	r = cache_store(c, keybuf, keylen, COMPRESS_IDENTITY, &gen, fields,
+	    nfields, body, bodylen, ttl);
+
+	/* Compression never runs here: if it cannot be handed over, the
+	 * identity response goes alone */
+	if (r == 0 && cache_variants_submit(c, keybuf, keylen, gen, fields,
+	    nfields, body, bodylen, ttl) < 0)
+		prterr("cache_variants_submit: failure.");
+
+	free(vary);
+	free(fields);
+	free(keybuf);
+
+	return r;
+}
+
+void
+cache_entry_unref(struct cache_entry *ce)
+{
+	if (ce == NULL)
+		return;
+
+	if (atomic_fetch_sub(&ce->ce_refcnt, 1) != 1)
+		return;
+
+	free(ce->ce_key);
+	free(ce->ce_buf);
+	free(ce);
+}
+
+/**
+ * Answers request with cached response, as endpoint_respond() would. Must run
+ * on the request's event loop; entry may be released right after it returns.
+ */
+int
+cache_entry_respond(struct cache_entry *ce, struct endpoint_request *er)
+{
+	atomic_fetch_add(&ce->ce_refcnt, 1);
+
+	return endpoint_respond_encoded(er, ce->ce_status, ce->ce_buf,
+	    ce->ce_hdrlen, &ce->ce_buf[ce->ce_hdrlen], ce->ce_bodylen,
+	    cache_entry_release, ce);
+}
+
+/**
+ * Key is serialized as its strings separated by NUL, which may not appear on
+ * HTTP/2 header fields. Returns the serialized length; buf may be NULL to just
+ * get it.
+ */
+static size_t
+cache_key_serialize(struct cache_key *key, char *buf, size_t buflen)
+{
+	const char *str[3];
+	size_t pos;
+	int i;
+
+	str[0] = key->ck_method;
+	str[1] = key->ck_authority;
+	str[2] = key->ck_path;
+
+#define CACHE_KEY_APPEND(s, n) do { \
+	if (buf != NULL && pos + (n) + 1 <= buflen) { \
+		memcpy(&buf[pos], (s), (n)); \
+		buf[pos + (n)] = '\0'; \
+	} \
+	pos += (n) + 1; \
+} while (0)
+
+	pos = 0;
+	for (i = 0; i < 3; i++)
+		CACHE_KEY_APPEND(str[i], strlen(str[i]));
+	for (i = 0; i < key->ck_nfields; i++) {
+		CACHE_KEY_APPEND(key->ck_fields[i].hf_name,
+		    key->ck_fields[i].hf_namelen);
+		CACHE_KEY_APPEND(key->ck_fields[i].hf_value,
+		    key->ck_fields[i].hf_valuelen);
+	}
+
+#undef CACHE_KEY_APPEND
+
+	return pos;
+}
+
+/**
+ * FNV-1a
+ */
+static uint64_t
+cache_hash(const char *buf, size_t len)
+{
+	uint64_t hash;
+	size_t i;
+
+	hash = 0xcbf29ce484222325ULL;
+	for (i = 0; i < len; i++) {
+		hash ^= (uint8_t)buf[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static time_t
+cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * Lookups register on the current epoch. If the epoch changes while doing
+ * so, the writer may have already checked this epoch's count, so it retries.
+ */
+static unsigned
+cache_read_enter(struct cache *c)
+{
+	unsigned epoch;
+
+	for (;;) {
+		epoch = atomic_load(&c->c_epoch);
+		atomic_fetch_add(&c->c_readers[epoch], 1);
+		if (atomic_load(&c->c_epoch) == epoch)
+			return epoch;
+		atomic_fetch_sub(&c->c_readers[epoch], 1);
+	}
+}
+
+static void
+cache_read_exit(struct cache *c, unsigned epoch)
+{
+	atomic_fetch_sub(&c->c_readers[epoch], 1);
+}
+
+static struct cache_entry *
+cache_find(struct cache *c, const char *keybuf, size_t keylen)
+{
+	struct cache_entry *ce;
+	uint64_t hash;
+	unsigned epoch;
+	time_t now;
+
+	hash = cache_hash(keybuf, keylen);
+	now = cache_now();
+
+	epoch = cache_read_enter(c);
+
+	ce = atomic_load_explicit(&c->c_buckets[hash & (c->c_nbuckets - 1)],
+	    memory_order_acquire);
+	for (; ce != NULL; ce = atomic_load_explicit(&ce->ce_next,
+	    memory_order_acquire)) {
+		if (ce->ce_hash != hash || ce->ce_keylen != keylen ||
+		    memcmp(ce->ce_key, keybuf, keylen) != 0)
+			continue;
+
+		/* Expired entries are left for writers to remove */
+		if (ce->ce_expires <= now) {
+			ce = NULL;
+			break;
+		}
+
+		atomic_fetch_add(&ce->ce_refcnt, 1);
+		atomic_store_explicit(&ce->ce_used, 1, memory_order_relaxed);
+		break;
+	}
+
+	cache_read_exit(c, epoch);
+
+	return ce;
+}
+
+/**
+ * Looks for key's entry, expired or not. c_lock must be held.
+ */
+static struct cache_entry *
+cache_find_locked(struct cache *c, const char *keybuf, size_t keylen)
+{
+	struct cache_entry *ce;
+	uint64_t hash;
+
+	hash = cache_hash(keybuf, keylen);
+	ce = atomic_load_explicit(&c->c_buckets[hash & (c->c_nbuckets - 1)],
+	    memory_order_relaxed);
+	for (; ce != NULL; ce = atomic_load_explicit(&ce->ce_next,
+	    memory_order_relaxed))
+		if (ce->ce_hash == hash && ce->ce_keylen == keylen &&
+		    memcmp(ce->ce_key, keybuf, keylen) == 0)
+			break;
+
+	return ce;
+}
+
+/**
+ * Stores response as the enc variant of serialized key, which has room for a
+ * variant's suffix; may be called from any thread. The identity response
+ * replaces the key's previous one and all its variants, and gets a new
+ * generation, set on gen. A variant is dropped unless the identity response
+ * stored is still that of generation *gen: a newer one may have come while it
+ * was being compressed.
+ */
+static int
+cache_store(struct cache *c, char *keybuf, size_t keylen, int enc,
+    uint64_t *gen, struct hpack_field *hf, int nfields, const char *body,
+    size_t bodylen, int ttl)
+{
+	struct cache_entry *ce, *old;
+	int i;
+
+	/* Encodes response out of the lock */
+	ce = cache_entry_new(keybuf, enc == COMPRESS_IDENTITY ? keylen :
+	    cache_key_variant(keybuf, keylen, enc), hf, nfields, body, bodylen,
+	    ttl);
+	if (ce == NULL) {
+		prterr("cache_entry_new: failure.");
+		return -1;
+	}
+	if (ce->ce_size > c->c_maxsize) {
+		prterr("cache_store: response is larger than the cache.");
+		cache_entry_unref(ce);
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->c_lock);
+
+	if (enc == COMPRESS_IDENTITY) {
+		for (i = COMPRESS_IDENTITY + 1; i < COMPRESS_NENCODINGS; i++) {
+			old = cache_find_locked(c, keybuf,
+			    cache_key_variant(keybuf, keylen, i));
+			if (old != NULL)
+				cache_remove(c, old);
+		}
+		ce->ce_gen = *gen = ++c->c_gen;
+	}
+	else {
+		old = cache_find_locked(c, keybuf, keylen);
+		if (old == NULL || old->ce_gen != *gen) {
+			pthread_mutex_unlock(&c->c_lock);
+			prtinfo("Dropping %s variant of a replaced response.",
+			    compress_name(enc));
+			cache_entry_unref(ce);
+			return -1;
+		}
+		ce->ce_gen = *gen;
+	}
+
+	/* Removes previous response for key */
+	old = cache_find_locked(c, ce->ce_key, ce->ce_keylen);
+	if (old != NULL)
+		cache_remove(c, old);
+
+	cache_evict(c, ce->ce_size);
+	cache_link(c, ce);
+	cache_reclaim(c);
+
+	pthread_mutex_unlock(&c->c_lock);
+
+	return 0;
+}
+
+static struct cache_entry *
+cache_entry_new(const char *keybuf, size_t keylen, struct hpack_field *hf,
+    int nfields, const char *body, size_t bodylen, int ttl)
+{
+	struct cache_entry *ce;
+	size_t bound;
+	ssize_t hdrlen;
+	int i;
+
+	ce = calloc(1, sizeof(*ce));
+	if (ce == NULL) {
+		prterrno("calloc");
+		return NULL;
+	}
+	atomic_init(&ce->ce_next, NULL);
+	atomic_init(&ce->ce_refcnt, 1);
+	atomic_init(&ce->ce_used, 0);
+
+	/* Key */
+	ce->ce_keylen = keylen;
+	ce->ce_key = malloc(keylen);
+	if (ce->ce_key == NULL) {
+		prterrno("malloc");
+		goto error;
+	}
+	memcpy(ce->ce_key, keybuf, keylen);
+	ce->ce_hash = cache_hash(ce->ce_key, ce->ce_keylen);
+
+	/* Header block (each field takes at most its strings plus the
+	 * integers' encoding) followed by body */
+	bound = 0;
+	for (i = 0; i < nfields; i++)
+		bound += hf[i].hf_namelen + hf[i].hf_valuelen + 16;
+	ce->ce_buf = malloc(bound + bodylen);
+	if (ce->ce_buf == NULL) {
+		prterrno("malloc");
+		goto error;
+	}
+	hdrlen = hpack_encode(hf, nfields, ce->ce_buf, bound);
+	if (hdrlen < 0) {
+		prterr("hpack_encode: failure.");
+		goto error;
+	}
+	if (bodylen > 0)
+		memcpy(&ce->ce_buf[hdrlen], body, bodylen);
+	ce->ce_hdrlen = hdrlen;
+	ce->ce_bodylen = bodylen;
+
+	/* Status is kept apart as well, for HEAD requests and HTTP/1.1 */
+	for (i = 0; i < nfields; i++) {
+		size_t j;
+
+		if (!CACHE_FIELD_IS(&hf[i], ":status"))
+			continue;
+		for (j = 0; j < hf[i].hf_valuelen; j++)
+			ce->ce_status = ce->ce_status * 10 +
+			    hf[i].hf_value[j] - '0';
+	}
+
+	ce->ce_expires = cache_now() + ttl;
+	ce->ce_size = sizeof(*ce) + ce->ce_keylen + hdrlen + bodylen;
+
+	return ce;
+
+error:
+	cache_entry_unref(ce);
+	return NULL;
+}
+
+/**
+ * fr_buffree for frames sharing a cached buffer.
+ */
+static void
+cache_entry_release(void *arg)
+{
+	cache_entry_unref(arg);
+}
+
+/**
+ * Only bodies of a reasonable size, with a textual content type and not
+ * already encoded are worth compressing.
+ */
+static int
+cache_compressible(struct hpack_field *hf, int nfields, size_t bodylen)
+{
+	static const char *types[] = {
+		"text/", "application/json", "application/javascript",
+		"application/xml", "image/svg+xml", NULL
+	};
+	int compressible;
+	int i, j;
+
+	if (bodylen < COMPRESS_MIN_SIZE)
+		return 0;
+
+	compressible = 0;
+	for (i = 0; i < nfields; i++) {
+		if (CACHE_FIELD_IS(&hf[i], "content-encoding"))
+			return 0;
+		if (!CACHE_FIELD_IS(&hf[i], "content-type"))
+			continue;
+
+		for (j = 0; types[j] != NULL; j++) {
+			if (hf[i].hf_valuelen >= strlen(types[j]) &&
+			    strncasecmp(hf[i].hf_value, types[j],
+			    strlen(types[j])) == 0)
+				compressible = 1;
+		}
+	}
+
+	return compressible;
+}
+
+/**
+ * Copies the nfields fields of hf onto fields, which has room for one more,
+ * adding accept-encoding to what the response varies on: merged into the
+ * value of its vary field if it has one (built on *buf, to be freed by the
+ * caller), else as a vary field of its own. Returns the new count of fields,
+ * -1 on failure.
+ */
+static int
+cache_vary(struct hpack_field *hf, int nfields, struct hpack_field *fields,
+    char **buf)
+{
+	struct hpack_field *vary;
+	const char *p, *end, *tok;
+	int i, ntoks;
+
+	*buf = NULL;
+	memcpy(fields, hf, nfields * sizeof(*fields));
+
+	vary = NULL;
+	for (i = 0; i < nfields && vary == NULL; i++)
+		if (CACHE_FIELD_IS(&fields[i], "vary"))
+			vary = &fields[i];
+	if (vary == NULL) {
+		vary = &fields[nfields++];
+		vary->hf_name = "vary";
+		vary->hf_namelen = sizeof("vary") - 1;
+		vary->hf_value = "accept-encoding";
+		vary->hf_valuelen = sizeof("accept-encoding") - 1;
+		return nfields;
+	}
+
+	/* Nothing to do if it already varies on it, or on everything */
+	ntoks = 0;
+	p = vary->hf_value;
+	end = p + vary->hf_valuelen;
+	while (p < end) {
+		while (p < end && (*p == ',' || *p == ' ' || *p == '\t'))
+			p++;
+		tok = p;
+		while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+			p++;
+		if (p == tok)
+			continue;
+		if ((p - tok == 1 && *tok == '*') ||
+		    (p - tok == sizeof("accept-encoding") - 1 &&
+		    strncasecmp(tok, "accept-encoding", p - tok) == 0))
+			return nfields;
+		ntoks++;
+	}
+
+	if (ntoks == 0) {
+		vary->hf_value = "accept-encoding";
+		vary->hf_valuelen = sizeof("accept-encoding") - 1;
+		return nfields;
+	}
+
+	*buf = malloc(vary->hf_valuelen + sizeof(", accept-encoding"));
+	if (*buf == NULL) {
+		prterrno("malloc");
+		return -1;
+	}
+	memcpy(*buf, vary->hf_value, vary->hf_valuelen);
+	memcpy(&(*buf)[vary->hf_valuelen], ", accept-encoding",
+	    sizeof(", accept-encoding") - 1);
+	vary->hf_value = *buf;
+	vary->hf_valuelen += sizeof(", accept-encoding") - 1;
+
+	return nfields;
+}
+
+/**
+ * Appends variant's content coding to a serialized key, the same way a
+ * header field would be. buf must have CACHE_KEY_VARIANT_SIZE bytes of room
+ * after keylen. Returns the new length.
+ */
+static size_t
+cache_key_variant(char *buf, size_t keylen, int enc)
+{
+	const char *name;
+	size_t pos;
+
+	name = compress_name(enc);
+
+	pos = keylen;
+	memcpy(&buf[pos], "content-encoding", sizeof("content-encoding"));
+	pos += sizeof("content-encoding");
+	memcpy(&buf[pos], name, strlen(name) + 1);
+	pos += strlen(name) + 1;
+
+	return pos;
+}
+
+/**
+ * Compresses body with every supported encoding and stores the variants which
+ * turn out smaller than the identity response of generation gen. hf are the
+ * identity response's fields, vary included.
+ */
+static void
+cache_variants(struct cache *c, const char *keybuf, size_t keylen,
+    uint64_t gen, struct hpack_field *hf, int nfields, const char *body,
+    size_t bodylen, int ttl)
+{
+	struct hpack_field *fields;
+	char *varkey;
+	char lenbuf[24];
+	int enc;
+	int i, n;
+
+	varkey = malloc(keylen + CACHE_KEY_VARIANT_SIZE);
+	fields = calloc(nfields + 2, sizeof(*fields));
+	if (varkey == NULL || fields == NULL) {
+		prterrno("malloc");
+		goto out;
+	}
+	memcpy(varkey, keybuf, keylen);
+
+	for (enc = COMPRESS_IDENTITY + 1; enc < COMPRESS_NENCODINGS; enc++) {
+		char *out;
+		ssize_t outlen;
+		int haslen;
+
+		if (!compress_supported(enc))
+			continue;
+
+		outlen = compress_body(enc, body, bodylen, &out);
+		if (outlen < 0) {
+			prterr("compress_body: failure.");
+			continue;
+		}
+		if (outlen >= bodylen) {
+			free(out);
+			continue;
+		}
+
+		/* Same fields, with content-length (if present) replaced */
+		haslen = 0;
+		for (i = 0, n = 0; i < nfields; i++) {
+			if (CACHE_FIELD_IS(&hf[i], "content-length")) {
+				haslen = 1;
+				continue;
+			}
+			fields[n++] = hf[i];
+		}
+		fields[n].hf_name = "content-encoding";
+		fields[n].hf_namelen = sizeof("content-encoding") - 1;
+		fields[n].hf_value = compress_name(enc);
+		fields[n].hf_valuelen = strlen(compress_name(enc));
+		n++;
+		if (haslen) {
+			fields[n].hf_name = "content-length";
+			fields[n].hf_namelen = sizeof("content-length") - 1;
+			fields[n].hf_value = lenbuf;
+			fields[n].hf_valuelen = snprintf(lenbuf, sizeof(lenbuf),
+			    "%zd", outlen);
+			n++;
+		}
+
+		if (cache_store(c, varkey, keylen, enc, &gen, fields, n, out,
+		    outlen, ttl) == 0)
+			prtinfo("Stored %s variant (%zu -> %zd bytes).",
+			    compress_name(enc), bodylen, outlen);
+
+		free(out);
+	}
+
+out:
+	free(fields);
+	free(varkey);
+}
+
+/**
+ * Hands a copy of the response to cache's worker pool for compression.
+ */
+static int
+cache_variants_submit(struct cache *c, const char *keybuf, size_t keylen,
+    uint64_t gen, struct hpack_field *hf, int nfields, const char *body,
+    size_t bodylen, int ttl)
+{
+	struct cache_variants_job *vj;
+	size_t slen;
+	char *str;
+	int i;
+
+	vj = calloc(1, sizeof(*vj));
+	if (vj == NULL) {
+		prterrno("calloc");
+		return -1;
+	}
+
+	/* Fields and their strings on a single buffer */
+	slen = 0;
+	for (i = 0; i < nfields; i++)
+		slen += hf[i].hf_namelen + hf[i].hf_valuelen;
+	vj->vj_fields = malloc(nfields * sizeof(*hf) + slen);
+	vj->vj_key = malloc(keylen);
+	vj->vj_body = malloc(bodylen);
+	if (vj->vj_fields == NULL || vj->vj_key == NULL ||
+	    vj->vj_body == NULL) {
+		prterrno("malloc");
+		goto error;
+	}
+
+	str = (char *)&vj->vj_fields[nfields];
+	for (i = 0; i < nfields; i++) {
+		vj->vj_fields[i] = hf[i];
+		vj->vj_fields[i].hf_name = memcpy(str, hf[i].hf_name,
+		    hf[i].hf_namelen);
+		str += hf[i].hf_namelen;
+		vj->vj_fields[i].hf_value = memcpy(str, hf[i].hf_value,
+		    hf[i].hf_valuelen);
+		str += hf[i].hf_valuelen;
+	}
+	vj->vj_nfields = nfields;
+	memcpy(vj->vj_key, keybuf, keylen);
+	vj->vj_keylen = keylen;
+	vj->vj_gen = gen;
+	memcpy(vj->vj_body, body, bodylen);
+	vj->vj_bodylen = bodylen;
+	vj->vj_ttl = ttl;
+	vj->vj_cache = c;
+
+	vj->vj_job.wj_work = cache_variants_work;
+	vj->vj_job.wj_done = cache_variants_done;
+	if (worker_submit(c->c_pool, &vj->vj_job) < 0) {
+		prterr("worker_submit: failure.");
+		goto error;
+	}
+
+	return 0;
+
+error:
+	free(vj->vj_fields);
+	free(vj->vj_key);
+	free(vj->vj_body);
+	free(vj);
+	return -1;
+}
+
+/**
+ * Runs on a worker thread.
+ */
+static void
+cache_variants_work(struct worker_job *job)
+{
+	struct cache_variants_job *vj;
+
+	vj = (struct cache_variants_job *)job;
+	cache_variants(vj->vj_cache, vj->vj_key, vj->vj_keylen, vj->vj_gen,
+	    vj->vj_fields, vj->vj_nfields, vj->vj_body, vj->vj_bodylen, vj->vj_ttl);
+}
+
+static void
+cache_variants_done(struct worker_job *job)
+{
+	struct cache_variants_job *vj;
+
+	vj = (struct cache_variants_job *)job;
+	free(vj->vj_fields);
+	free(vj->vj_key);
+	free(vj->vj_body);
+	free(vj);
+}
+
+/**
+ * Links entry on its bucket and right behind the clock hand. c_lock must be
+ * held.
+ */
+static void
+cache_link(struct cache *c, struct cache_entry *ce)
+{
+	struct cache_entry *_Atomic *bucket;
+
+	/* Entry is fully built before readers may reach it */
+	bucket = &c->c_buckets[ce->ce_hash & (c->c_nbuckets - 1)];
+	atomic_store_explicit(&ce->ce_next,
+	    atomic_load_explicit(bucket, memory_order_relaxed),
+	    memory_order_relaxed);
+	atomic_store_explicit(bucket, ce, memory_order_release);
+
+	if (c->c_clock == NULL) {
+		ce->ce_prev_clock = ce;
+		ce->ce_next_clock = ce;
+		c->c_clock = ce;
+	}
+	else {
+		ce->ce_next_clock = c->c_clock;
+		ce->ce_prev_clock = c->c_clock->ce_prev_clock;
+		ce->ce_prev_clock->ce_next_clock = ce;
+		c->c_clock->ce_prev_clock = ce;
+	}
+
+	c->c_size += ce->ce_size;
+}
+
+/**
+ * Unlinks entry and retires it on current epoch. c_lock must be held.
+ */
+static void
+cache_remove(struct cache *c, struct cache_entry *ce)
+{
+	struct cache_entry *_Atomic *pos;
+	unsigned epoch;
+
+	/* Bucket chain: readers going through ce still find the rest of it */
+	pos = &c->c_buckets[ce->ce_hash & (c->c_nbuckets - 1)];
+	while (atomic_load_explicit(pos, memory_order_relaxed) != ce)
+		pos = &atomic_load_explicit(pos, memory_order_relaxed)->ce_next;
+	atomic_store_explicit(pos,
+	    atomic_load_explicit(&ce->ce_next, memory_order_relaxed),
+	    memory_order_release);
+
+	/* Clock list */
+	if (ce->ce_next_clock == ce)
+		c->c_clock = NULL;
+	else {
+		ce->ce_prev_clock->ce_next_clock = ce->ce_next_clock;
+		ce->ce_next_clock->ce_prev_clock = ce->ce_prev_clock;
+		if (c->c_clock == ce)
+			c->c_clock = ce->ce_next_clock;
+	}
+
+	c->c_size -= ce->ce_size;
+
+	epoch = atomic_load(&c->c_epoch);
+	ce->ce_next_retired = c->c_retired[epoch];
+	c->c_retired[epoch] = ce;
+	atomic_store_explicit(&c->c_reclaim, 1, memory_order_relaxed);
+}
+
+/**
+ * Makes room for size bytes with the CLOCK algorithm: entries used since the
+ * hand last passed get a second chance, expired entries never do. c_lock must
+ * be held.
+ */
+static void
+cache_evict(struct cache *c, size_t size)
+{
+	struct cache_entry *ce;
+	time_t now;
+
+	now = cache_now();
+	while (c->c_clock != NULL && c->c_size + size > c->c_maxsize) {
+		ce = c->c_clock;
+		if (ce->ce_expires > now && atomic_exchange(&ce->ce_used, 0)) {
+			c->c_clock = ce->ce_next_clock;
+			continue;
+		}
+
+		prtinfo("Evicting cached response (size=%zu).", ce->ce_size);
+		cache_remove(c, ce);
+	}
+}
+
+/**
+ * Releases entries retired on the previous epoch once no lookups registered on
+ * it are left, then starts a new epoch if there is anything waiting on the
+ * current one. c_lock must be held.
+ */
+static void
+cache_reclaim(struct cache *c)
+{
+	unsigned epoch, prev;
+
+	epoch = atomic_load(&c->c_epoch);
+	prev = epoch ^ 1;
+
+	if (atomic_load(&c->c_readers[prev]) != 0)
+		return;
+
+	while (c->c_retired[prev] != NULL) {
+		struct cache_entry *next;
+
+		next = c->c_retired[prev]->ce_next_retired;
+		cache_entry_unref(c->c_retired[prev]);
+		c->c_retired[prev] = next;
+	}
+
+	if (c->c_retired[epoch] != NULL)
+		atomic_store(&c->c_epoch, prev);
+	else
+		atomic_store_explicit(&c->c_reclaim, 0, memory_order_relaxed);
+}
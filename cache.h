@@ -0,0 +1,93 @@
+/**
+ * In-memory response cache
+ *
+ * Responses are stored already encoded: a static-table-only HPACK header block
+ * (see hpack_encode()) followed by the body. Answering a request from the
+ * cache only takes framing them for its stream (see endpoint_respond_encoded());
+ * frames share the cached buffer, nothing is copied.
+ *
+ * Compressible responses also get pre-compressed variants (see compress.h),
+ * stored as entries of their own, under the response's key plus the content
+ * coding. They are produced once, on the cache's worker pool (never without
+ * one), and picked by lookups according to the request's accept-encoding.
+ * Storing a response again drops its variants; those still being compressed
+ * for the former one are discarded when done.
+ *
+ * Lookups take no locks and may be done from any thread (e.g. from frame
+ * handlers running on a worker pool); insertions and evictions are serialized
+ * by a mutex. Removed entries are only released once no lookup that could
+ * still see them is running (two-epoch reclamation); both insertions and
+ * lookups move reclamation forward, the latter only if the mutex is free.
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+/**
+ * Cache key: request's method, authority and path, plus the request header
+ * fields the response varies on. ck_accept is the request's accept-encoding
+ * (NULL if absent); it only selects among variants and is ignored when
+ * inserting.
+ */
+struct cache_key {
+	const char *ck_method;
+	const char *ck_authority;
+	const char *ck_path;
+	struct hpack_field *ck_fields;
+	int ck_nfields;
+	const char *ck_accept;
+};
+
+struct cache_entry {
+	struct cache_entry *_Atomic ce_next; /* bucket chain */
+	uint64_t ce_hash;
+	char *ce_key;
+	size_t ce_keylen;
+	time_t ce_expires; /* monotonic time in seconds */
+	size_t ce_size; /* memory accounted for this entry */
+	atomic_int ce_refcnt; /* one for the cache plus one per user */
+	atomic_int ce_used; /* referenced since last eviction sweep */
+	int ce_status;
+	char *ce_buf; /* header block followed by body */
+	size_t ce_hdrlen;
+	size_t ce_bodylen;
+	uint64_t ce_gen; /* of the identity response, for variants as well */
+
+	/* Writer-only fields */
+	struct cache_entry *ce_prev_clock; /* eviction (CLOCK) order */
+	struct cache_entry *ce_next_clock;
+	struct cache_entry *ce_next_retired;
+};
+
+struct cache {
+	struct cache_entry *_Atomic *c_buckets;
+	size_t c_nbuckets; /* power of 2 */
+
+	/* Readers in each epoch and current epoch */
+	atomic_uint c_readers[2];
+	atomic_uint c_epoch;
+
+	/* Writer side, protected by c_lock */
+	pthread_mutex_t c_lock;
+	size_t c_size;
+	size_t c_maxsize;
+	struct cache_entry *c_clock; /* next entry to be considered for eviction */
+	struct cache_entry *c_retired[2]; /* removed on each epoch */
+	atomic_int c_reclaim; /* retired entries are waiting */
+	uint64_t c_gen; /* of the last identity response stored */
+
+	struct worker_pool *c_pool; /* where variants are compressed, if set */
+};
+
+struct cache *cache_new(size_t, size_t);
+void cache_free(struct cache *);
+void cache_set_pool(struct cache *, struct worker_pool *);
+
+struct cache_entry *cache_lookup(struct cache *, struct cache_key *);
+int cache_insert(struct cache *, struct cache_key *, struct hpack_field *, int,
+    const char *, size_t, int);
+void cache_entry_unref(struct cache_entry *);
+
+int cache_entry_respond(struct cache_entry *, struct endpoint_request *);
+
+#endif /* !__CACHE_H__ */
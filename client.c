@@ -4,44 +4,80 @@
 
 #include <errno.h>
 #include <netdb.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
 #include <sys/types.h>
-#include <sys/socket.h>
 
 #include <event2/event.h>
 
+#include "libhttp2.h"
 #include "defines.h"
+#include "timer.h"
 #include "http2.h"
+#include "hpack.h"
 #include "util.h"
 
 #include "client.h"
 
+#define CLIENT_CONNS_DEFAULT 1
+
 /* libevent's structures */
 struct event_base *evbase;
 
+/* Wheel for request deadlines, if any */
+struct timer_wheel *client_timers = NULL;
+
+/* Requests not yet answered */
+static int client_pending;
+
 static void usage(void);
 
 int
 main(int argc, char *argv[])
 {
-	struct http2_connection *conn;
-	int sockfd;
+	struct timespec start, end;
+	struct pool *pool;
+	int nrequests = 1;
+	int nconns = CLIENT_CONNS_DEFAULT;
+	int nstreams = 0;
+	int timeout = 0;
 	int r;
+	int i;
 	char *host;
+	char *path = "/";
 	char *port = SERVER_PORT_DEFAULT;
 	char ch;
 
 	/* Parse arguments */
-	while ((ch = getopt(argc, argv, "hp:")) != -1) {
+	while ((ch = getopt(argc, argv, "c:hn:p:s:t:")) != -1) {
 		switch (ch) {
+		case 'c':
+			nconns = atoi(optarg);
+			if (nconns <= 0)
+				usage();
+			break;
+		case 'n':
+			nrequests = atoi(optarg);
+			if (nrequests <= 0)
+				usage();
+			break;
 		case 'p':
 			port = optarg;
 			break;
+		case 's':
+			nstreams = atoi(optarg);
+			if (nstreams <= 0)
+				usage();
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			if (timeout <= 0)
+				usage();
+			break;
 		case 'h':
 		default:
 			usage();
@@ -52,94 +88,90 @@ main(int argc, char *argv[])
 		usage();
 	}
 	host = argv[optind];
+	if (optind + 1 < argc)
+		path = argv[optind + 1];
 
 	printf("HTTP/2 client\n");
 
-	/* Opens the socket */
-	sockfd = client_connect(host, port);
-	if (sockfd < 0) {
-		prterr("client_connect: failure.");
-		exit(1);
-	}
-
 	/* Creates libevent event_base struct */
 	evbase = event_base_new();
 	if (evbase == NULL) {
-		close(sockfd);
 		prterr("event_base_new: failure.");
 		exit(1);
 	}
 
-	/* Creates a new HTTP/2 connection */
-	conn = http2_connection_new(sockfd, evbase);
-	if (conn == NULL) {
-		close(sockfd);
-		prterr("http2_connection_new: failure.");
+	/* Creates the pool of connections to the server */
+	pool = pool_new(evbase, host, port, nconns, nstreams);
+	if (pool == NULL) {
+		prterr("pool_new: failure.");
 		exit(1);
 	}
 
-	/* Sends client preface: sends starting sequence and a SETTINGS frame */
-	/* TODO send starting sequence */
-	http2_settings_send(conn, NULL, 0);
-
-	/* Dispatch events */
-	r = event_base_dispatch(evbase);
+	/* Requests time out, if requested */
+	if (timeout > 0) {
+		client_timers = timer_wheel_new(evbase, TIMER_TICK_DEFAULT);
+		if (client_timers == NULL) {
+			prterr("timer_wheel_new: failure.");
+			exit(1);
+		}
+		pool_set_timeout(pool, client_timers, timeout);
+	}
 
-	if (r < 0) {
-		prterr("event_base_dispatch: failure.");
-		http2_connection_free(conn);
+	/* Sends all requests at once; they are spread over the pool */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nrequests; i++) {
+		if (pool_request(pool, "GET", path, NULL, 0, NULL, 0,
+		    client_response, NULL) < 0) {
+			prterr("pool_request: failure.");
+			exit(1);
+		}
+		client_pending++;
 	}
 
+	/* Dispatch events until every response arrives */
+	r = 0;
+	while (client_pending > 0 && r == 0)
+		r = event_base_loop(evbase, EVLOOP_ONCE);
+	if (r < 0)
+		prterr("event_base_loop: failure.");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%d request(s) in %.3f ms\n", nrequests - client_pending,
+	    (end.tv_sec - start.tv_sec) * 1e3 +
+	    (end.tv_nsec - start.tv_nsec) / 1e6);
+
+	pool_free(pool);
+	timer_wheel_free(client_timers);
 	event_base_free(evbase);
 
 	return 0;
 }
 
-int
-client_connect(char *host, char *port)
+void
+client_response(struct pool_response *pr, void *arg)
 {
-	struct sockaddr_in *sin;
-	struct addrinfo h, *ai;
-	char ip[INET_ADDRSTRLEN];
-	int e;
-	int fd;
-
-	/* Gets local address */
-	memset(&h, 0, sizeof(h));
-	h.ai_family = AF_INET;
-	h.ai_socktype = SOCK_STREAM;
-	e = getaddrinfo(host, port, &h, &ai);
-	if (e) {
-		prterr("getaddrinfo: %s.", gai_strerror(e));
-		exit(1);
-	}
-	if (ai == NULL) {
-		prterr("getaddrinfo: no address found.");
-		exit(1);
-	}
+	int i;
 
-	/* Opens the socket and connect to the host */
-	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-	if (fd < 0) {
-		prterrno("socket");
-		exit(1);
-	}
-	if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
-		prterrno("connect");
-		exit(1);
-	}
+	client_pending--;
 
-	sin = (struct sockaddr_in *)ai->ai_addr;
-	inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
-	printf("connected to %s:%d...\n", ip, ntohs(sin->sin_port));
+	if (pr->pr_status < 0) {
+		printf("request failed\n");
+		return;
+	}
 
-	return fd;
+	printf("status %d, %d field(s), %zu byte(s) of body\n",
+	    pr->pr_status, pr->pr_nfields, pr->pr_bodylen);
+	for (i = 0; i < pr->pr_nfields; i++)
+		prtinfo("  %.*s: %.*s", (int)pr->pr_fields[i].hf_namelen,
+		    pr->pr_fields[i].hf_name,
+		    (int)pr->pr_fields[i].hf_valuelen,
+		    pr->pr_fields[i].hf_value);
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-p port] host\n", __progname);
+	fprintf(stderr, "usage: %s [-p port] [-n requests] [-c conns] "
+	    "[-s streams] [-t timeout] host [path]\n", __progname);
 	exit(1);
 }
-
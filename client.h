@@ -5,8 +5,7 @@
 #ifndef __CLIENT_H__
 #define __CLIENT_H__
 
-void client_read(evutil_socket_t, short, void *);
-int client_connect(char *, char *);
+void client_response(struct pool_response *, void *);
 
 #endif /* !__CLIENT_H__ */
 
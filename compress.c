@@ -0,0 +1,274 @@
+/**
+ * Content encodings for pre-compressed responses
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "util.h"
+
+#include "compress.h"
+
+static ssize_t compress_gzip(const char *, size_t, char **);
+#ifdef HAVE_BROTLI
+static ssize_t compress_brotli(const char *, size_t, char **);
+#endif
+#ifdef HAVE_ZSTD
+static ssize_t compress_zstd(const char *, size_t, char **);
+#endif
+
+/* Content-coding names, indexed by COMPRESS_* */
+static const char *compress_names[COMPRESS_NENCODINGS] = {
+	"identity",
+	"gzip",
+	"br",
+	"zstd",
+};
+
+/* Our preference when the client has none */
+static const int compress_preference[] = {
+	COMPRESS_BROTLI,
+	COMPRESS_ZSTD,
+	COMPRESS_GZIP,
+};
+
+const char *
+compress_name(int enc)
+{
+	if (enc < 0 || enc >= COMPRESS_NENCODINGS)
+		return NULL;
+
+	return compress_names[enc];
+}
+
+int
+compress_supported(int enc)
+{
+	switch (enc) {
+	case COMPRESS_IDENTITY:
+	case COMPRESS_GZIP:
+		return 1;
+#ifdef HAVE_BROTLI
+	case COMPRESS_BROTLI:
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Parses an accept-encoding field value and fills encs with the supported
+ * encodings it accepts (identity excluded), most preferred first. encs must
+ * have room for COMPRESS_NENCODINGS entries. Returns how many were filled.
+ */
+int
+compress_negotiate(const char *accept, int *encs)
+{
+	double q[COMPRESS_NENCODINGS];
+	double qany;
+	const char *p;
+	int nencs;
+	int i, j;
+
+	for (i = 0; i < COMPRESS_NENCODINGS; i++)
+		q[i] = -1;
+	qany = -1;
+
+	p = accept;
+	while (*p != '\0') {
+		const char *tok;
+		size_t toklen;
+		double qv;
+
+		/* Coding name */
+		while (*p == ',' || *p == ' ' || *p == '\t')
+			p++;
+		tok = p;
+		while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' &&
+		    *p != '\t')
+			p++;
+		toklen = p - tok;
+
+		/* Parameters; only the weight matters */
+		qv = 1;
+		while (*p != '\0' && *p != ',') {
+			if (*p == ';') {
+				p++;
+				while (*p == ' ' || *p == '\t')
+					p++;
+				if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=')
+					qv = strtod(&p[2], NULL);
+				continue;
+			}
+			p++;
+		}
+
+		if (toklen == 0)
+			continue;
+		if (toklen == 1 && tok[0] == '*') {
+			qany = qv;
+			continue;
+		}
+		for (i = 0; i < COMPRESS_NENCODINGS; i++) {
+			if (strlen(compress_names[i]) == toklen &&
+			    strncasecmp(compress_names[i], tok, toklen) == 0)
+				q[i] = qv;
+		}
+		if (toklen == 6 && strncasecmp("x-gzip", tok, toklen) == 0)
+			q[COMPRESS_GZIP] = qv;
+	}
+
+	/* Sorts by weight; ties keep our preference */
+	nencs = 0;
+	for (i = 0; i < sizeof(compress_preference) /
+	    sizeof(compress_preference[0]); i++) {
+		int enc;
+
+		enc = compress_preference[i];
+		if (q[enc] < 0)
+			q[enc] = qany;
+		if (q[enc] <= 0 || !compress_supported(enc))
+			continue;
+
+		for (j = nencs; j > 0 && q[encs[j - 1]] < q[enc]; j--)
+			encs[j] = encs[j - 1];
+		encs[j] = enc;
+		nencs++;
+	}
+
+	return nencs;
+}
+
+/**
+ * Compresses body with the given encoding at its highest level, as this is
+ * only done once per response. On success, out points to a malloc'd buffer
+ * and its length is returned.
+ */
+ssize_t
+compress_body(int enc, const char *in, size_t inlen, char **out)
+{
+	switch (enc) {
+	case COMPRESS_GZIP:
+		return compress_gzip(in, inlen, out);
+#ifdef HAVE_BROTLI
+	case COMPRESS_BROTLI:
+		return compress_brotli(in, inlen, out);
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return compress_zstd(in, inlen, out);
+#endif
+	default:
+		prterr("compress_body: unsupported encoding %d.", enc);
+		return -1;
+	}
+}
+
+static ssize_t
+compress_gzip(const char *in, size_t inlen, char **out)
+{
+	z_stream zs;
+	size_t bound;
+	int r;
+
+	memset(&zs, 0, sizeof(zs));
+	/* 15 + 16: largest window with gzip wrapper */
+	r = deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+	    Z_DEFAULT_STRATEGY);
+	if (r != Z_OK) {
+		prterr("deflateInit2: %d.", r);
+		return -1;
+	}
+
+	bound = deflateBound(&zs, inlen);
+	*out = malloc(bound);
+	if (*out == NULL) {
+		prterrno("malloc");
+		deflateEnd(&zs);
+		return -1;
+	}
+
+	zs.next_in = (Bytef *)in;
+	zs.avail_in = inlen;
+	zs.next_out = (Bytef *)*out;
+	zs.avail_out = bound;
+	r = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (r != Z_STREAM_END) {
+		prterr("deflate: %d.", r);
+		free(*out);
+		return -1;
+	}
+
+	return bound - zs.avail_out;
+}
+
+#ifdef HAVE_BROTLI
+static ssize_t
+compress_brotli(const char *in, size_t inlen, char **out)
+{
+	size_t outlen;
+
+	outlen = BrotliEncoderMaxCompressedSize(inlen);
+	if (outlen == 0) {
+		prterr("BrotliEncoderMaxCompressedSize: input too large.");
+		return -1;
+	}
+	*out = malloc(outlen);
+	if (*out == NULL) {
+		prterrno("malloc");
+		return -1;
+	}
+
+	if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+	    BROTLI_MODE_TEXT, inlen, (const uint8_t *)in, &outlen,
+	    (uint8_t *)*out)) {
+		prterr("BrotliEncoderCompress: failure.");
+		free(*out);
+		return -1;
+	}
+
+	return outlen;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static ssize_t
+compress_zstd(const char *in, size_t inlen, char **out)
+{
+	size_t outlen;
+
+	outlen = ZSTD_compressBound(inlen);
+	*out = malloc(outlen);
+	if (*out == NULL) {
+		prterrno("malloc");
+		return -1;
+	}
+
+	outlen = ZSTD_compress(*out, outlen, in, inlen, ZSTD_maxCLevel());
+	if (ZSTD_isError(outlen)) {
+		prterr("ZSTD_compress: %s.", ZSTD_getErrorName(outlen));
+		free(*out);
+		return -1;
+	}
+
+	return outlen;
+}
+#endif
@@ -0,0 +1,23 @@
+/**
+ * Content encodings for pre-compressed responses
+ */
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#define COMPRESS_IDENTITY 0
+#define COMPRESS_GZIP 1
+#define COMPRESS_BROTLI 2
+#define COMPRESS_ZSTD 3
+#define COMPRESS_NENCODINGS 4
+
+/* Bodies smaller than this are not worth compressing */
+#define COMPRESS_MIN_SIZE 256
+
+const char *compress_name(int);
+int compress_supported(int);
+int compress_negotiate(const char *, int *);
+
+ssize_t compress_body(int, const char *, size_t, char **);
+
+#endif /* !__COMPRESS_H__ */
@@ -3,6 +3,12 @@
 #define __DEFINES_H__
 
 #define SERVER_PORT_DEFAULT "5555"
+#define SERVER_MAX_STREAMS_DEFAULT 100
+
+/* Response cache: buckets, size in bytes and freshness in seconds */
+#define SERVER_CACHE_BUCKETS 1024
+#define SERVER_CACHE_SIZE (64 * 1024 * 1024)
+#define SERVER_CACHE_TTL 60
 
 #endif /* !__DEFINES_H__ */
 
@@ -0,0 +1,1559 @@
+/**
+ * HTTP/2 server endpoint
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+#include "util.h"
+#include "timer.h"
+#include "worker.h"
+#include "http2.h"
+#include "hpack.h"
+#include "field.h"
+#include "http1.h"
+
+#include "endpoint.h"
+
+static void endpoint_conn_closed(struct http2_connection *, void *);
+static int endpoint_conn_frame(struct http2_frame *, void *);
+static int endpoint_conn_settings(struct http2_connection *, void *);
+static int endpoint_conn_windows(struct endpoint_conn *);
+static int endpoint_conn_drain(struct http2_connection *, void *);
+static int endpoint_conn_resume(struct endpoint_conn *);
+static int endpoint_conn_credit(struct endpoint_conn *);
+static int endpoint_conn_window_update(struct endpoint_conn *, uint32_t,
+    uint32_t);
+static int endpoint_conn_rst_stream(struct endpoint_conn *, uint32_t,
+    uint32_t);
+
+static struct endpoint_request *endpoint_request_new(struct endpoint_conn *,
+    uint32_t);
+static int endpoint_request_headers(struct endpoint_conn *,
+    struct endpoint_request *, struct http2_frame *);
+static int endpoint_request_data(struct endpoint_conn *,
+    struct endpoint_request *, struct http2_frame *);
+static int endpoint_request_field(struct hpack_field *, void *);
+static int endpoint_request_discard(struct hpack_field *, void *);
+static int endpoint_response_field(struct hpack_field *, void *);
+static int endpoint_request_dispatch(struct endpoint_request *);
+static int endpoint_request_respond(struct endpoint_request *, int,
+    struct endpoint_body *, const char *, size_t);
+static int endpoint_request_send_data(struct endpoint_request *);
+static int endpoint_request_reset(struct endpoint_request *, uint32_t);
+static void endpoint_request_close(struct endpoint_request *);
+
+static void endpoint_body_unref(void *);
+
+static int endpoint_job_submit(struct endpoint *, struct endpoint_request *,
+    struct endpoint_handler *);
+static void endpoint_job_work(struct worker_job *);
+static void endpoint_job_done(struct worker_job *);
+static int endpoint_job_keep(struct endpoint_job *, int, struct hpack_field *,
+    int, const char *, size_t);
+
+/* Request being handled off-loop, and the response its handler gave */
+struct endpoint_job {
+	struct worker_job ej_job;
+	struct endpoint_request *ej_req;
+	endpoint_handler_f ej_cb;
+	void *ej_arg;
+	int ej_status; /* 0 until responded */
+	int ej_encoded; /* by endpoint_respond_encoded() */
+	struct hpack_field *ej_fields;
+	int ej_nfields;
+	const char *ej_block;
+	size_t ej_blocklen;
+	const char *ej_body;
+	size_t ej_bodylen;
+	void (*ej_release)(void *);
+	void *ej_relarg;
+	char *ej_buf; /* copies of fields and body, unless encoded */
+};
+
+/**
+ * Creates an endpoint on evbase allowing maxstreams concurrent streams on each
+ * connection.
+ */
+struct endpoint *
+endpoint_new(struct event_base *evbase, int maxstreams)
+{
+	struct endpoint *ep;
+
+	if (maxstreams <= 0)
+		return NULL;
+
+	ep = calloc(1, sizeof(*ep));
+	if (ep == NULL) {
+		prterrno("calloc");
+		return NULL;
+	}
+	ep->ep_evbase = evbase;
+	ep->ep_maxstreams = maxstreams;
+
+	return ep;
+}
+
+/**
+ * Frees endpoint, closing its connections. Requests still held by handlers
+ * stay valid until they are responded to. It must not be called from a
+ * handler.
+ */
+void
+endpoint_free(struct endpoint *ep)
+{
+	struct endpoint_handler *eh;
+
+	if (ep == NULL)
+		return;
+
+	/* Each connection leaves the list on close */
+	while (ep->ep_conns != NULL)
+		http2_connection_free(ep->ep_conns->ec_conn);
+	while (ep->ep_h1conns != NULL)
+		http1_conn_free(ep->ep_h1conns);
+
+	while ((eh = ep->ep_handlers) != NULL) {
+		ep->ep_handlers = eh->eh_next;
+		free(eh->eh_method);
+		free(eh->eh_prefix);
+		free(eh);
+	}
+
+	free(ep);
+}
+
+/**
+ * Registers cb(request, arg) as the handler of requests with method (NULL for
+ * any) and a path starting with prefix. A later registration of the same
+ * method and prefix replaces the former one. With ENDPOINT_HEAVY on flags, it
+ * runs on the endpoint's worker pool (see libhttp2.h).
+ */
+int
+endpoint_handle(struct endpoint *ep, const char *method, const char *prefix,
+    endpoint_handler_f cb, void *arg, int flags)
+{
+	struct endpoint_handler *eh;
+
+	for (eh = ep->ep_handlers; eh != NULL; eh = eh->eh_next)
+		if (strcmp(eh->eh_prefix, prefix) == 0 &&
+		    (eh->eh_method == NULL ? method == NULL : method != NULL &&
+		    strcmp(eh->eh_method, method) == 0))
+			break;
+
+	if (eh == NULL) {
+		eh = calloc(1, sizeof(*eh));
+		if (eh == NULL) {
+			prterrno("calloc");
+			return -1;
+		}
+		eh->eh_prefix = strdup(prefix);
+		if (method != NULL)
+			eh->eh_method = strdup(method);
+		if (eh->eh_prefix == NULL ||
+		    (method != NULL && eh->eh_method == NULL)) {
+			prterrno("strdup");
+			free(eh->eh_prefix);
+			free(eh->eh_method);
+			free(eh);
+			return -1;
+		}
+		eh->eh_prefixlen = strlen(prefix);
+		eh->eh_next = ep->ep_handlers;
+		ep->ep_handlers = eh;
+	}
+
+	eh->eh_cb = cb;
+	eh->eh_arg = arg;
+	eh->eh_flags = flags;
+
+	return 0;
+}
+
+/**
+ * Sets worker pool, of the endpoint's event_base, where heavy handlers run;
+ * without one, they run on the event loop as any other.
+ */
+void
+endpoint_set_pool(struct endpoint *ep, struct worker_pool *pool)
+{
+	ep->ep_pool = pool;
+}
+
+/**
+ * Sets timer wheel, of the endpoint's event_base, where the deadlines of the
+ * connections served from now on are kept: HTTP/1.1 ones time out when idle
+ * or stalled and HTTP/2 ones when SETTINGS go unacknowledged. Without one,
+ * there are none.
+ */
+void
+endpoint_set_timers(struct endpoint *ep, struct timer_wheel *tw)
+{
+	ep->ep_timers = tw;
+}
+
+/**
+ * Sets cb(connection, arg) to be called on every HTTP/2 connection attached,
+ * upgraded ones included, so that it may be tuned (adaptive frame sizing).
+ */
+void
+endpoint_set_conncb(struct endpoint *ep,
+    void (*cb)(struct http2_connection *, void *), void *arg)
+{
+	ep->ep_conncb = cb;
+	ep->ep_connarg = arg;
+}
+
+/**
+ * Serves sockfd, a connected socket, with HTTP/2 if the client starts with the
+ * connection preface and HTTP/1.1 otherwise. On failure, sockfd is left open.
+ */
+int
+endpoint_accept(struct endpoint *ep, int sockfd)
+{
+	if (http1_conn_new(ep, sockfd) == NULL) {
+		prterr("http1_conn_new: failure.");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Serves HTTP/2 on sockfd, a connected socket whose client preface is still to
+ * be received, and sends the server preface. The returned connection may still
+ * be tuned by the caller; it is freed when closed by either side or along with
+ * the endpoint, and sockfd with it. On failure, sockfd is left open.
+ */
+struct http2_connection *
+endpoint_attach(struct endpoint *ep, int sockfd)
+{
+	struct http2_connection *conn;
+
+	conn = http2_connection_new(sockfd, ep->ep_evbase);
+	if (conn == NULL) {
+		prterr("http2_connection_new: failure.");
+		return NULL;
+	}
+	http2_connection_expect_preface(conn);
+
+	if (endpoint_serve(ep, conn) < 0) {
+		prterr("endpoint_serve: failure.");
+		/* Descriptor stays with the caller */
+		conn->cn_sockfd = -1;
+		http2_connection_free(conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+/**
+ * Serves HTTP/2 on conn, a connection just created on any transport (e.g. the
+ * loopback), and sends the server preface; the client preface is only
+ * expected if the caller asked for it. On failure, conn is left for the caller
+ * to free.
+ */
+int
+endpoint_serve(struct endpoint *ep, struct http2_connection *conn)
+{
+	struct http2_setting set[2];
+	struct endpoint_conn *ec;
+
+	ec = calloc(1, sizeof(*ec));
+	if (ec == NULL) {
+		prterrno("calloc");
+		return -1;
+	}
+	ec->ec_ep = ep;
+	ec->ec_conn = conn;
+	ec->ec_window = ENDPOINT_WINDOW_DEFAULT;
+	ec->ec_recvwindow = ENDPOINT_WINDOW_DEFAULT;
+	ec->ec_initwindow = ENDPOINT_WINDOW_DEFAULT;
+
+	if (hpack_decoder_init(&ec->ec_hd, conn->cn_locsets.ss_values[
+	    HTTP2_SETTINGS_HEADER_TABLE_SIZE]) < 0) {
+		prterr("hpack_decoder_init: failure.");
+		free(ec);
+		return -1;
+	}
+	http2_connection_set_closecb(conn, endpoint_conn_closed, ec);
+	http2_connection_set_streamcb(conn, endpoint_conn_frame, ec);
+	http2_connection_set_settingscb(conn, endpoint_conn_settings, ec);
+	http2_connection_set_draincb(conn, endpoint_conn_drain, ec);
+
+	ec->ec_next = ep->ep_conns;
+	ep->ep_conns = ec;
+	ep->ep_nconns++;
+
+	/* Sends server preface: first SETTINGS frame; from now on, ec goes
+	 * along with conn */
+	set[0].set_id = HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+	set[0].set_value = ep->ep_maxstreams;
+	set[1].set_id = HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE;
+	set[1].set_value = HTTP2_HEADER_BLOCK_MAX;
+	if (http2_settings_send(conn, set, 2) < 0) {
+		prterr("http2_settings_send: failure.");
+		return -1;
+	}
+
+	if (ep->ep_timers != NULL)
+		http2_connection_set_timers(conn, ep->ep_timers);
+	if (ep->ep_conncb != NULL)
+		ep->ep_conncb(conn, ep->ep_connarg);
+
+	return 0;
+}
+
+/**
+ * Serves HTTP/2 on sockfd, whose HTTP/1.1 request er asked for an upgrade to
+ * h2c and got the 101 response: settings is the HTTP2-Settings payload, and
+ * the request, complete, goes on stream 1 (RFC 7540, Section 3.2). On failure,
+ * sockfd is left open and the request is freed.
+ */
+int
+endpoint_upgrade(struct endpoint *ep, int sockfd, struct endpoint_request *er,
+    const uint8_t *settings, size_t len)
+{
+	struct http2_connection *conn;
+	struct endpoint_conn *ec;
+
+	conn = endpoint_attach(ep, sockfd);
+	if (conn == NULL) {
+		prterr("endpoint_attach: failure.");
+		endpoint_request_free(er);
+		return -1;
+	}
+	ec = conn->cn_streamarg;
+
+	if (http2_settings_apply(conn, settings, len) < 0) {
+		prterr("http2_settings_apply: failure.");
+		endpoint_request_free(er);
+		conn->cn_sockfd = -1;
+		http2_connection_free(conn);
+		return -1;
+	}
+
+	/* No stream is open yet */
+	endpoint_conn_windows(ec);
+	er->er_id = 1;
+	er->er_conn = ec;
+	er->er_h1 = NULL;
+	er->er_window = ec->ec_initwindow;
+	er->er_next = ec->ec_streams;
+	ec->ec_streams = er;
+	ec->ec_nstreams++;
+	ec->ec_lastid = 1;
+	ec->ec_buffered += er->er_bodylen;
+
+	return endpoint_request_dispatch(er);
+}
+
+/**
+ * Answers request with status, the fields besides :status and body (copied,
+ * NULL if none). Content-length is added, as on HTTP/1.1; responses to HEAD
+ * requests keep it, for the body given, but go without the body itself, as do
+ * 204 and 304 ones. The request is released in any case, so it must not be
+ * used afterwards; -1 is returned if the response could not be sent (e.g. the
+ * stream was reset or the connection lost before).
+ */
+int
+endpoint_respond(struct endpoint_request *er, int status,
+    struct hpack_field *hf, int nfields, const char *body, size_t bodylen)
+{
+	struct endpoint_body *eb;
+	struct hpack_field *fields;
+	char code[4], lenbuf[24];
+	size_t bound;
+	ssize_t len;
+	int i, n;
+
+	/* Heavy handler: kept until back on the event loop */
+	if (er->er_job != NULL)
+		return endpoint_job_keep(er->er_job, status, hf, nfields, body,
+		    bodylen);
+
+	er->er_responded = 1;
+	if (er->er_h1 != NULL)
+		return http1_respond(er, status, hf, nfields, body, bodylen);
+	if (er->er_conn == NULL) {
+		endpoint_request_free(er);
+		return -1;
+	}
+
+	if (status < 100 || status > 999) {
+		prterr("endpoint_respond: invalid status %d.", status);
+		goto reset;
+	}
+	snprintf(code, sizeof(code), "%d", status);
+
+	fields = malloc((nfields + 2) * sizeof(*fields));
+	if (fields == NULL) {
+		prterrno("malloc");
+		goto reset;
+	}
+	n = 0;
+	fields[n++] = (struct hpack_field){ ":status", 7, code, 3 };
+	if (nfields > 0)
+		memcpy(&fields[n], hf, nfields * sizeof(*hf));
+	n += nfields;
+	if (status != 204 && status != 304)
+		fields[n++] = (struct hpack_field){ "content-length", 14, lenbuf,
+		    snprintf(lenbuf, sizeof(lenbuf), "%zu", bodylen) };
+
+	/* Header block (each field takes at most its strings plus the
+	 * integers' encoding) followed by body, on a single buffer */
+	bound = 0;
+	for (i = 0; i < n; i++)
+		bound += fields[i].hf_namelen + fields[i].hf_valuelen + 16;
+	eb = malloc(sizeof(*eb) + bound + bodylen);
+	if (eb == NULL) {
+		prterrno("malloc");
+		free(fields);
+		goto reset;
+	}
+	len = hpack_encode(fields, n, eb->eb_buf, bound);
+	free(fields);
+	if (len < 0) {
+		prterr("hpack_encode: failure.");
+		free(eb);
+		goto reset;
+	}
+	if (bodylen != 0)
+		memcpy(&eb->eb_buf[len], body, bodylen);
+	eb->eb_refcnt = 1;
+	eb->eb_data = &eb->eb_buf[len];
+	eb->eb_len = bodylen;
+	eb->eb_release = NULL;
+
+	return endpoint_request_respond(er, status, eb, eb->eb_buf, len);
+
+reset:
+	if (endpoint_request_reset(er, HTTP2_INTERNAL_ERROR) < 0)
+		prterr("endpoint_request_reset: failure.");
+	return -1;
+}
+
+/**
+ * Answers request with status and an already encoded header block, :status
+ * included, with no dynamic table references (see hpack_encode()). The block
+ * and body are not copied: release(arg) is called once neither is used
+ * anymore, which may be before this returns. Otherwise as endpoint_respond(),
+ * HEAD requests included; HTTP/1.1 ones get the header block decoded back,
+ * content-length being set by http1_respond().
+ */
+int
+endpoint_respond_encoded(struct endpoint_request *er, int status,
+    const char *block, size_t blocklen, const char *body, size_t bodylen,
+    void (*release)(void *), void *arg)
+{
+	struct endpoint_request *h1resp;
+	struct endpoint_body *eb;
+	struct hpack_decoder hd;
+	struct endpoint_job *ej;
+	int r;
+
+	/* Heavy handler: sent once back on the event loop */
+	if (er->er_job != NULL) {
+		ej = er->er_job;
+		ej->ej_status = status;
+		ej->ej_encoded = 1;
+		ej->ej_block = block;
+		ej->ej_blocklen = blocklen;
+		ej->ej_body = body;
+		ej->ej_bodylen = bodylen;
+		ej->ej_release = release;
+		ej->ej_relarg = arg;
+		return 0;
+	}
+
+	er->er_responded = 1;
+	if (er->er_h1 != NULL) {
+		/* Fields are kept on a request of their own */
+		h1resp = calloc(1, sizeof(*h1resp));
+		if (h1resp == NULL) {
+			prterrno("calloc");
+			release(arg);
+			http1_respond(er, 500, NULL, 0, NULL, 0);
+			return -1;
+		}
+		r = -1;
+		if (hpack_decoder_init(&hd, 0) == 0) {
+			r = hpack_decode(&hd, block, blocklen,
+			    endpoint_response_field, h1resp);
+			hpack_decoder_clear(&hd);
+		}
+		if (r < 0) {
+			prterr("hpack_decode: failure.");
+			http1_respond(er, 500, NULL, 0, NULL, 0);
+		}
+		else
+			r = http1_respond(er, status, h1resp->er_fields,
+			    h1resp->er_nfields, body, bodylen);
+		endpoint_request_free(h1resp);
+		release(arg);
+		return r;
+	}
+	if (er->er_conn == NULL) {
+		release(arg);
+		endpoint_request_free(er);
+		return -1;
+	}
+
+	eb = malloc(sizeof(*eb));
+	if (eb == NULL) {
+		prterrno("malloc");
+		release(arg);
+		if (endpoint_request_reset(er, HTTP2_INTERNAL_ERROR) < 0)
+			prterr("endpoint_request_reset: failure.");
+		return -1;
+	}
+	eb->eb_refcnt = 1;
+	eb->eb_data = body;
+	eb->eb_len = bodylen;
+	eb->eb_release = release;
+	eb->eb_arg = arg;
+
+	return endpoint_request_respond(er, status, eb, block, blocklen);
+}
+
+const char *
+endpoint_request_method(const struct endpoint_request *er)
+{
+	return er->er_method;
+}
+
+const char *
+endpoint_request_scheme(const struct endpoint_request *er)
+{
+	return er->er_scheme;
+}
+
+const char *
+endpoint_request_authority(const struct endpoint_request *er)
+{
+	return er->er_authority;
+}
+
+const char *
+endpoint_request_path(const struct endpoint_request *er)
+{
+	return er->er_path;
+}
+
+/**
+ * Sets fields to request's header fields and returns how many there are.
+ */
+int
+endpoint_request_fields(const struct endpoint_request *er,
+    const struct hpack_field **fields)
+{
+	*fields = er->er_fields;
+	return er->er_nfields;
+}
+
+/**
+ * Returns request's body, NULL if empty, and sets len to its length.
+ */
+const char *
+endpoint_request_body(const struct endpoint_request *er, size_t *len)
+{
+	*len = er->er_bodylen;
+	return er->er_body;
+}
+
+/**
+ * Connection is being freed: its requests are closed, those held by handlers
+ * being left for them to release.
+ */
+static void
+endpoint_conn_closed(struct http2_connection *conn, void *arg)
+{
+	struct endpoint_conn *ec, **pos;
+	struct endpoint *ep;
+
+	ec = arg;
+	ep = ec->ec_ep;
+
+	for (pos = &ep->ep_conns; *pos != ec; pos = &(*pos)->ec_next)
+		;
+	*pos = ec->ec_next;
+	ep->ep_nconns--;
+
+	while (ec->ec_streams != NULL)
+		endpoint_request_close(ec->ec_streams);
+
+	hpack_decoder_clear(&ec->ec_hd);
+	free(ec);
+}
+
+/**
+ * Handles frames on connection's streams, plus WINDOW_UPDATE.
+ */
+static int
+endpoint_conn_frame(struct http2_frame *fr, void *arg)
+{
+	struct endpoint_conn *ec;
+	struct endpoint_request *er;
+	uint32_t incr;
+	uint8_t *ptr;
+
+	ec = arg;
+
+	for (er = ec->ec_streams; er != NULL; er = er->er_next)
+		if (er->er_id == fr->fr_streamid)
+			break;
+
+	switch (fr->fr_type) {
+	case HTTP2_FRAME_HEADERS:
+		/* Blocks of closed streams must still be decoded */
+		if (endpoint_request_headers(ec, er, fr) < 0)
+			return -1;
+		break;
+
+	case HTTP2_FRAME_DATA:
+		if (endpoint_request_data(ec, er, fr) < 0)
+			return -1;
+		break;
+
+	case HTTP2_FRAME_RST_STREAM:
+		if (fr->fr_length != HTTP2_FRAME_RST_STREAM_SIZE) {
+			/* TODO connection error: FRAME_SIZE_ERROR */
+			prtinfo("(%d) Connection error: RST_STREAM frame with "
+			    "wrong frame size (size=%zu)",
+			    ec->ec_conn->cn_sockfd, fr->fr_length);
+			return -1;
+		}
+		ptr = (uint8_t *)fr->fr_buf;
+		prtinfo("(%d) Stream %u reset by peer (error=0x%x).",
+		    ec->ec_conn->cn_sockfd, fr->fr_streamid,
+		    (uint32_t)ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 |
+		    ptr[3]);
+		if (er != NULL) {
+			endpoint_request_close(er);
+			if (endpoint_conn_credit(ec) < 0)
+				return -1;
+		}
+		break;
+
+	case HTTP2_FRAME_WINDOW_UPDATE:
+		if (fr->fr_length != HTTP2_FRAME_WINDOW_UPDATE_SIZE) {
+			/* TODO connection error: FRAME_SIZE_ERROR */
+			prtinfo("(%d) Connection error: WINDOW_UPDATE frame "
+			    "with wrong frame size (size=%zu)",
+			    ec->ec_conn->cn_sockfd, fr->fr_length);
+			return -1;
+		}
+		ptr = (uint8_t *)fr->fr_buf;
+		incr = ((uint32_t)ptr[0] & 0x7F) << 24 | ptr[1] << 16 |
+		    ptr[2] << 8 | ptr[3];
+		if (fr->fr_streamid == 0) {
+			if (incr == 0 || ec->ec_window + incr >
+			    HTTP2_WINDOW_MAX) {
+				/* TODO connection error: PROTOCOL_ERROR or
+				 * FLOW_CONTROL_ERROR */
+				prtinfo("(%d) Connection error: WINDOW_UPDATE "
+				    "frame with wrong increment (%u).",
+				    ec->ec_conn->cn_sockfd, incr);
+				return -1;
+			}
+			ec->ec_window += incr;
+		}
+		else if (er != NULL) {
+			if (incr == 0 || er->er_window + incr >
+			    HTTP2_WINDOW_MAX) {
+				prtinfo("(%d) WINDOW_UPDATE frame with wrong "
+				    "increment (%u) on stream %u.",
+				    ec->ec_conn->cn_sockfd, incr, er->er_id);
+				if (endpoint_request_reset(er, incr == 0 ?
+				    HTTP2_PROTOCOL_ERROR :
+				    HTTP2_FLOW_CONTROL_ERROR) < 0)
+					return -1;
+			}
+			else
+				er->er_window += incr;
+		}
+
+		if (endpoint_conn_resume(ec) < 0)
+			return -1;
+		break;
+	}
+
+	http2_frame_free(fr);
+
+	return 0;
+}
+
+/**
+ * Peer's settings changed: bodies waiting for a larger window go on.
+ */
+static int
+endpoint_conn_settings(struct http2_connection *conn, void *arg)
+{
+	if (endpoint_conn_windows(arg) < 0)
+		return -1;
+
+	return endpoint_conn_resume(arg);
+}
+
+/**
+ * Applies a change of the peer's SETTINGS_INITIAL_WINDOW_SIZE to the windows
+ * of open streams, none of which may go past HTTP2_WINDOW_MAX.
+ */
+static int
+endpoint_conn_windows(struct endpoint_conn *ec)
+{
+	struct endpoint_request *er;
+	int64_t delta;
+
+	delta = (int64_t)ec->ec_conn->cn_remsets.ss_values[
+	    HTTP2_SETTINGS_INITIAL_WINDOW_SIZE] - ec->ec_initwindow;
+	if (delta == 0)
+		return 0;
+
+	for (er = ec->ec_streams; er != NULL; er = er->er_next) {
+		if (er->er_window + delta > HTTP2_WINDOW_MAX) {
+			/* TODO connection error: FLOW_CONTROL_ERROR */
+			prtinfo("(%d) Connection error: window of stream %u "
+			    "past its maximum.", ec->ec_conn->cn_sockfd,
+			    er->er_id);
+			return -1;
+		}
+	}
+	for (er = ec->ec_streams; er != NULL; er = er->er_next)
+		er->er_window += delta;
+	ec->ec_initwindow += delta;
+
+	return 0;
+}
+
+/**
+ * Connection wrote all it had queued after running out of sending budget.
+ */
+static int
+endpoint_conn_drain(struct http2_connection *conn, void *arg)
+{
+	return endpoint_conn_resume(arg);
+}
+
+/**
+ * Sends bodies which were waiting for the window or the sending budget;
+ * requests leave the list once theirs is sent.
+ */
+static int
+endpoint_conn_resume(struct endpoint_conn *ec)
+{
+	struct endpoint_request *er, *next;
+
+	for (er = ec->ec_streams; er != NULL; er = next) {
+		next = er->er_next;
+		if (er->er_responded && endpoint_request_send_data(er) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Gives back to the peer whatever the request bodies held leave of
+ * ENDPOINT_CONN_BODY_MAX, beyond what the connection's window already allows.
+ */
+static int
+endpoint_conn_credit(struct endpoint_conn *ec)
+{
+	int64_t room;
+
+	room = ENDPOINT_CONN_BODY_MAX - (int64_t)ec->ec_buffered -
+	    ec->ec_recvwindow;
+	if (room <= 0)
+		return 0;
+
+	ec->ec_recvwindow += room;
+	return endpoint_conn_window_update(ec, 0, room);
+}
+
+static int
+endpoint_conn_window_update(struct endpoint_conn *ec, uint32_t streamid,
+    uint32_t increment)
+{
+	struct http2_frame *fr;
+
+	fr = http2_frame_new(ec->ec_conn);
+	if (fr == NULL) {
+		prterr("http2_frame_new: failure.");
+		return -1;
+	}
+	fr->fr_type = HTTP2_FRAME_WINDOW_UPDATE;
+	fr->fr_streamid = streamid;
+	fr->fr_length = HTTP2_FRAME_WINDOW_UPDATE_SIZE;
+	fr->fr_buf = malloc(fr->fr_length);
+	if (fr->fr_buf == NULL) {
+		prterrno("malloc");
+		http2_frame_free(fr);
+		return -1;
+	}
+	fr->fr_buf[0] = (increment >> 24) & 0x7F;
+	fr->fr_buf[1] = increment >> 16;
+	fr->fr_buf[2] = increment >> 8;
+	fr->fr_buf[3] = increment;
+
+	return http2_frame_send(fr);
+}
+
+static int
+endpoint_conn_rst_stream(struct endpoint_conn *ec, uint32_t streamid,
+    uint32_t error)
+{
+	struct http2_frame *fr;
+
+	fr = http2_frame_new(ec->ec_conn);
+	if (fr == NULL) {
+		prterr("http2_frame_new: failure.");
+		return -1;
+	}
+	fr->fr_type = HTTP2_FRAME_RST_STREAM;
+	fr->fr_streamid = streamid;
+	fr->fr_length = HTTP2_FRAME_RST_STREAM_SIZE;
+	fr->fr_buf = malloc(fr->fr_length);
+	if (fr->fr_buf == NULL) {
+		prterrno("malloc");
+		http2_frame_free(fr);
+		return -1;
+	}
+	fr->fr_buf[0] = error >> 24;
+	fr->fr_buf[1] = error >> 16;
+	fr->fr_buf[2] = error >> 8;
+	fr->fr_buf[3] = error;
+
+	return http2_frame_send(fr);
+}
+
+/**
+ * Opens stream id, started by the peer, for a new request.
+ */
+static struct endpoint_request *
+endpoint_request_new(struct endpoint_conn *ec, uint32_t id)
+{
+	struct endpoint_request *er;
+
+	er = calloc(1, sizeof(*er));
+	if (er == NULL) {
+		prterrno("calloc");
+		return NULL;
+	}
+
+	er->er_id = id;
+	er->er_conn = ec;
+	er->er_window = ec->ec_initwindow;
+	er->er_recvwindow = ENDPOINT_WINDOW_DEFAULT;
+	er->er_next = ec->ec_streams;
+	ec->ec_streams = er;
+	ec->ec_nstreams++;
+
+	return er;
+}
+
+/**
+ * Handles HEADERS frame, with a whole header block, of request er, which opens
+ * a new one if er is NULL and the stream is new. Trailers add to the request's
+ * fields. Requests with malformed fields are reset.
+ */
+static int
+endpoint_request_headers(struct endpoint_conn *ec, struct endpoint_request *er,
+    struct http2_frame *fr)
+{
+	size_t pos, len;
+	int r;
+
+	/* Skips padding and priority */
+	pos = 0;
+	len = fr->fr_length;
+	if (fr->fr_flags & HTTP2_FRAME_HEADERS_PADDED) {
+		if (len < 1 || (uint8_t)fr->fr_buf[0] >= len)
+			goto protocol_error;
+		len -= 1 + (uint8_t)fr->fr_buf[0];
+		pos++;
+	}
+	if (fr->fr_flags & HTTP2_FRAME_HEADERS_PRIORITY) {
+		if (len < 5)
+			goto protocol_error;
+		len -= 5;
+		pos += 5;
+	}
+
+	/* New stream: client-initiated IDs are odd and increasing */
+	if (er == NULL && fr->fr_streamid > ec->ec_lastid) {
+		if (fr->fr_streamid % 2 == 0) {
+			/* TODO connection error: PROTOCOL_ERROR */
+			prtinfo("(%d) Connection error: stream %u opened with "
+			    "an even ID.", fr->fr_conn->cn_sockfd,
+			    fr->fr_streamid);
+			return -1;
+		}
+		ec->ec_lastid = fr->fr_streamid;
+
+		if (ec->ec_nstreams >= ec->ec_ep->ep_maxstreams) {
+			prtinfo("(%d) Stream %u refused: too many streams.",
+			    fr->fr_conn->cn_sockfd, fr->fr_streamid);
+			if (endpoint_conn_rst_stream(ec, fr->fr_streamid,
+			    HTTP2_REFUSED_STREAM) < 0)
+				return -1;
+		}
+		else {
+			er = endpoint_request_new(ec, fr->fr_streamid);
+			if (er == NULL) {
+				prterr("endpoint_request_new: failure.");
+				return -1;
+			}
+		}
+	}
+
+	/* Once the request is complete, only the header block matters */
+	if (er != NULL && er->er_ended)
+		er = NULL;
+
+	if (er != NULL)
+		er->er_listsize = 0;
+	r = hpack_decode(&ec->ec_hd, &fr->fr_buf[pos], len,
+	    er != NULL ? endpoint_request_field : endpoint_request_discard, er);
+	if (r < 0) {
+		/* TODO connection error: COMPRESSION_ERROR */
+		prtinfo("(%d) Connection error: header block could not be "
+		    "decoded.", fr->fr_conn->cn_sockfd);
+		return -1;
+	}
+	if (er == NULL)
+		return 0;
+
+	/* Trailers, if any, must not have pseudo-header fields */
+	er->er_fieldstate |= FIELD_REGULAR;
+
+	if (er->er_malformed) {
+		prtinfo("(%d) Malformed header block on stream %u.",
+		    fr->fr_conn->cn_sockfd, er->er_id);
+		return endpoint_request_reset(er, HTTP2_PROTOCOL_ERROR);
+	}
+
+	if (fr->fr_flags & HTTP2_FRAME_HEADERS_END_STREAM)
+		return endpoint_request_dispatch(er);
+
+	return 0;
+
+protocol_error:
+	/* TODO connection error: PROTOCOL_ERROR */
+	prtinfo("(%d) Connection error: HEADERS frame with wrong padding or "
+	    "priority.", fr->fr_conn->cn_sockfd);
+	return -1;
+}
+
+/**
+ * Handles DATA frame of request er (NULL if its stream is no longer open).
+ * Windows are given back as far as the bodies held stay within
+ * ENDPOINT_BODY_MAX on the stream and ENDPOINT_CONN_BODY_MAX on the
+ * connection; the rest once requests are done with.
+ */
+static int
+endpoint_request_data(struct endpoint_conn *ec, struct endpoint_request *er,
+    struct http2_frame *fr)
+{
+	size_t pos, len;
+	int64_t room;
+	int r;
+
+	pos = 0;
+	len = fr->fr_length;
+	if (fr->fr_flags & HTTP2_FRAME_DATA_PADDED) {
+		if (len < 1 || (uint8_t)fr->fr_buf[0] >= len) {
+			/* TODO connection error: PROTOCOL_ERROR */
+			prtinfo("(%d) Connection error: DATA frame with wrong "
+			    "padding.", fr->fr_conn->cn_sockfd);
+			return -1;
+		}
+		len -= 1 + (uint8_t)fr->fr_buf[0];
+		pos++;
+	}
+
+	if ((int64_t)fr->fr_length > ec->ec_recvwindow) {
+		/* TODO connection error: FLOW_CONTROL_ERROR */
+		prtinfo("(%d) Connection error: DATA frame beyond the "
+		    "connection's window.", fr->fr_conn->cn_sockfd);
+		return -1;
+	}
+	ec->ec_recvwindow -= fr->fr_length;
+
+	/* Nothing is held for closed streams */
+	if (er == NULL || er->er_ended)
+		return endpoint_conn_credit(ec);
+
+	if ((int64_t)fr->fr_length > er->er_recvwindow) {
+		prtinfo("(%d) DATA frame beyond the window of stream %u.",
+		    fr->fr_conn->cn_sockfd, er->er_id);
+		r = endpoint_request_reset(er, HTTP2_FLOW_CONTROL_ERROR);
+		return r < 0 ? r : endpoint_conn_credit(ec);
+	}
+	er->er_recvwindow -= fr->fr_length;
+
+	if (er->er_bodylen + len > ENDPOINT_BODY_MAX) {
+		prtinfo("(%d) Request body on stream %u too large.",
+		    fr->fr_conn->cn_sockfd, er->er_id);
+		r = endpoint_request_reset(er, HTTP2_CANCEL);
+		return r < 0 ? r : endpoint_conn_credit(ec);
+	}
+
+	if (len != 0) {
+		char *body;
+
+		body = realloc(er->er_body, er->er_bodylen + len);
+		if (body == NULL) {
+			prterrno("realloc");
+			return -1;
+		}
+		memcpy(&body[er->er_bodylen], &fr->fr_buf[pos], len);
+		er->er_body = body;
+		er->er_bodylen += len;
+		ec->ec_buffered += len;
+	}
+
+	if (fr->fr_flags & HTTP2_FRAME_DATA_END_STREAM) {
+		if (endpoint_request_dispatch(er) < 0)
+			return -1;
+		return endpoint_conn_credit(ec);
+	}
+
+	/* Stream's window goes a byte past ENDPOINT_BODY_MAX, for larger
+	 * bodies to be told apart */
+	room = ENDPOINT_BODY_MAX + 1 - (int64_t)er->er_bodylen -
+	    er->er_recvwindow;
+	if (room > 0) {
+		er->er_recvwindow += room;
+		if (endpoint_conn_window_update(ec, er->er_id, room) < 0)
+			return -1;
+	}
+
+	return endpoint_conn_credit(ec);
+}
+
+/**
+ * Adds a decoded field to request; pseudo-header fields are kept apart, as
+ * strings. Malformed fields, or those beyond the header list size we take,
+ * mark the request as malformed instead, decoding going on.
+ */
+static int
+endpoint_request_field(struct hpack_field *hf, void *arg)
+{
+	struct endpoint_request *er;
+	char **pseudo;
+	int r;
+
+	er = arg;
+
+	if (er->er_malformed)
+		return 0;
+
+	er->er_listsize += hf->hf_namelen + hf->hf_valuelen +
+	    HPACK_ENTRY_OVERHEAD;
+	r = field_check(hf, FIELD_REQUEST, &er->er_fieldstate);
+	if (r < 0 || er->er_listsize >
+	    http2_connection_header_max(er->er_conn->ec_conn)) {
+		er->er_malformed = 1;
+		return 0;
+	}
+
+	if (r > 0) {
+		switch (r) {
+		case FIELD_METHOD:
+			pseudo = &er->er_method;
+			break;
+		case FIELD_SCHEME:
+			pseudo = &er->er_scheme;
+			break;
+		case FIELD_AUTHORITY:
+			pseudo = &er->er_authority;
+			break;
+		default:
+			pseudo = &er->er_path;
+			break;
+		}
+
+		*pseudo = malloc(hf->hf_valuelen + 1);
+		if (*pseudo == NULL) {
+			prterrno("malloc");
+			return -1;
+		}
+		memcpy(*pseudo, hf->hf_value, hf->hf_valuelen);
+		(*pseudo)[hf->hf_valuelen] = '\0';
+		return 0;
+	}
+
+	return endpoint_request_add(er, hf);
+}
+
+/**
+ * Adds a regular field to request, name and value copied together.
+ */
+int
+endpoint_request_add(struct endpoint_request *er, struct hpack_field *hf)
+{
+	char *str;
+
+	if (er->er_nfields == er->er_nfieldsmax) {
+		struct hpack_field *fields;
+		int n;
+
+		n = er->er_nfieldsmax == 0 ? 8 : er->er_nfieldsmax * 2;
+		fields = realloc(er->er_fields, n * sizeof(*fields));
+		if (fields == NULL) {
+			prterrno("realloc");
+			return -1;
+		}
+		er->er_fields = fields;
+		er->er_nfieldsmax = n;
+	}
+
+	str = malloc(hf->hf_namelen + hf->hf_valuelen);
+	if (str == NULL && hf->hf_namelen + hf->hf_valuelen != 0) {
+		prterrno("malloc");
+		return -1;
+	}
+	memcpy(str, hf->hf_name, hf->hf_namelen);
+	memcpy(&str[hf->hf_namelen], hf->hf_value, hf->hf_valuelen);
+
+	er->er_fields[er->er_nfields].hf_name = str;
+	er->er_fields[er->er_nfields].hf_namelen = hf->hf_namelen;
+	er->er_fields[er->er_nfields].hf_value = &str[hf->hf_namelen];
+	er->er_fields[er->er_nfields].hf_valuelen = hf->hf_valuelen;
+	er->er_nfields++;
+
+	return 0;
+}
+
+static int
+endpoint_request_discard(struct hpack_field *hf, void *arg)
+{
+	return 0;
+}
+
+/**
+ * Keeps a decoded response field for HTTP/1.1, but pseudo-header fields and
+ * content-length.
+ */
+static int
+endpoint_response_field(struct hpack_field *hf, void *arg)
+{
+	if ((hf->hf_namelen > 0 && hf->hf_name[0] == ':') ||
+	    (hf->hf_namelen == 14 &&
+	    memcmp(hf->hf_name, "content-length", 14) == 0))
+		return 0;
+
+	return endpoint_request_add(arg, hf);
+}
+
+/**
+ * Request is complete: it is routed, unless malformed (without :method,
+ * :scheme or :path), in which case it is reset.
+ */
+static int
+endpoint_request_dispatch(struct endpoint_request *er)
+{
+	er->er_ended = 1;
+
+	if (er->er_method == NULL || er->er_scheme == NULL ||
+	    er->er_path == NULL) {
+		prtinfo("(%d) Malformed request on stream %u.",
+		    er->er_conn->ec_conn->cn_sockfd, er->er_id);
+		return endpoint_request_reset(er, HTTP2_PROTOCOL_ERROR);
+	}
+
+	prtinfo("(%d) Request %s %s on stream %u.",
+	    er->er_conn->ec_conn->cn_sockfd, er->er_method, er->er_path,
+	    er->er_id);
+
+	/* Failures to respond only concern the stream */
+	er->er_dispatched = 1;
+	endpoint_route(er->er_conn->ec_ep, er);
+
+	return 0;
+}
+
+/**
+ * Hands complete request to the handler for its method and the longest
+ * matching prefix of its path, or answers it with 404 if there is none.
+ */
+void
+endpoint_route(struct endpoint *ep, struct endpoint_request *er)
+{
+	struct endpoint_handler *eh, *best;
+
+	best = NULL;
+	for (eh = ep->ep_handlers; eh != NULL; eh = eh->eh_next) {
+		if (eh->eh_method != NULL &&
+		    strcmp(eh->eh_method, er->er_method) != 0)
+			continue;
+		if (strncmp(eh->eh_prefix, er->er_path, eh->eh_prefixlen) != 0)
+			continue;
+		if (best == NULL || eh->eh_prefixlen > best->eh_prefixlen ||
+		    (eh->eh_prefixlen == best->eh_prefixlen &&
+		    best->eh_method == NULL))
+			best = eh;
+	}
+
+	if (best == NULL)
+		endpoint_respond(er, 404, NULL, 0, NULL, 0);
+	else if ((best->eh_flags & ENDPOINT_HEAVY) && ep->ep_pool != NULL) {
+		if (endpoint_job_submit(ep, er, best) < 0) {
+			prterr("endpoint_job_submit: failure.");
+			endpoint_respond(er, 500, NULL, 0, NULL, 0);
+		}
+	}
+	else
+		best->eh_cb(er, best->eh_arg);
+}
+
+/**
+ * Sends response to er, with status: header block on a HEADERS frame, plus
+ * CONTINUATION ones for what does not fit on the smallest maximum frame size
+ * any peer accepts, then body eb, unless the response goes without. eb's
+ * reference is taken over, and frames share its buffers.
+ */
+static int
+endpoint_request_respond(struct endpoint_request *er, int status,
+    struct endpoint_body *eb, const char *block, size_t blocklen)
+{
+	struct endpoint_conn *ec;
+	struct http2_frame *fr;
+	size_t pos;
+	int nobody;
+
+	ec = er->er_conn;
+	nobody = strcmp(er->er_method, "HEAD") == 0 || status == 204 ||
+	    status == 304 || eb->eb_len == 0;
+
+	pos = 0;
+	do {
+		fr = http2_frame_new(ec->ec_conn);
+		if (fr == NULL) {
+			prterr("http2_frame_new: failure.");
+			endpoint_body_unref(eb);
+			goto reset;
+		}
+		fr->fr_type = pos == 0 ? HTTP2_FRAME_HEADERS :
+		    HTTP2_FRAME_CONTINUATION;
+		fr->fr_streamid = er->er_id;
+		fr->fr_length = blocklen - pos;
+		if (fr->fr_length > HTTP2_FRAME_MAX_SIZE_DEFAULT)
+			fr->fr_length = HTTP2_FRAME_MAX_SIZE_DEFAULT;
+		fr->fr_buf = (char *)&block[pos];
+		fr->fr_buffree = endpoint_body_unref;
+		fr->fr_bufarg = eb;
+		eb->eb_refcnt++;
+		if (pos == 0 && nobody)
+			fr->fr_flags |= HTTP2_FRAME_HEADERS_END_STREAM;
+		pos += fr->fr_length;
+		if (pos == blocklen)
+			fr->fr_flags |= HTTP2_FRAME_HEADERS_END_HEADERS;
+
+		/* Nothing goes between the frames of a header block */
+		if (http2_frame_send(fr) < 0) {
+			prterr("http2_frame_send: failure.");
+			endpoint_body_unref(eb);
+			goto reset;
+		}
+	} while (pos < blocklen);
+
+	if (nobody)
+		endpoint_body_unref(eb);
+	else
+		er->er_resp = eb;
+
+	prtinfo("(%d) Response %d on stream %u.", ec->ec_conn->cn_sockfd,
+	    status, er->er_id);
+
+	/* Request stays on the connection until its body is fully sent */
+	if (endpoint_request_send_data(er) < 0) {
+		prterr("endpoint_request_send_data: failure.");
+		goto reset;
+	}
+
+	return 0;
+
+reset:
+	if (endpoint_request_reset(er, HTTP2_INTERNAL_ERROR) < 0)
+		prterr("endpoint_request_reset: failure.");
+	return -1;
+}
+
+/**
+ * Sends what is left of response's body on DATA frames, as far as the stream
+ * and connection windows allow, closing the request once it is all sent.
+ */
+static int
+endpoint_request_send_data(struct endpoint_request *er)
+{
+	struct endpoint_conn *ec;
+	struct endpoint_body *eb;
+	ssize_t budget;
+
+	ec = er->er_conn;
+	eb = er->er_resp;
+
+	while (eb != NULL && er->er_resppos < eb->eb_len) {
+		struct http2_frame *fr;
+		size_t len;
+
+		len = eb->eb_len - er->er_resppos;
+		if (len > ec->ec_conn->cn_txmaxframe)
+			len = ec->ec_conn->cn_txmaxframe;
+		if (er->er_window < (int64_t)len)
+			len = er->er_window < 0 ? 0 : er->er_window;
+		if (ec->ec_window < (int64_t)len)
+			len = ec->ec_window < 0 ? 0 : ec->ec_window;
+		if (len == 0)
+			return 0;
+
+		/* Sized to what may be written right away, so that frames
+		 * queued later do not wait behind it; the drain callback
+		 * comes back if nothing may */
+		budget = http2_connection_data_budget(ec->ec_conn);
+		if (budget < 0) {
+			prterr("http2_connection_data_budget: failure.");
+			return -1;
+		}
+		if ((size_t)budget < len)
+			len = budget;
+		if (len == 0)
+			return 0;
+
+		fr = http2_frame_new(ec->ec_conn);
+		if (fr == NULL) {
+			prterr("http2_frame_new: failure.");
+			return -1;
+		}
+		fr->fr_type = HTTP2_FRAME_DATA;
+		fr->fr_streamid = er->er_id;
+		fr->fr_length = len;
+		fr->fr_buf = (char *)&eb->eb_data[er->er_resppos];
+		fr->fr_buffree = endpoint_body_unref;
+		fr->fr_bufarg = eb;
+		eb->eb_refcnt++;
+
+		er->er_resppos += len;
+		er->er_window -= len;
+		ec->ec_window -= len;
+		if (er->er_resppos == eb->eb_len)
+			fr->fr_flags = HTTP2_FRAME_DATA_END_STREAM;
+
+		if (http2_frame_send(fr) < 0) {
+			prterr("http2_frame_send: failure.");
+			return -1;
+		}
+	}
+
+	endpoint_request_close(er);
+
+	return endpoint_conn_credit(ec);
+}
+
+/**
+ * Resets request's stream and closes it.
+ */
+static int
+endpoint_request_reset(struct endpoint_request *er, uint32_t error)
+{
+	struct endpoint_conn *ec;
+	int r;
+
+	ec = er->er_conn;
+	r = endpoint_conn_rst_stream(ec, er->er_id, error);
+	endpoint_request_close(er);
+	if (r < 0)
+		return r;
+
+	return endpoint_conn_credit(ec);
+}
+
+/**
+ * Takes request off its connection, which no longer holds its body. It is
+ * freed unless its handler still holds it, in which case endpoint_respond()
+ * will.
+ */
+static void
+endpoint_request_close(struct endpoint_request *er)
+{
+	struct endpoint_conn *ec;
+	struct endpoint_request **pos;
+
+	ec = er->er_conn;
+	for (pos = &ec->ec_streams; *pos != er; pos = &(*pos)->er_next)
+		;
+	*pos = er->er_next;
+	ec->ec_nstreams--;
+	ec->ec_buffered -= er->er_bodylen;
+	er->er_conn = NULL;
+
+	if (!er->er_dispatched || er->er_responded)
+		endpoint_request_free(er);
+}
+
+void
+endpoint_request_free(struct endpoint_request *er)
+{
+	int i;
+
+	for (i = 0; i < er->er_nfields; i++)
+		free((char *)er->er_fields[i].hf_name);
+	free(er->er_fields);
+	free(er->er_method);
+	free(er->er_scheme);
+	free(er->er_authority);
+	free(er->er_path);
+	free(er->er_body);
+	if (er->er_resp != NULL)
+		endpoint_body_unref(er->er_resp);
+	free(er);
+}
+
+static void
+endpoint_body_unref(void *arg)
+{
+	struct endpoint_body *eb;
+
+	eb = arg;
+	if (--eb->eb_refcnt != 0)
+		return;
+
+	if (eb->eb_release != NULL)
+		eb->eb_release(eb->eb_arg);
+	free(eb);
+}
+
+/**
+ * Runs heavy handler eh on the endpoint's worker pool. Until it is done, the
+ * request stays with it: a stream reset or a connection lost meanwhile only
+ * leaves er_conn or er_h1 NULL, which the handler does not read.
+ */
+static int
+endpoint_job_submit(struct endpoint *ep, struct endpoint_request *er,
+    struct endpoint_handler *eh)
+{
+	struct endpoint_job *ej;
+
+	ej = calloc(1, sizeof(*ej));
+	if (ej == NULL) {
+		prterrno("calloc");
+		return -1;
+	}
+	ej->ej_job.wj_work = endpoint_job_work;
+	ej->ej_job.wj_done = endpoint_job_done;
+	ej->ej_req = er;
+	ej->ej_cb = eh->eh_cb;
+	ej->ej_arg = eh->eh_arg;
+
+	er->er_job = ej;
+	if (worker_submit(ep->ep_pool, &ej->ej_job) < 0) {
+		prterr("worker_submit: failure.");
+		er->er_job = NULL;
+		free(ej);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Runs on a worker thread.
+ */
+static void
+endpoint_job_work(struct worker_job *job)
+{
+	struct endpoint_job *ej;
+
+	ej = (struct endpoint_job *)job;
+	ej->ej_cb(ej->ej_req, ej->ej_arg);
+}
+
+/**
+ * Runs back on the event loop, where the response kept is sent.
+ */
+static void
+endpoint_job_done(struct worker_job *job)
+{
+	struct endpoint_request *er;
+	struct endpoint_job *ej;
+
+	ej = (struct endpoint_job *)job;
+	er = ej->ej_req;
+	er->er_job = NULL;
+
+	if (ej->ej_status == 0) {
+		prterr("Heavy handler of %s %s gave no response.",
+		    er->er_method, er->er_path);
+		endpoint_respond(er, 500, NULL, 0, NULL, 0);
+	}
+	else if (ej->ej_encoded)
+		endpoint_respond_encoded(er, ej->ej_status, ej->ej_block,
+		    ej->ej_blocklen, ej->ej_body, ej->ej_bodylen,
+		    ej->ej_release, ej->ej_relarg);
+	else
+		endpoint_respond(er, ej->ej_status, ej->ej_fields,
+		    ej->ej_nfields, ej->ej_body, ej->ej_bodylen);
+
+	free(ej->ej_buf);
+	free(ej);
+}
+
+/**
+ * Keeps response given on a worker thread, copying fields and body, the
+ * caller's buffers being gone by the time it is sent. If it cannot, a 500
+ * response is kept instead.
+ */
+static int
+endpoint_job_keep(struct endpoint_job *ej, int status, struct hpack_field *hf,
+    int nfields, const char *body, size_t bodylen)
+{
+	struct hpack_field *fields;
+	size_t size;
+	char *p;
+	int i;
+
+	size = nfields * sizeof(*hf) + bodylen + 1;
+	for (i = 0; i < nfields; i++)
+		size += hf[i].hf_namelen + hf[i].hf_valuelen;
+	ej->ej_buf = malloc(size);
+	if (ej->ej_buf == NULL) {
+		prterrno("malloc");
+		ej->ej_status = 500;
+		return -1;
+	}
+
+	/* Field array, then their strings, then body */
+	fields = (struct hpack_field *)ej->ej_buf;
+	p = &ej->ej_buf[nfields * sizeof(*hf)];
+	for (i = 0; i < nfields; i++) {
+		fields[i] = hf[i];
+		fields[i].hf_name = p;
+		memcpy(p, hf[i].hf_name, hf[i].hf_namelen);
+		p += hf[i].hf_namelen;
+		fields[i].hf_value = p;
+		if (hf[i].hf_valuelen != 0)
+			memcpy(p, hf[i].hf_value, hf[i].hf_valuelen);
+		p += hf[i].hf_valuelen;
+	}
+	if (bodylen != 0)
+		memcpy(p, body, bodylen);
+
+	ej->ej_status = status;
+	ej->ej_fields = fields;
+	ej->ej_nfields = nfields;
+	ej->ej_body = body != NULL ? p : NULL;
+	ej->ej_bodylen = bodylen;
+
+	return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * HTTP/2 server endpoint
+ *
+ * Internals of the endpoint, whose interface is part of libhttp2.h.
+ * Connections handed over with endpoint_accept() may also speak HTTP/1.1
+ * (see http1.h), their requests going to the same handlers.
+ */
+
+#ifndef __ENDPOINT_H__
+#define __ENDPOINT_H__
+
+/* Initial flow-control window of connections and streams */
+#define ENDPOINT_WINDOW_DEFAULT 65535
+
+/* Largest request body accepted; streams with larger ones are reset */
+#define ENDPOINT_BODY_MAX (16 * 1024 * 1024)
+
+/* Request body bytes held per connection, which its window never goes past;
+ * more than ENDPOINT_BODY_MAX, so that no single stream may take it all */
+#define ENDPOINT_CONN_BODY_MAX (2 * ENDPOINT_BODY_MAX)
+
+/**
+ * Request
+ *
+ * Handed to the handler once complete (see libhttp2.h); er_conn is NULL once
+ * the stream is reset or the connection lost.
+ */
+struct endpoint_request {
+	uint32_t er_id;
+	struct endpoint_conn *er_conn;
+	char *er_method;
+	char *er_scheme;
+	char *er_authority; /* NULL if absent */
+	char *er_path;
+	struct hpack_field *er_fields;
+	int er_nfields;
+	int er_nfieldsmax; /* room on er_fields */
+	int er_fieldstate; /* see field_check() */
+	size_t er_listsize; /* of the header block being decoded */
+	int er_malformed; /* some field was invalid */
+	char *er_body;
+	size_t er_bodylen;
+	int er_ended; /* END_STREAM received */
+	int er_dispatched; /* handed to its handler */
+	struct endpoint_job *er_job; /* heavy handler's, while it runs */
+	int er_responded;
+	struct endpoint_body *er_resp; /* response body, until sent */
+	size_t er_resppos; /* body bytes already on DATA frames */
+	int64_t er_window; /* stream's sending window */
+	int64_t er_recvwindow; /* peer's sending window on stream */
+	struct http1_conn *er_h1; /* HTTP/1.1 connection it came on, if any */
+	struct endpoint_request *er_next;
+};
+
+/* Response's header block and body, shared by the frames carrying them */
+struct endpoint_body {
+	int eb_refcnt;
+	const char *eb_data; /* body */
+	size_t eb_len;
+	void (*eb_release)(void *); /* if buffers are the caller's */
+	void *eb_arg;
+	char eb_buf[]; /* header block and body, unless the caller's */
+};
+
+struct endpoint_handler {
+	char *eh_method; /* NULL for any */
+	char *eh_prefix;
+	size_t eh_prefixlen;
+	endpoint_handler_f eh_cb;
+	void *eh_arg;
+	int eh_flags; /* ENDPOINT_HEAVY */
+	struct endpoint_handler *eh_next;
+};
+
+struct endpoint_conn {
+	struct endpoint *ec_ep;
+	struct http2_connection *ec_conn;
+	struct hpack_decoder ec_hd;
+	struct endpoint_request *ec_streams;
+	int ec_nstreams;
+	uint32_t ec_lastid; /* highest stream opened by the peer */
+	int64_t ec_window; /* connection's sending window */
+	int64_t ec_recvwindow; /* peer's sending window */
+	size_t ec_buffered; /* bytes of request bodies held */
+	uint32_t ec_initwindow; /* peer's SETTINGS_INITIAL_WINDOW_SIZE applied */
+	struct endpoint_conn *ec_next;
+};
+
+struct endpoint {
+	struct event_base *ep_evbase;
+	int ep_maxstreams; /* concurrent streams per connection */
+	struct endpoint_handler *ep_handlers;
+	struct endpoint_conn *ep_conns;
+	int ep_nconns;
+	struct http1_conn *ep_h1conns;
+	void (*ep_conncb)(struct http2_connection *, void *);
+	void *ep_connarg;
+	struct worker_pool *ep_pool; /* for heavy handlers, if any */
+	struct timer_wheel *ep_timers; /* deadlines, if any */
+};
+
+int endpoint_serve(struct endpoint *, struct http2_connection *);
+int endpoint_upgrade(struct endpoint *, int, struct endpoint_request *,
+    const uint8_t *, size_t);
+void endpoint_route(struct endpoint *, struct endpoint_request *);
+int endpoint_request_add(struct endpoint_request *, struct hpack_field *);
+void endpoint_request_free(struct endpoint_request *);
+
+#endif /* !__ENDPOINT_H__ */
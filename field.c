@@ -0,0 +1,276 @@
+/**
+ * Header field validation
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FIELD_AVX2
+#endif
+
+#include "libhttp2.h"
+#include "hpack.h"
+
+#include "field.h"
+
+static ssize_t field_name_scan(const char *, size_t);
+static ssize_t field_value_scan(const char *, size_t);
+#ifdef __SSE2__
+static ssize_t field_name_sse2(const char *, size_t);
+static ssize_t field_value_sse2(const char *, size_t);
+#endif
+#ifdef FIELD_AVX2
+static ssize_t field_name_avx2(const char *, size_t);
+static ssize_t field_value_avx2(const char *, size_t);
+#endif
+
+/* Names of pseudo-header fields, without the colon */
+static const struct {
+	const char *fp_name;
+	size_t fp_len;
+	int fp_bit;
+} field_pseudo[] = {
+	{ "method", 6, FIELD_METHOD },
+	{ "scheme", 6, FIELD_SCHEME },
+	{ "authority", 9, FIELD_AUTHORITY },
+	{ "path", 4, FIELD_PATH },
+	{ "status", 6, FIELD_STATUS },
+};
+
+/**
+ * Checks a decoded field of a header block, given the pseudo-header fields
+ * allowed on it and the block's state so far (0 at its start, FIELD_REGULAR
+ * for trailers), which is updated.
+ *
+ * Pseudo-header fields must be known, allowed, come before any regular field
+ * and appear only once. Returns the field's FIELD_* bit if it is one of them,
+ * 0 for a valid regular field and -1 if the field is malformed.
+ */
+int
+field_check(struct hpack_field *hf, int allowed, int *state)
+{
+	int i;
+
+	if (hf->hf_namelen > 0 && hf->hf_name[0] == ':') {
+		for (i = 0; i < sizeof(field_pseudo) / sizeof(field_pseudo[0]);
+		    i++)
+			if (hf->hf_namelen - 1 == field_pseudo[i].fp_len &&
+			    memcmp(&hf->hf_name[1], field_pseudo[i].fp_name,
+			    field_pseudo[i].fp_len) == 0)
+				break;
+		if (i == sizeof(field_pseudo) / sizeof(field_pseudo[0]))
+			return -1;
+
+		if (!(field_pseudo[i].fp_bit & allowed) ||
+		    *state & (field_pseudo[i].fp_bit | FIELD_REGULAR) ||
+		    field_value_check(hf->hf_value, hf->hf_valuelen) < 0)
+			return -1;
+
+		*state |= field_pseudo[i].fp_bit;
+		return field_pseudo[i].fp_bit;
+	}
+
+	if (field_name_check(hf->hf_name, hf->hf_namelen) < 0 ||
+	    field_value_check(hf->hf_value, hf->hf_valuelen) < 0)
+		return -1;
+
+	*state |= FIELD_REGULAR;
+	return 0;
+}
+
+/**
+ * Names of regular fields must not be empty nor hold uppercase letters,
+ * controls, space, colons, DEL or non-ASCII octets.
+ */
+int
+field_name_check(const char *name, size_t len)
+{
+	if (len == 0)
+		return -1;
+
+	return field_name_scan(name, len) < 0 ? -1 : 0;
+}
+
+/**
+ * Values must not hold NUL, CR or LF, nor start or end with whitespace.
+ */
+int
+field_value_check(const char *value, size_t len)
+{
+	if (len > 0 && (value[0] == ' ' || value[0] == '\t' ||
+	    value[len - 1] == ' ' || value[len - 1] == '\t'))
+		return -1;
+
+	return field_value_scan(value, len) < 0 ? -1 : 0;
+}
+
+/**
+ * Scans the widest chunks first, then what is left a byte at a time. Returns
+ * -1 on the first forbidden octet found.
+ */
+static ssize_t
+field_name_scan(const char *s, size_t len)
+{
+	ssize_t n;
+	size_t i;
+
+	i = 0;
+#ifdef FIELD_AVX2
+	if (len >= 32 && __builtin_cpu_supports("avx2")) {
+		n = field_name_avx2(s, len);
+		if (n < 0)
+			return -1;
+		i += n;
+	}
+#endif
+#ifdef __SSE2__
+	if (len - i >= 16) {
+		n = field_name_sse2(&s[i], len - i);
+		if (n < 0)
+			return -1;
+		i += n;
+	}
+#endif
+
+	for (; i < len; i++) {
+		uint8_t c;
+
+		c = s[i];
+		if (c <= 0x20 || c >= 0x7F || (c >= 'A' && c <= 'Z') ||
+		    c == ':')
+			return -1;
+	}
+
+	return len;
+}
+
+static ssize_t
+field_value_scan(const char *s, size_t len)
+{
+	ssize_t n;
+	size_t i;
+
+	i = 0;
+#ifdef FIELD_AVX2
+	if (len >= 32 && __builtin_cpu_supports("avx2")) {
+		n = field_value_avx2(s, len);
+		if (n < 0)
+			return -1;
+		i += n;
+	}
+#endif
+#ifdef __SSE2__
+	if (len - i >= 16) {
+		n = field_value_sse2(&s[i], len - i);
+		if (n < 0)
+			return -1;
+		i += n;
+	}
+#endif
+
+	for (; i < len; i++)
+		if (s[i] == '\0' || s[i] == '\r' || s[i] == '\n')
+			return -1;
+
+	return len;
+}
+
+#ifdef __SSE2__
+/**
+ * Kernels take whole chunks only and return how many bytes they scanned, or
+ * -1. Octets are compared as signed: those from 0x80 up are negative, so they
+ * fall below 0x21 along with controls and space, and uppercase letters are
+ * moved to the bottom of the signed range to be found with one comparison.
+ */
+static ssize_t
+field_name_sse2(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v, bad;
+
+		v = _mm_loadu_si128((const __m128i *)&s[i]);
+		bad = _mm_cmplt_epi8(v, _mm_set1_epi8(0x21));
+		bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+		bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8(':')));
+		bad = _mm_or_si128(bad, _mm_cmplt_epi8(_mm_add_epi8(v,
+		    _mm_set1_epi8(0x80 - 'A')), _mm_set1_epi8(-128 + 26)));
+		if (_mm_movemask_epi8(bad) != 0)
+			return -1;
+	}
+
+	return i;
+}
+
+static ssize_t
+field_value_sse2(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v, bad;
+
+		v = _mm_loadu_si128((const __m128i *)&s[i]);
+		bad = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+		bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+		bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+		if (_mm_movemask_epi8(bad) != 0)
+			return -1;
+	}
+
+	return i;
+}
+#endif
+
+#ifdef FIELD_AVX2
+__attribute__((target("avx2")))
+static ssize_t
+field_name_avx2(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v, bad;
+
+		v = _mm256_loadu_si256((const __m256i *)&s[i]);
+		bad = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x21), v);
+		bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(v,
+		    _mm256_set1_epi8(0x7F)));
+		bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(v,
+		    _mm256_set1_epi8(':')));
+		bad = _mm256_or_si256(bad, _mm256_cmpgt_epi8(
+		    _mm256_set1_epi8(-128 + 26), _mm256_add_epi8(v,
+		    _mm256_set1_epi8(0x80 - 'A'))));
+		if (_mm256_movemask_epi8(bad) != 0)
+			return -1;
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static ssize_t
+field_value_avx2(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v, bad;
+
+		v = _mm256_loadu_si256((const __m256i *)&s[i]);
+		bad = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+		bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(v,
+		    _mm256_set1_epi8('\r')));
+		bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(v,
+		    _mm256_set1_epi8('\n')));
+		if (_mm256_movemask_epi8(bad) != 0)
+			return -1;
+	}
+
+	return i;
+}
+#endif
@@ -0,0 +1,32 @@
+/**
+ * Header field validation (RFC 9113, Section 8.2)
+ *
+ * Names and values are scanned 32 or 16 bytes at a time with AVX2 or SSE2,
+ * whichever the CPU has, falling back to a byte at a time elsewhere.
+ */
+
+#ifndef __FIELD_H__
+#define __FIELD_H__
+
+/**
+ * Pseudo-header fields, as bits of the state kept over a header block by
+ * field_check(), which also has FIELD_REGULAR set once a regular field was
+ * seen.
+ */
+#define FIELD_METHOD 0x01
+#define FIELD_SCHEME 0x02
+#define FIELD_AUTHORITY 0x04
+#define FIELD_PATH 0x08
+#define FIELD_STATUS 0x10
+#define FIELD_REGULAR 0x20
+
+/* Pseudo-header fields allowed on requests and responses */
+#define FIELD_REQUEST (FIELD_METHOD | FIELD_SCHEME | FIELD_AUTHORITY | \
+    FIELD_PATH)
+#define FIELD_RESPONSE FIELD_STATUS
+
+int field_check(struct hpack_field *, int, int *);
+int field_name_check(const char *, size_t);
+int field_value_check(const char *, size_t);
+
+#endif /* !__FIELD_H__ */
@@ -0,0 +1,599 @@
+/**
+ * HPACK header compression (RFC 7541)
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "libhttp2.h"
+#include "util.h"
+
+#include "hpack.h"
+
+static ssize_t hpack_encode_int(uint32_t, int, uint8_t, char *, size_t);
+static ssize_t hpack_encode_string(const char *, size_t, char *, size_t);
+static int hpack_static_find(struct hpack_field *, int *);
+
+static ssize_t hpack_decode_int(const uint8_t *, size_t, int, uint32_t *);
+static ssize_t hpack_decode_string(const uint8_t *, size_t, char **,
+    const char **, size_t *);
+static ssize_t hpack_huffman_decode(const uint8_t *, size_t, char *);
+static int hpack_decoder_get(struct hpack_decoder *, uint32_t,
+    struct hpack_field *);
+static int hpack_decoder_add(struct hpack_decoder *, struct hpack_field *);
+static void hpack_decoder_evict(struct hpack_decoder *, size_t);
+
+#define HPACK_FIELD(name, value) \
+	{ name, sizeof(name) - 1, value, sizeof(value) - 1 }
+
+/* Static table (RFC 7541, Appendix A); index 0 is not used */
+static struct hpack_field hpack_static_table[HPACK_STATIC_TABLE_SIZE + 1] = {
+	{ NULL, 0, NULL, 0 },
+	HPACK_FIELD(":authority", ""),
+	HPACK_FIELD(":method", "GET"),
+	HPACK_FIELD(":method", "POST"),
+	HPACK_FIELD(":path", "/"),
+	HPACK_FIELD(":path", "/index.html"),
+	HPACK_FIELD(":scheme", "http"),
+	HPACK_FIELD(":scheme", "https"),
+	HPACK_FIELD(":status", "200"),
+	HPACK_FIELD(":status", "204"),
+	HPACK_FIELD(":status", "206"),
+	HPACK_FIELD(":status", "304"),
+	HPACK_FIELD(":status", "400"),
+	HPACK_FIELD(":status", "404"),
+	HPACK_FIELD(":status", "500"),
+	HPACK_FIELD("accept-charset", ""),
+	HPACK_FIELD("accept-encoding", "gzip, deflate"),
+	HPACK_FIELD("accept-language", ""),
+	HPACK_FIELD("accept-ranges", ""),
+	HPACK_FIELD("accept", ""),
+	HPACK_FIELD("access-control-allow-origin", ""),
+	HPACK_FIELD("age", ""),
+	HPACK_FIELD("allow", ""),
+	HPACK_FIELD("authorization", ""),
+	HPACK_FIELD("cache-control", ""),
+	HPACK_FIELD("content-disposition", ""),
+	HPACK_FIELD("content-encoding", ""),
+	HPACK_FIELD("content-language", ""),
+	HPACK_FIELD("content-length", ""),
+	HPACK_FIELD("content-location", ""),
+	HPACK_FIELD("content-range", ""),
+	HPACK_FIELD("content-type", ""),
+	HPACK_FIELD("cookie", ""),
+	HPACK_FIELD("date", ""),
+	HPACK_FIELD("etag", ""),
+	HPACK_FIELD("expect", ""),
+	HPACK_FIELD("expires", ""),
+	HPACK_FIELD("from", ""),
+	HPACK_FIELD("host", ""),
+	HPACK_FIELD("if-match", ""),
+	HPACK_FIELD("if-modified-since", ""),
+	HPACK_FIELD("if-none-match", ""),
+	HPACK_FIELD("if-range", ""),
+	HPACK_FIELD("if-unmodified-since", ""),
+	HPACK_FIELD("last-modified", ""),
+	HPACK_FIELD("link", ""),
+	HPACK_FIELD("location", ""),
+	HPACK_FIELD("max-forwards", ""),
+	HPACK_FIELD("proxy-authenticate", ""),
+	HPACK_FIELD("proxy-authorization", ""),
+	HPACK_FIELD("range", ""),
+	HPACK_FIELD("referer", ""),
+	HPACK_FIELD("refresh", ""),
+	HPACK_FIELD("retry-after", ""),
+	HPACK_FIELD("server", ""),
+	HPACK_FIELD("set-cookie", ""),
+	HPACK_FIELD("strict-transport-security", ""),
+	HPACK_FIELD("transfer-encoding", ""),
+	HPACK_FIELD("user-agent", ""),
+	HPACK_FIELD("vary", ""),
+	HPACK_FIELD("via", ""),
+	HPACK_FIELD("www-authenticate", ""),
+};
+
+/*
+ * Canonical Huffman code (RFC 7541, Appendix B): number of codes of each
+ * length, in bits, and symbols in code order (256 is EOS)
+ */
+static const uint16_t hpack_huffman_counts[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const uint16_t hpack_huffman_symbols[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+	52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+	110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77,
+	78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119,
+	120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124,
+	35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92, 195, 208,
+	128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+	179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154,
+	156, 160, 163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190,
+	196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140, 141, 143, 147,
+	149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+	183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171, 206,
+	215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205,
+	210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214,
+	221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+	2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24,
+	25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22, 256
+};
+
+/**
+ * Encodes a header list using only the static table: fields found on it are
+ * indexed, all other are literals without indexing (with an indexed name when
+ * possible). Strings are never Huffman-encoded. The encoder keeps no state, so
+ * the resulting block may be sent on any connection, any number of times.
+ *
+ * Returns the length of the header block or -1 if it does not fit on buf.
+ */
+ssize_t
+hpack_encode(struct hpack_field *hf, int nfields, char *buf, size_t buflen)
+{
+	size_t pos;
+	ssize_t len;
+	int i;
+
+	pos = 0;
+	for (i = 0; i < nfields; i++) {
+		int idx;
+
+		/* Indexed header field */
+		if (hpack_static_find(&hf[i], &idx)) {
+			len = hpack_encode_int(idx, 7, 0x80, &buf[pos],
+			    buflen - pos);
+			if (len < 0)
+				return -1;
+			pos += len;
+			continue;
+		}
+
+		/* Literal header field without indexing */
+		len = hpack_encode_int(idx, 4, 0x00, &buf[pos], buflen - pos);
+		if (len < 0)
+			return -1;
+		pos += len;
+
+		if (idx == 0) {
+			len = hpack_encode_string(hf[i].hf_name,
+			    hf[i].hf_namelen, &buf[pos], buflen - pos);
+			if (len < 0)
+				return -1;
+			pos += len;
+		}
+
+		len = hpack_encode_string(hf[i].hf_value, hf[i].hf_valuelen,
+		    &buf[pos], buflen - pos);
+		if (len < 0)
+			return -1;
+		pos += len;
+	}
+
+	return pos;
+}
+
+/**
+ * Integer representation (RFC 7541, Section 5.1). mask holds the bits set on
+ * the first byte besides the prefix.
+ */
+static ssize_t
+hpack_encode_int(uint32_t value, int prefix, uint8_t mask, char *buf,
+    size_t buflen)
+{
+	uint32_t max;
+	size_t pos;
+
+	if (buflen == 0)
+		return -1;
+
+	max = (1U << prefix) - 1;
+	if (value < max) {
+		buf[0] = mask | value;
+		return 1;
+	}
+
+	buf[0] = mask | max;
+	value -= max;
+	for (pos = 1; value >= 0x80; pos++) {
+		if (pos >= buflen)
+			return -1;
+		buf[pos] = 0x80 | (value & 0x7F);
+		value >>= 7;
+	}
+	if (pos >= buflen)
+		return -1;
+	buf[pos++] = value;
+
+	return pos;
+}
+
+/**
+ * String literal representation (RFC 7541, Section 5.2), without Huffman.
+ */
+static ssize_t
+hpack_encode_string(const char *str, size_t len, char *buf, size_t buflen)
+{
+	ssize_t pos;
+
+	pos = hpack_encode_int(len, 7, 0x00, buf, buflen);
+	if (pos < 0 || buflen - pos < len)
+		return -1;
+
+	memcpy(&buf[pos], str, len);
+
+	return pos + len;
+}
+
+/**
+ * Looks for field on static table. Returns 1 if both name and value were
+ * found; otherwise, returns 0 and sets idx to an entry with the same name or
+ * to 0 if there is none.
+ */
+static int
+hpack_static_find(struct hpack_field *hf, int *idx)
+{
+	int i;
+
+	*idx = 0;
+	for (i = 1; i <= HPACK_STATIC_TABLE_SIZE; i++) {
+		struct hpack_field *st;
+
+		st = &hpack_static_table[i];
+		if (st->hf_namelen != hf->hf_namelen ||
+		    memcmp(st->hf_name, hf->hf_name, hf->hf_namelen) != 0)
+			continue;
+
+		if (st->hf_valuelen == hf->hf_valuelen &&
+		    memcmp(st->hf_value, hf->hf_value, hf->hf_valuelen) == 0) {
+			*idx = i;
+			return 1;
+		}
+
+		if (*idx == 0)
+			*idx = i;
+	}
+
+	return 0;
+}
+
+/**
+ * Sets up decoding context, limit being our SETTINGS_HEADER_TABLE_SIZE.
+ */
+int
+hpack_decoder_init(struct hpack_decoder *hd, size_t limit)
+{
+	memset(hd, 0, sizeof(*hd));
+
+	hd->hd_ringsize = limit / HPACK_ENTRY_OVERHEAD + 1;
+	hd->hd_entries = calloc(hd->hd_ringsize, sizeof(*hd->hd_entries));
+	if (hd->hd_entries == NULL) {
+		prterrno("calloc");
+		return -1;
+	}
+	hd->hd_maxsize = limit;
+	hd->hd_limit = limit;
+
+	return 0;
+}
+
+void
+hpack_decoder_clear(struct hpack_decoder *hd)
+{
+	if (hd->hd_entries == NULL)
+		return;
+
+	hpack_decoder_evict(hd, 0);
+	free(hd->hd_entries);
+	hd->hd_entries = NULL;
+}
+
+/**
+ * Decodes a complete header block, calling cb(field, arg) for each of its
+ * fields in order; strings of a field are only valid during the call.
+ *
+ * Returns 0 or -1 if cb fails or the block cannot be decoded. The latter is a
+ * connection error (COMPRESSION_ERROR), as the dynamic table is then out of
+ * sync with the remote encoder.
+ */
+int
+hpack_decode(struct hpack_decoder *hd, const char *block, size_t len,
+    hpack_field_f cb, void *arg)
+{
+	const uint8_t *buf;
+	char *strbuf, *out;
+	size_t pos;
+	int nfields;
+	int r;
+
+	buf = (const uint8_t *)block;
+
+	/* Huffman-decoded strings go here; as codes are at least 5 bits long,
+	 * they take at most 8/5 of the block */
+	strbuf = malloc(len * 8 / 5 + 1);
+	if (strbuf == NULL) {
+		prterrno("malloc");
+		return -1;
+	}
+	out = strbuf;
+
+	r = -1;
+	nfields = 0;
+	for (pos = 0; pos < len; ) {
+		struct hpack_field hf;
+		uint32_t idx;
+		ssize_t n;
+		int indexing;
+
+		/* Indexed header field */
+		if (buf[pos] & 0x80) {
+			n = hpack_decode_int(&buf[pos], len - pos, 7, &idx);
+			if (n < 0 || hpack_decoder_get(hd, idx, &hf) < 0)
+				goto out;
+			pos += n;
+
+			if (cb(&hf, arg) < 0)
+				goto out;
+			nfields++;
+			continue;
+		}
+
+		/* Dynamic table size update, only allowed before any field */
+		if ((buf[pos] & 0xE0) == 0x20) {
+			n = hpack_decode_int(&buf[pos], len - pos, 5, &idx);
+			if (n < 0 || nfields > 0 || idx > hd->hd_limit)
+				goto out;
+			pos += n;
+
+			hd->hd_maxsize = idx;
+			hpack_decoder_evict(hd, idx);
+			continue;
+		}
+
+		/* Literal header field with incremental indexing, without
+		 * indexing or never indexed */
+		indexing = buf[pos] & 0x40;
+		n = hpack_decode_int(&buf[pos], len - pos, indexing ? 6 : 4,
+		    &idx);
+		if (n < 0)
+			goto out;
+		pos += n;
+
+		if (idx != 0) {
+			if (hpack_decoder_get(hd, idx, &hf) < 0)
+				goto out;
+		}
+		else {
+			n = hpack_decode_string(&buf[pos], len - pos, &out,
+			    &hf.hf_name, &hf.hf_namelen);
+			if (n < 0)
+				goto out;
+			pos += n;
+		}
+
+		n = hpack_decode_string(&buf[pos], len - pos, &out,
+		    &hf.hf_value, &hf.hf_valuelen);
+		if (n < 0)
+			goto out;
+		pos += n;
+
+		if (cb(&hf, arg) < 0)
+			goto out;
+		nfields++;
+
+		/* Added after cb, as it may evict the entry hf's name is on */
+		if (indexing && hpack_decoder_add(hd, &hf) < 0)
+			goto out;
+	}
+	r = 0;
+
+out:
+	free(strbuf);
+	return r;
+}
+
+/**
+ * Integer representation (RFC 7541, Section 5.1). Returns bytes used or -1
+ * if it does not fit on buf or on 32 bits.
+ */
+static ssize_t
+hpack_decode_int(const uint8_t *buf, size_t buflen, int prefix,
+    uint32_t *value)
+{
+	uint32_t max, v;
+	size_t pos;
+	int shift;
+
+	if (buflen == 0)
+		return -1;
+
+	max = (1U << prefix) - 1;
+	v = buf[0] & max;
+	if (v < max) {
+		*value = v;
+		return 1;
+	}
+
+	for (pos = 1, shift = 0; ; pos++, shift += 7) {
+		if (pos >= buflen || shift > 21)
+			return -1;
+		v += (uint32_t)(buf[pos] & 0x7F) << shift;
+		if (!(buf[pos] & 0x80))
+			break;
+	}
+	*value = v;
+
+	return pos + 1;
+}
+
+/**
+ * String literal representation (RFC 7541, Section 5.2). Plain strings are
+ * left on buf; Huffman-encoded ones are decoded to *out, which is advanced.
+ */
+static ssize_t
+hpack_decode_string(const uint8_t *buf, size_t buflen, char **out,
+    const char **str, size_t *len)
+{
+	uint32_t slen;
+	ssize_t pos;
+	ssize_t n;
+
+	pos = hpack_decode_int(buf, buflen, 7, &slen);
+	if (pos < 0 || buflen - pos < slen)
+		return -1;
+
+	if (!(buf[0] & 0x80)) {
+		*str = (const char *)&buf[pos];
+		*len = slen;
+		return pos + slen;
+	}
+
+	n = hpack_huffman_decode(&buf[pos], slen, *out);
+	if (n < 0)
+		return -1;
+	*str = *out;
+	*len = n;
+	*out += n;
+
+	return pos + slen;
+}
+
+/**
+ * Decodes Huffman-encoded string to dst, which must have room for len * 8 / 5
+ * bytes. Returns decoded length or -1 if string is invalid.
+ */
+static ssize_t
+hpack_huffman_decode(const uint8_t *src, size_t len, char *dst)
+{
+	uint32_t code, first;
+	size_t i, n;
+	int index, bits;
+	int b;
+
+	n = 0;
+	code = first = 0;
+	index = bits = 0;
+	for (i = 0; i < len; i++) {
+		for (b = 7; b >= 0; b--) {
+			uint16_t count;
+
+			code = code << 1 | ((src[i] >> b) & 1);
+			bits++;
+			count = hpack_huffman_counts[bits];
+
+			/* Codes of each length follow those of the previous
+			 * one, so code is complete if it is below the last */
+			if (code < first + count) {
+				uint16_t sym;
+
+				sym = hpack_huffman_symbols[index + code - first];
+				if (sym == 256)
+					return -1;
+				dst[n++] = sym;
+
+				code = first = 0;
+				index = bits = 0;
+				continue;
+			}
+			if (bits == 30)
+				return -1;
+
+			index += count;
+			first = (first + count) << 1;
+		}
+	}
+
+	/* Padding is up to 7 most significant bits of EOS (all ones) */
+	if (bits > 7 || code != (1U << bits) - 1)
+		return -1;
+
+	return n;
+}
+
+/**
+ * Gets field on index idx of both tables.
+ */
+static int
+hpack_decoder_get(struct hpack_decoder *hd, uint32_t idx,
+    struct hpack_field *hf)
+{
+	struct hpack_entry *he;
+
+	if (idx == 0)
+		return -1;
+	if (idx <= HPACK_STATIC_TABLE_SIZE) {
+		*hf = hpack_static_table[idx];
+		return 0;
+	}
+
+	idx -= HPACK_STATIC_TABLE_SIZE + 1;
+	if (idx >= hd->hd_nentries)
+		return -1;
+
+	he = hd->hd_entries[(hd->hd_first + idx) % hd->hd_ringsize];
+	hf->hf_name = he->he_data;
+	hf->hf_namelen = he->he_namelen;
+	hf->hf_value = &he->he_data[he->he_namelen];
+	hf->hf_valuelen = he->he_valuelen;
+
+	return 0;
+}
+
+/**
+ * Adds a copy of field to the dynamic table, evicting older entries to make
+ * room. A field larger than the whole table just empties it.
+ */
+static int
+hpack_decoder_add(struct hpack_decoder *hd, struct hpack_field *hf)
+{
+	struct hpack_entry *he;
+	size_t size;
+
+	size = hf->hf_namelen + hf->hf_valuelen + HPACK_ENTRY_OVERHEAD;
+	if (size > hd->hd_maxsize) {
+		hpack_decoder_evict(hd, 0);
+		return 0;
+	}
+
+	/* Copied before evicting, as name may come from an evicted entry */
+	he = malloc(sizeof(*he) + hf->hf_namelen + hf->hf_valuelen);
+	if (he == NULL) {
+		prterrno("malloc");
+		return -1;
+	}
+	he->he_namelen = hf->hf_namelen;
+	he->he_valuelen = hf->hf_valuelen;
+	memcpy(he->he_data, hf->hf_name, hf->hf_namelen);
+	memcpy(&he->he_data[hf->hf_namelen], hf->hf_value, hf->hf_valuelen);
+
+	hpack_decoder_evict(hd, hd->hd_maxsize - size);
+
+	hd->hd_first = (hd->hd_first + hd->hd_ringsize - 1) % hd->hd_ringsize;
+	hd->hd_entries[hd->hd_first] = he;
+	hd->hd_nentries++;
+	hd->hd_size += size;
+
+	return 0;
+}
+
+/**
+ * Evicts oldest entries until the dynamic table takes at most size bytes.
+ */
+static void
+hpack_decoder_evict(struct hpack_decoder *hd, size_t size)
+{
+	while (hd->hd_size > size) {
+		struct hpack_entry *he;
+
+		he = hd->hd_entries[(hd->hd_first + hd->hd_nentries - 1) %
+		    hd->hd_ringsize];
+		hd->hd_size -= he->he_namelen + he->he_valuelen +
+		    HPACK_ENTRY_OVERHEAD;
+		hd->hd_nentries--;
+		free(he);
+	}
+}
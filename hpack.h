@@ -0,0 +1,51 @@
+/**
+ * HPACK header compression (RFC 7541)
+ */
+
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+#define HPACK_STATIC_TABLE_SIZE 61
+
+/* Size of a table entry besides its name and value (RFC 7541, Section 4.1) */
+#define HPACK_ENTRY_OVERHEAD 32
+
+/* Dynamic table entry; name and value follow the structure */
+struct hpack_entry {
+	size_t he_namelen;
+	size_t he_valuelen;
+	char he_data[];
+};
+
+/**
+ * Decoding context of a connection
+ *
+ * hd_entries:
+ *   Dynamic table (RFC 7541, Section 2.3.2), a ring of hd_ringsize entries of
+ *   which hd_nentries are used, hd_first being the newest one. As an entry
+ *   takes at least HPACK_ENTRY_OVERHEAD bytes, the ring never has to grow.
+ *
+ * hd_limit:
+ *   Our SETTINGS_HEADER_TABLE_SIZE, bound of the sizes the encoder may set
+ *   (hd_maxsize).
+ */
+struct hpack_decoder {
+	struct hpack_entry **hd_entries;
+	int hd_ringsize;
+	int hd_first;
+	int hd_nentries;
+	size_t hd_size;
+	size_t hd_maxsize;
+	size_t hd_limit;
+};
+
+typedef int (*hpack_field_f)(struct hpack_field *, void *);
+
+ssize_t hpack_encode(struct hpack_field *, int, char *, size_t);
+
+int hpack_decoder_init(struct hpack_decoder *, size_t);
+void hpack_decoder_clear(struct hpack_decoder *);
+int hpack_decode(struct hpack_decoder *, const char *, size_t, hpack_field_f,
+    void *);
+
+#endif /* !__HPACK_H__ */
@@ -0,0 +1,926 @@
+/**
+ * HTTP/1.1 server connections
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+#include "util.h"
+#include "timer.h"
+#include "http2.h"
+#include "hpack.h"
+#include "field.h"
+#include "endpoint.h"
+
+#include "http1.h"
+
+/* Bytes of the HTTP/2 preface telling it apart from any request line */
+#define HTTP1_SNIFF_LEN 4
+
+static void http1_conn_read(evutil_socket_t, short, void *);
+static void http1_conn_write(evutil_socket_t, short, void *);
+static int http1_conn_arm(struct http1_conn *, struct event *);
+static void http1_conn_timeout(struct timer *, void *);
+static int http1_conn_sniff(struct http1_conn *);
+static int http1_conn_process(struct http1_conn *);
+static void http1_conn_consume(struct http1_conn *, size_t);
+static int http1_conn_upgrade(struct http1_conn *, const uint8_t *, size_t);
+static int http1_conn_error(struct http1_conn *, int);
+static char *http1_conn_reserve(struct http1_conn *, size_t);
+static void http1_conn_flush(struct http1_conn *);
+
+static int http1_request_parse(struct http1_conn *, size_t);
+static int http1_field_is(struct hpack_field *, const char *);
+static int http1_token(const char *, size_t, const char *);
+static char *http1_strdup(const char *, size_t);
+static ssize_t http1_base64url(const char *, size_t, uint8_t *);
+static const char *http1_reason(int);
+
+/**
+ * Starts serving sockfd for endpoint ep, first waiting for the bytes telling
+ * HTTP/2 and HTTP/1.1 apart. On failure, sockfd is left open.
+ */
+struct http1_conn *
+http1_conn_new(struct endpoint *ep, int sockfd)
+{
+	struct http1_conn *hc;
+
+	hc = calloc(1, sizeof(*hc));
+	if (hc == NULL) {
+		prterrno("calloc");
+		return NULL;
+	}
+	hc->hc_ep = ep;
+	hc->hc_sockfd = sockfd;
+	timer_init(&hc->hc_timer, http1_conn_timeout, hc);
+	hc->hc_next = ep->ep_h1conns;
+	ep->ep_h1conns = hc;
+
+	hc->hc_rxbuf = malloc(HTTP1_HEADER_MAX);
+	if (hc->hc_rxbuf == NULL) {
+		prterrno("malloc");
+		goto error;
+	}
+
+	hc->hc_rdevent = event_new(ep->ep_evbase, sockfd, EV_READ | EV_PERSIST,
+	    http1_conn_read, hc);
+	hc->hc_wrevent = event_new(ep->ep_evbase, sockfd, EV_WRITE,
+	    http1_conn_write, hc);
+	if (hc->hc_rdevent == NULL || hc->hc_wrevent == NULL) {
+		prterr("event_new: failure.");
+		goto error;
+	}
+	if (http1_conn_arm(hc, hc->hc_rdevent) < 0)
+		goto error;
+
+	return hc;
+
+error:
+	/* Descriptor stays with the caller */
+	hc->hc_sockfd = -1;
+	http1_conn_free(hc);
+	return NULL;
+}
+
+/**
+ * Frees connection, closing its socket unless hc_sockfd was set to -1. A
+ * request held by its handler is left for endpoint_respond() to release.
+ */
+void
+http1_conn_free(struct http1_conn *hc)
+{
+	struct http1_conn **pos;
+
+	for (pos = &hc->hc_ep->ep_h1conns; *pos != hc; pos = &(*pos)->hc_next)
+		;
+	*pos = hc->hc_next;
+
+	if (hc->hc_req != NULL) {
+		hc->hc_req->er_h1 = NULL;
+		if (!hc->hc_req->er_dispatched)
+			endpoint_request_free(hc->hc_req);
+	}
+
+	if (hc->hc_timer.tm_pending)
+		timer_cancel(hc->hc_ep->ep_timers, &hc->hc_timer);
+	if (hc->hc_rdevent != NULL)
+		event_free(hc->hc_rdevent);
+	if (hc->hc_wrevent != NULL)
+		event_free(hc->hc_wrevent);
+	if (hc->hc_sockfd >= 0)
+		close(hc->hc_sockfd);
+	free(hc->hc_rxbuf);
+	free(hc->hc_txbuf);
+	free(hc);
+}
+
+/**
+ * Answers er, the request being served on its connection, with status, the
+ * given fields and body (copied, NULL if none); the connection goes on with
+ * the next request once it is sent. The request is released.
+ */
+int
+http1_respond(struct endpoint_request *er, int status, struct hpack_field *hf,
+    int nfields, const char *body, size_t bodylen)
+{
+	struct http1_conn *hc;
+	size_t size, len;
+	char *buf;
+	int i, nobody;
+
+	hc = er->er_h1;
+	hc->hc_req = NULL;
+
+	if (status < 200 || status > 999) {
+		prterr("http1_respond: invalid status %d.", status);
+		status = 500;
+		nfields = 0;
+		bodylen = 0;
+		hc->hc_close = 1;
+	}
+
+	/* Responses to HEAD, 204 and 304 ones have no body */
+	nobody = strcmp(er->er_method, "HEAD") == 0 || status == 204 ||
+	    status == 304;
+
+	prtinfo("(%d) HTTP/1.1 response %d to %s %s.", hc->hc_sockfd, status,
+	    er->er_method, er->er_path);
+	endpoint_request_free(er);
+
+	size = 128;
+	for (i = 0; i < nfields; i++)
+		size += hf[i].hf_namelen + hf[i].hf_valuelen + 4;
+	if (!nobody)
+		size += bodylen;
+
+	buf = http1_conn_reserve(hc, size);
+	if (buf == NULL) {
+		/* Connection is closed once done with what it had to send */
+		hc->hc_close = 1;
+		http1_conn_flush(hc);
+		return -1;
+	}
+
+	len = snprintf(buf, size, "HTTP/1.1 %d %s\r\n", status,
+	    http1_reason(status));
+	for (i = 0; i < nfields; i++)
+		len += snprintf(&buf[len], size - len, "%.*s: %.*s\r\n",
+		    (int)hf[i].hf_namelen, hf[i].hf_name,
+		    (int)hf[i].hf_valuelen, hf[i].hf_value);
+	if (status != 204 && status != 304)
+		len += snprintf(&buf[len], size - len,
+		    "content-length: %zu\r\n", bodylen);
+	if (hc->hc_close)
+		len += snprintf(&buf[len], size - len, "connection: close\r\n");
+	len += snprintf(&buf[len], size - len, "\r\n");
+	if (!nobody && bodylen != 0) {
+		memcpy(&buf[len], body, bodylen);
+		len += bodylen;
+	}
+	hc->hc_txlen += len;
+
+	http1_conn_flush(hc);
+
+	return 0;
+}
+
+/**
+ * Receives on connection, for the request being received: none is read while
+ * one is being served.
+ */
+static void
+http1_conn_read(evutil_socket_t fd, short events, void *arg)
+{
+	struct http1_conn *hc;
+	ssize_t bytes;
+	int r;
+
+	hc = arg;
+
+	/* Connection may be handed over to HTTP/2 meanwhile */
+	if (!hc->hc_sniffed) {
+		r = http1_conn_sniff(hc);
+		if (r < 0)
+			goto error;
+		if (r == 0)
+			return;
+	}
+
+	if (hc->hc_rxlen < HTTP1_HEADER_MAX) {
+		bytes = recv(fd, &hc->hc_rxbuf[hc->hc_rxlen],
+		    HTTP1_HEADER_MAX - hc->hc_rxlen, MSG_DONTWAIT);
+		if (bytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			prterrno("recv");
+			goto error;
+		}
+		else if (bytes == 0) {
+			prtinfo("(%d) HTTP/1.1 connection closed by peer.", fd);
+			goto error;
+		}
+		hc->hc_rxlen += bytes;
+
+		/* Not idle */
+		if (http1_conn_arm(hc, NULL) < 0)
+			goto error;
+	}
+
+	if (http1_conn_process(hc) < 0)
+		goto error;
+	return;
+
+error:
+	http1_conn_free(hc);
+	return;
+}
+
+/**
+ * Sends what was queued. Once all is sent and no request is being served,
+ * the connection is closed if it has to be, or goes on with what was
+ * received meanwhile.
+ */
+static void
+http1_conn_write(evutil_socket_t fd, short events, void *arg)
+{
+	struct http1_conn *hc;
+	ssize_t bytes;
+
+	hc = arg;
+
+	while (hc->hc_txpos < hc->hc_txlen) {
+		bytes = send(fd, &hc->hc_txbuf[hc->hc_txpos],
+		    hc->hc_txlen - hc->hc_txpos, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (bytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (http1_conn_arm(hc, hc->hc_wrevent) < 0)
+					goto error;
+				return;
+			}
+			prterrno("send");
+			goto error;
+		}
+		hc->hc_txpos += bytes;
+	}
+
+	/* Large bodies are not kept around */
+	free(hc->hc_txbuf);
+	hc->hc_txbuf = NULL;
+	hc->hc_txlen = hc->hc_txpos = 0;
+
+	if (hc->hc_req != NULL)
+		return;
+	if (hc->hc_close)
+		goto error;
+
+	if (http1_conn_arm(hc, hc->hc_rdevent) < 0 ||
+	    http1_conn_process(hc) < 0)
+		goto error;
+	return;
+
+error:
+	http1_conn_free(hc);
+	return;
+}
+
+/**
+ * Adds event ev, if any, and restarts the connection's HTTP1_TIMEOUT, if the
+ * endpoint keeps deadlines.
+ */
+static int
+http1_conn_arm(struct http1_conn *hc, struct event *ev)
+{
+	if (ev != NULL && event_add(ev, NULL) < 0) {
+		prterr("event_add: failure.");
+		return -1;
+	}
+	if (hc->hc_ep->ep_timers != NULL && timer_schedule(hc->hc_ep->ep_timers,
+	    &hc->hc_timer, HTTP1_TIMEOUT) < 0) {
+		prterr("timer_schedule: failure.");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+http1_conn_timeout(struct timer *tm, void *arg)
+{
+	struct http1_conn *hc;
+
+	hc = arg;
+	prtinfo("(%d) HTTP/1.1 connection timed out.", hc->hc_sockfd);
+	http1_conn_free(hc);
+}
+
+/**
+ * Peeks at the first bytes received: as soon as they are known to start the
+ * HTTP/2 preface, the connection is attached to the endpoint and freed here.
+ * The rare few bytes not telling yet are taken onto hc_rxbuf, so that the
+ * socket stops being readable. Returns 1 if the connection is HTTP/1.1, 0 if
+ * there is nothing more to do (hc may be gone) and -1 on error.
+ */
+static int
+http1_conn_sniff(struct http1_conn *hc)
+{
+	struct http2_connection *conn;
+	char buf[HTTP2_PREFACE_LEN];
+	ssize_t bytes;
+	size_t len;
+
+	len = hc->hc_rxlen;
+	bytes = recv(hc->hc_sockfd, buf, HTTP2_PREFACE_LEN - len,
+	    MSG_PEEK | MSG_DONTWAIT);
+	if (bytes < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		prterrno("recv");
+		return -1;
+	}
+	else if (bytes == 0) {
+		prtinfo("(%d) Connection closed by peer.", hc->hc_sockfd);
+		return -1;
+	}
+
+	if (memcmp(buf, &HTTP2_PREFACE[len], bytes) != 0) {
+		hc->hc_sniffed = 1;
+		return 1;
+	}
+
+	if (len + bytes < HTTP1_SNIFF_LEN) {
+		bytes = recv(hc->hc_sockfd, &hc->hc_rxbuf[len], bytes,
+		    MSG_DONTWAIT);
+		if (bytes < 0) {
+			prterrno("recv");
+			return -1;
+		}
+		hc->hc_rxlen += bytes;
+		return 0;
+	}
+
+	/* Preface is checked whole by the HTTP/2 connection */
+	prtinfo("(%d) HTTP/2 with prior knowledge.", hc->hc_sockfd);
+	conn = endpoint_attach(hc->hc_ep, hc->hc_sockfd);
+	if (conn == NULL) {
+		prterr("endpoint_attach: failure.");
+		return -1;
+	}
+	/* Bytes taken onto hc_rxbuf were part of it */
+	conn->cn_rxpreface -= len;
+
+	hc->hc_sockfd = -1;
+	http1_conn_free(hc);
+
+	return 0;
+}
+
+/**
+ * Goes on with the request being received: its header, then its body. Once
+ * complete, it is routed and reading stops until it is answered. hc must not
+ * be used after 0 is returned, as it may have been upgraded.
+ */
+static int
+http1_conn_process(struct http1_conn *hc)
+{
+	struct endpoint_request *er;
+	size_t i, n;
+
+	if (hc->hc_req == NULL) {
+		/* Empty lines ahead of a request line are ignored */
+		for (n = 0; n + 1 < hc->hc_rxlen && hc->hc_rxbuf[n] == '\r' &&
+		    hc->hc_rxbuf[n + 1] == '\n'; n += 2)
+			;
+		http1_conn_consume(hc, n);
+
+		for (i = 3; i < hc->hc_rxlen; i++)
+			if (hc->hc_rxbuf[i] == '\n' &&
+			    hc->hc_rxbuf[i - 1] == '\r' &&
+			    hc->hc_rxbuf[i - 2] == '\n' &&
+			    hc->hc_rxbuf[i - 3] == '\r')
+				break;
+		if (i >= hc->hc_rxlen) {
+			if (hc->hc_rxlen == HTTP1_HEADER_MAX)
+				return http1_conn_error(hc, 431);
+			return 0;
+		}
+
+		switch (http1_request_parse(hc, i + 1)) {
+		case -1:
+			return -1;
+		case 0:
+			return 0;
+		}
+	}
+	er = hc->hc_req;
+
+	n = hc->hc_rxlen < hc->hc_bodyleft ? hc->hc_rxlen : hc->hc_bodyleft;
+	if (n != 0) {
+		memcpy(&er->er_body[er->er_bodylen], hc->hc_rxbuf, n);
+		er->er_bodylen += n;
+		hc->hc_bodyleft -= n;
+		http1_conn_consume(hc, n);
+	}
+	if (hc->hc_bodyleft != 0)
+		return 0;
+
+	event_del(hc->hc_rdevent);
+
+	prtinfo("(%d) HTTP/1.1 request %s %s.", hc->hc_sockfd, er->er_method,
+	    er->er_path);
+
+	er->er_ended = 1;
+	er->er_dispatched = 1;
+	endpoint_route(hc->hc_ep, er);
+
+	return 0;
+}
+
+static void
+http1_conn_consume(struct http1_conn *hc, size_t len)
+{
+	if (len == 0)
+		return;
+
+	memmove(hc->hc_rxbuf, &hc->hc_rxbuf[len], hc->hc_rxlen - len);
+	hc->hc_rxlen -= len;
+}
+
+/**
+ * Switches to h2c for the request being received, complete: the 101 response
+ * is written right away, before the HTTP/2 connection takes the socket over.
+ * Returns 0 once hc is gone and -1 on error.
+ */
+static int
+http1_conn_upgrade(struct http1_conn *hc, const uint8_t *settings,
+    size_t len)
+{
+	static const char resp[] = "HTTP/1.1 101 Switching Protocols\r\n"
+	    "connection: Upgrade\r\nupgrade: h2c\r\n\r\n";
+	struct endpoint_request *er;
+	struct endpoint *ep;
+	ssize_t bytes;
+	int sockfd;
+
+	/* Nothing was sent yet, so the socket takes it whole */
+	bytes = send(hc->hc_sockfd, resp, sizeof(resp) - 1,
+	    MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (bytes != sizeof(resp) - 1) {
+		prterr("send: 101 response could not be written.");
+		return -1;
+	}
+
+	prtinfo("(%d) HTTP/1.1 connection upgraded to h2c.", hc->hc_sockfd);
+
+	er = hc->hc_req;
+	ep = hc->hc_ep;
+	sockfd = hc->hc_sockfd;
+	hc->hc_req = NULL;
+	hc->hc_sockfd = -1;
+	http1_conn_free(hc);
+
+	if (endpoint_upgrade(ep, sockfd, er, settings, len) < 0) {
+		prterr("endpoint_upgrade: failure.");
+		close(sockfd);
+	}
+
+	return 0;
+}
+
+/**
+ * Answers the request being received with status, and no body, and closes
+ * the connection once that is sent.
+ */
+static int
+http1_conn_error(struct http1_conn *hc, int status)
+{
+	char *buf;
+	size_t size;
+
+	prtinfo("(%d) HTTP/1.1 request refused with %d.", hc->hc_sockfd,
+	    status);
+
+	if (hc->hc_req != NULL) {
+		endpoint_request_free(hc->hc_req);
+		hc->hc_req = NULL;
+	}
+	hc->hc_close = 1;
+	event_del(hc->hc_rdevent);
+
+	size = 128;
+	buf = http1_conn_reserve(hc, size);
+	if (buf == NULL)
+		return -1;
+	hc->hc_txlen += snprintf(buf, size, "HTTP/1.1 %d %s\r\n"
+	    "content-length: 0\r\nconnection: close\r\n\r\n", status,
+	    http1_reason(status));
+
+	http1_conn_flush(hc);
+
+	return 0;
+}
+
+/**
+ * Returns room for len more bytes at the end of hc_txbuf.
+ */
+static char *
+http1_conn_reserve(struct http1_conn *hc, size_t len)
+{
+	char *buf;
+
+	buf = realloc(hc->hc_txbuf, hc->hc_txlen + len);
+	if (buf == NULL) {
+		prterrno("realloc");
+		return NULL;
+	}
+	hc->hc_txbuf = buf;
+
+	return &buf[hc->hc_txlen];
+}
+
+/**
+ * What was queued is sent at the end of the loop iteration, as on HTTP/2.
+ */
+static void
+http1_conn_flush(struct http1_conn *hc)
+{
+	if (!event_pending(hc->hc_wrevent, EV_WRITE, NULL))
+		event_active(hc->hc_wrevent, EV_WRITE, 1);
+}
+
+/**
+ * Parses the request line and header fields, on the first hdrlen bytes of
+ * hc_rxbuf, into a new hc_req. Names are lowercased and fields checked as on
+ * HTTP/2; Host becomes the authority, and connection-specific fields are
+ * dropped. Returns 1 once the request's body may be received, 0 if it was
+ * refused or upgraded (hc may be gone) and -1 on error.
+ */
+static int
+http1_request_parse(struct http1_conn *hc, size_t hdrlen)
+{
+	struct endpoint_request *er;
+	struct hpack_field hf;
+	char *line, *eol, *end, *sp1, *sp2, *p, *target, *auth;
+	const char *settings;
+	size_t clen, settingslen, schemelen;
+	int http10, gotlen, upgrade, nsettings, expect;
+
+	end = &hc->hc_rxbuf[hdrlen - 2];
+	line = hc->hc_rxbuf;
+	for (eol = line; eol[0] != '\r' || eol[1] != '\n'; eol++)
+		;
+
+	/* Request line: method SP request-target SP HTTP-version */
+	sp1 = memchr(line, ' ', eol - line);
+	sp2 = sp1 == NULL ? NULL : memchr(&sp1[1], ' ', eol - &sp1[1]);
+	if (sp1 == NULL || sp2 == NULL || sp1 == line || sp2 == &sp1[1])
+		return http1_conn_error(hc, 400);
+	for (p = line; p < sp1; p++)
+		if (*p <= 0x20 || *p >= 0x7F ||
+		    strchr("\"(),/:;<=>?@[\\]{}", *p) != NULL)
+			return http1_conn_error(hc, 400);
+	for (p = &sp1[1]; p < sp2; p++)
+		if (*p <= 0x20 || *p >= 0x7F)
+			return http1_conn_error(hc, 400);
+
+	/* Request target: origin form, asterisk form or absolute form (RFC
+	 * 9112, Section 3.2.2), whose authority is taken instead of Host's */
+	target = &sp1[1];
+	auth = NULL;
+	schemelen = 4;
+	if (*target != '/' && (*target != '*' || sp2 != &target[1])) {
+		if (sp2 - target > 7 && strncasecmp(target, "http://", 7) == 0)
+			schemelen = 4;
+		else if (sp2 - target > 8 &&
+		    strncasecmp(target, "https://", 8) == 0)
+			schemelen = 5;
+		else
+			return http1_conn_error(hc, 400);
+
+		auth = &target[schemelen + 3];
+		for (target = auth; target < sp2 && *target != '/' &&
+		    *target != '?'; target++)
+			if (*target == '@')
+				return http1_conn_error(hc, 400);
+		if (target == auth)
+			return http1_conn_error(hc, 400);
+	}
+	if (eol - &sp2[1] == 8 && memcmp(&sp2[1], "HTTP/1.1", 8) == 0)
+		http10 = 0;
+	else if (eol - &sp2[1] == 8 && memcmp(&sp2[1], "HTTP/1.0", 8) == 0)
+		http10 = 1;
+	else
+		return http1_conn_error(hc, 505);
+
+	er = calloc(1, sizeof(*er));
+	if (er == NULL) {
+		prterrno("calloc");
+		return -1;
+	}
+	er->er_h1 = hc;
+	hc->hc_req = er;
+	er->er_method = http1_strdup(line, sp1 - line);
+	er->er_scheme = http1_strdup(schemelen == 5 ? "https" : "http",
+	    schemelen);
+	if (er->er_method == NULL || er->er_scheme == NULL)
+		return -1;
+
+	/* Absolute form may have an empty path, which stands for "/" */
+	if (target == sp2 || *target == '?') {
+		er->er_path = malloc(sp2 - target + 2);
+		if (er->er_path == NULL) {
+			prterrno("malloc");
+			return -1;
+		}
+		er->er_path[0] = '/';
+		memcpy(&er->er_path[1], target, sp2 - target);
+		er->er_path[sp2 - target + 1] = '\0';
+	}
+	else {
+		er->er_path = http1_strdup(target, sp2 - target);
+		if (er->er_path == NULL)
+			return -1;
+	}
+
+	/* Header fields, one per line */
+	clen = 0;
+	settings = NULL;
+	settingslen = 0;
+	gotlen = upgrade = nsettings = expect = 0;
+	hc->hc_close = http10;
+	for (line = &eol[2]; line < end; line = &eol[2]) {
+		char *colon;
+		size_t i;
+
+		for (eol = line; eol[0] != '\r' || eol[1] != '\n'; eol++)
+			;
+
+		/* Obsolete line folding is not taken */
+		if (*line == ' ' || *line == '\t')
+			return http1_conn_error(hc, 400);
+		colon = memchr(line, ':', eol - line);
+		if (colon == NULL)
+			return http1_conn_error(hc, 400);
+
+		for (p = line; p < colon; p++)
+			if (*p >= 'A' && *p <= 'Z')
+				*p += 'a' - 'A';
+		hf.hf_name = line;
+		hf.hf_namelen = colon - line;
+
+		/* Value, without surrounding whitespace */
+		for (p = &colon[1]; p < eol && (*p == ' ' || *p == '\t'); p++)
+			;
+		hf.hf_value = p;
+		for (p = eol; p > hf.hf_value && (p[-1] == ' ' || p[-1] == '\t');
+		    p--)
+			;
+		hf.hf_valuelen = p - hf.hf_value;
+
+		if (field_name_check(hf.hf_name, hf.hf_namelen) < 0 ||
+		    field_value_check(hf.hf_value, hf.hf_valuelen) < 0)
+			return http1_conn_error(hc, 400);
+
+		if (http1_field_is(&hf, "host")) {
+			if (er->er_authority != NULL)
+				return http1_conn_error(hc, 400);
+			er->er_authority = http1_strdup(hf.hf_value,
+			    hf.hf_valuelen);
+			if (er->er_authority == NULL)
+				return -1;
+		}
+		else if (http1_field_is(&hf, "content-length")) {
+			size_t len;
+
+			if (hf.hf_valuelen == 0)
+				return http1_conn_error(hc, 400);
+			for (len = 0, i = 0; i < hf.hf_valuelen; i++) {
+				if (hf.hf_value[i] < '0' ||
+				    hf.hf_value[i] > '9')
+					return http1_conn_error(hc, 400);
+				if (len <= ENDPOINT_BODY_MAX)
+					len = len * 10 + hf.hf_value[i] - '0';
+			}
+			if (gotlen && len != clen)
+				return http1_conn_error(hc, 400);
+			if (len > ENDPOINT_BODY_MAX)
+				return http1_conn_error(hc, 413);
+			clen = len;
+			gotlen = 1;
+		}
+		else if (http1_field_is(&hf, "transfer-encoding"))
+			return http1_conn_error(hc, 501);
+		else if (http1_field_is(&hf, "connection")) {
+			if (http1_token(hf.hf_value, hf.hf_valuelen, "close"))
+				hc->hc_close = 1;
+			else if (http10 && http1_token(hf.hf_value,
+			    hf.hf_valuelen, "keep-alive"))
+				hc->hc_close = 0;
+		}
+		else if (http1_field_is(&hf, "upgrade"))
+			upgrade = http1_token(hf.hf_value, hf.hf_valuelen,
+			    "h2c");
+		else if (http1_field_is(&hf, "http2-settings")) {
+			settings = hf.hf_value;
+			settingslen = hf.hf_valuelen;
+			nsettings++;
+		}
+		else if (http1_field_is(&hf, "expect"))
+			expect = hf.hf_valuelen == 12 &&
+			    strncasecmp(hf.hf_value, "100-continue", 12) == 0;
+		else if (http1_field_is(&hf, "keep-alive") ||
+		    http1_field_is(&hf, "proxy-connection"))
+			continue;
+		else if (endpoint_request_add(er, &hf) < 0)
+			return -1;
+	}
+	if (!http10 && er->er_authority == NULL)
+		return http1_conn_error(hc, 400);
+	if (auth != NULL) {
+		free(er->er_authority);
+		er->er_authority = http1_strdup(auth, target - auth);
+		if (er->er_authority == NULL)
+			return -1;
+	}
+
+	/* Upgrade to h2c, only for requests with nothing sent after them
+	 * (RFC 7540, Section 3.2); others are served on HTTP/1.1 */
+	if (upgrade && nsettings == 1 && !http10 && clen == 0 &&
+	    hc->hc_rxlen == hdrlen) {
+		uint8_t payload[HTTP1_HEADER_MAX / 4 * 3];
+		ssize_t len;
+
+		len = http1_base64url(settings, settingslen, payload);
+		if (len >= 0) {
+			hc->hc_rxlen = 0;
+			return http1_conn_upgrade(hc, payload, len);
+		}
+	}
+
+	http1_conn_consume(hc, hdrlen);
+
+	hc->hc_bodyleft = clen;
+	if (clen != 0) {
+		er->er_body = malloc(clen);
+		if (er->er_body == NULL) {
+			prterrno("malloc");
+			return -1;
+		}
+
+		/* Client waits for this before sending the body */
+		if (expect && hc->hc_rxlen < clen) {
+			static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+			char *buf;
+
+			buf = http1_conn_reserve(hc, sizeof(cont) - 1);
+			if (buf == NULL)
+				return -1;
+			memcpy(buf, cont, sizeof(cont) - 1);
+			hc->hc_txlen += sizeof(cont) - 1;
+			http1_conn_flush(hc);
+		}
+	}
+
+	return 1;
+}
+
+static int
+http1_field_is(struct hpack_field *hf, const char *name)
+{
+	return hf->hf_namelen == strlen(name) &&
+	    memcmp(hf->hf_name, name, hf->hf_namelen) == 0;
+}
+
+/**
+ * Tells whether the comma-separated list value holds token, in any case.
+ */
+static int
+http1_token(const char *value, size_t len, const char *token)
+{
+	size_t i, j, k;
+
+	for (i = 0; i < len; i = j + 1) {
+		while (i < len && (value[i] == ' ' || value[i] == '\t'))
+			i++;
+		for (j = i; j < len && value[j] != ','; j++)
+			;
+		for (k = j; k > i && (value[k - 1] == ' ' ||
+		    value[k - 1] == '\t'); k--)
+			;
+		if (k - i == strlen(token) &&
+		    strncasecmp(&value[i], token, k - i) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static char *
+http1_strdup(const char *s, size_t len)
+{
+	char *str;
+
+	str = malloc(len + 1);
+	if (str == NULL) {
+		prterrno("malloc");
+		return NULL;
+	}
+	memcpy(str, s, len);
+	str[len] = '\0';
+
+	return str;
+}
+
+/**
+ * Decodes base64url (RFC 4648, Section 5) src onto dst, which takes len * 3 /
+ * 4 bytes; padding is optional. Returns the decoded length or -1.
+ */
+static ssize_t
+http1_base64url(const char *src, size_t len, uint8_t *dst)
+{
+	uint32_t acc;
+	size_t i, n;
+	int bits, v;
+
+	while (len > 0 && src[len - 1] == '=')
+		len--;
+	if (len % 4 == 1)
+		return -1;
+
+	acc = 0;
+	bits = 0;
+	n = 0;
+	for (i = 0; i < len; i++) {
+		if (src[i] >= 'A' && src[i] <= 'Z')
+			v = src[i] - 'A';
+		else if (src[i] >= 'a' && src[i] <= 'z')
+			v = src[i] - 'a' + 26;
+		else if (src[i] >= '0' && src[i] <= '9')
+			v = src[i] - '0' + 52;
+		else if (src[i] == '-')
+			v = 62;
+		else if (src[i] == '_')
+			v = 63;
+		else
+			return -1;
+
+		acc = (acc << 6 | v) & 0xFFFFFF;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			dst[n++] = acc >> bits;
+		}
+	}
+
+	return n;
+}
+
+static const char *
+http1_reason(int status)
+{
+	switch (status) {
+	case 200:
+		return "OK";
+	case 201:
+		return "Created";
+	case 204:
+		return "No Content";
+	case 301:
+		return "Moved Permanently";
+	case 302:
+		return "Found";
+	case 304:
+		return "Not Modified";
+	case 400:
+		return "Bad Request";
+	case 403:
+		return "Forbidden";
+	case 404:
+		return "Not Found";
+	case 405:
+		return "Method Not Allowed";
+	case 413:
+		return "Content Too Large";
+	case 431:
+		return "Request Header Fields Too Large";
+	case 500:
+		return "Internal Server Error";
+	case 501:
+		return "Not Implemented";
+	case 503:
+		return "Service Unavailable";
+	case 505:
+		return "HTTP Version Not Supported";
+	default:
+		return "";
+	}
+}
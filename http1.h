@@ -0,0 +1,45 @@
+/**
+ * HTTP/1.1 server connections
+ *
+ * Every connection accepted by an endpoint starts here: if its first bytes
+ * are those of the HTTP/2 connection preface, it is attached to the endpoint
+ * as HTTP/2 right away; otherwise, it is served as HTTP/1.1, one request at a
+ * time, by the endpoint's handlers. Requests asking for an upgrade to h2c
+ * (with no body) get it, and their response on stream 1.
+ *
+ * Bodies must come with a Content-Length: chunked requests are refused.
+ */
+
+#ifndef __HTTP1_H__
+#define __HTTP1_H__
+
+/* Largest request line and header fields taken */
+#define HTTP1_HEADER_MAX 8192
+
+/* Time, in milliseconds, a connection may stay idle or stalled writing */
+#define HTTP1_TIMEOUT 30000
+
+struct http1_conn {
+	struct endpoint *hc_ep;
+	int hc_sockfd;
+	int hc_sniffed; /* told apart from HTTP/2 */
+	int hc_close; /* closed once the response is sent */
+	struct event *hc_rdevent;
+	struct event *hc_wrevent;
+	struct timer hc_timer; /* idle or stalled, on the endpoint's wheel */
+	char *hc_rxbuf; /* HTTP1_HEADER_MAX bytes */
+	size_t hc_rxlen; /* bytes on hc_rxbuf */
+	char *hc_txbuf;
+	size_t hc_txlen; /* bytes on hc_txbuf */
+	size_t hc_txpos; /* bytes of hc_txbuf already sent */
+	struct endpoint_request *hc_req; /* being received or served */
+	size_t hc_bodyleft; /* body bytes of hc_req still to be received */
+	struct http1_conn *hc_next;
+};
+
+struct http1_conn *http1_conn_new(struct endpoint *, int);
+void http1_conn_free(struct http1_conn *);
+int http1_respond(struct endpoint_request *, int, struct hpack_field *, int,
+    const char *, size_t);
+
+#endif /* !__HTTP1_H__ */
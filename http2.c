@@ -3,70 +3,149 @@
  */
 
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#include <linux/tcp.h> /* tcp_info with tcpi_snd_wnd */
+#else
+#include <netinet/tcp.h>
+#endif
 
 #include <event2/event.h>
 
+#include "libhttp2.h"
 #include "defines.h"
 #include "util.h"
 
+#include "timer.h"
+
 #include "http2.h"
+#include "trace.h"
 
 static void http2_connection_read(evutil_socket_t, short, void *);
+static int http2_connection_read_step(struct http2_connection *);
 static void http2_connection_write(evutil_socket_t, short, void *);
 
-static void http2_frame_free(struct http2_frame *);
+static ssize_t http2_socket_recv(struct http2_connection *, void *, size_t);
+static ssize_t http2_socket_sendv(struct http2_connection *,
+    const struct iovec *, int);
+static int http2_socket_arm(struct http2_connection *, short);
+static void http2_socket_close(struct http2_connection *);
+
+static void http2_frame_enqueue(struct http2_connection *, struct http2_frame *);
 
 static int http2_frame_recv(struct http2_frame *);
-static int http2_frame_send(struct http2_frame *);
 
+static int http2_frame_stream_handler(struct http2_frame *);
+static int http2_frame_headers_handler(struct http2_frame *);
+static int http2_frame_continuation_handler(struct http2_frame *);
 static int http2_frame_settings_handler(struct http2_frame *);
 static int http2_frame_settings_send(struct http2_connection *, struct http2_setting *, int, int);
 
+static int http2_header_fragment(struct http2_frame *);
+static int http2_header_reserve(struct http2_connection *, size_t);
+static void http2_header_keep(void *);
+
+static void http2_settings_timeout(struct timer *, void *);
+static void http2_settings_init(struct http2_settings *);
+static int http2_setting_check(struct http2_setting *);
+
 /* Frame handlers */
 struct http2_frame_handler http2_frame_handlers[] = {
+	{ HTTP2_FRAME_DATA, http2_frame_stream_handler },
+	{ HTTP2_FRAME_HEADERS, http2_frame_headers_handler },
+	{ HTTP2_FRAME_RST_STREAM, http2_frame_stream_handler },
 	{ HTTP2_FRAME_SETTINGS, http2_frame_settings_handler },
+	{ HTTP2_FRAME_WINDOW_UPDATE, http2_frame_stream_handler },
+	{ HTTP2_FRAME_CONTINUATION, http2_frame_continuation_handler },
 	{ -1, NULL }
 };
 
+/* Last connection ID given */
+static uint32_t http2_connection_lastid = 0;
+
+/* TCP (or any stream socket) transport */
+const struct http2_transport http2_transport_socket = {
+	http2_socket_recv,
+	http2_socket_sendv,
+	http2_socket_arm,
+	http2_socket_close,
+};
+
 struct http2_connection *
 http2_connection_new(int sockfd, struct event_base *evbase)
+{
+	return http2_connection_new_transport(sockfd, &http2_transport_socket,
+	    NULL, evbase);
+}
+
+/**
+ * Creates a connection over the given transport. fd is the descriptor its
+ * events watch; transports with no descriptor use -1 and activate the events
+ * themselves.
+ */
+struct http2_connection *
+http2_connection_new_transport(int fd, const struct http2_transport *tr,
+    void *trdata, struct event_base *evbase)
 {
 	struct http2_connection *conn;
 
-	/* Allocates structure */
-	conn = calloc(1, sizeof(*conn));
-	if (conn == NULL) {
-		prterrno("calloc");
+	/* Allocates structure, aligned so its hot fields share cache lines */
+	errno = posix_memalign((void **)&conn, HTTP2_CACHE_LINE_SIZE,
+	    sizeof(*conn));
+	if (errno != 0) {
+		prterrno("posix_memalign");
 		return NULL;
 	}
+	memset(conn, 0, sizeof(*conn));
 
 	/* Sets initial values */
-	conn->cn_sockfd = sockfd;
-
-	/* Creates events for socket's reading and writing readiness */
-	conn->cn_rdevent = event_new(evbase, sockfd, EV_READ,
+	conn->cn_sockfd = fd;
+	conn->cn_transport = tr;
+	conn->cn_trdata = trdata;
+	conn->cn_id = ++http2_connection_lastid;
+	http2_settings_init(&conn->cn_remsets);
+	http2_settings_init(&conn->cn_locsets);
+	conn->cn_rxmaxframe = conn->cn_locsets.ss_values[
+	    HTTP2_SETTINGS_MAX_FRAME_SIZE];
+	conn->cn_txmaxframe = conn->cn_remsets.ss_values[
+	    HTTP2_SETTINGS_MAX_FRAME_SIZE];
+	timer_init(&conn->cn_settings_timer, http2_settings_timeout, conn);
+
+	/* Creates events for transport's reading and writing readiness; reading
+	 * stays armed for the connection's lifetime */
+	conn->cn_rdevent = event_new(evbase, fd, EV_READ | EV_PERSIST,
 	    http2_connection_read, conn);
-	conn->cn_wrevent = event_new(evbase, sockfd, EV_WRITE,
+	conn->cn_wrevent = event_new(evbase, fd, EV_WRITE,
 	    http2_connection_write, conn);
 	if (conn->cn_rdevent == NULL || conn->cn_wrevent == NULL) {
 		prterr("event_new: failure.");
+		if (conn->cn_rdevent != NULL)
+			event_free(conn->cn_rdevent);
+		if (conn->cn_wrevent != NULL)
+			event_free(conn->cn_wrevent);
 		free(conn);
 		return NULL;
 	}
 
 	/* Arms reading event */
-	if (event_add(conn->cn_rdevent, NULL) < 0) {
-		prterr("event_add: failure.");
+	if (tr->tr_arm(conn, EV_READ) < 0) {
+		prterr("tr_arm: failure.");
 		event_free(conn->cn_rdevent);
+		event_free(conn->cn_wrevent);
 		free(conn);
 		return NULL;
 	}
@@ -82,12 +161,19 @@ http2_connection_free(struct http2_connection *conn)
 	if (conn == NULL)
 		return;
 
-	close(conn->cn_sockfd);
+	if (conn->cn_timers != NULL)
+		timer_cancel(conn->cn_timers, &conn->cn_settings_timer);
+
+	if (conn->cn_closecb != NULL)
+		conn->cn_closecb(conn, conn->cn_closearg);
 
 	event_free(conn->cn_rdevent);
 	event_free(conn->cn_wrevent);
 
+	conn->cn_transport->tr_close(conn);
+
 	http2_frame_free(conn->cn_rxframe);
+	free(conn->cn_hdrbuf);
 
 	fr = conn->cn_txframe;
 	while (fr != NULL) {
@@ -101,41 +187,340 @@ http2_connection_free(struct http2_connection *conn)
 	free(conn);
 }
 
+/**
+ * Sets function called when connection is about to be freed, whatever the
+ * reason.
+ */
+void
+http2_connection_set_closecb(struct http2_connection *conn,
+    void (*cb)(struct http2_connection *, void *), void *arg)
+{
+	conn->cn_closecb = cb;
+	conn->cn_closearg = arg;
+}
+
+/**
+ * Sets function to which frames on streams (DATA, HEADERS and RST_STREAM) and
+ * WINDOW_UPDATE frames, which may also be on stream 0, are handed, along with
+ * arg. Like frame handlers, it frees the frame unless it returns -1 on a
+ * connection error, and then the connection is freed by its caller. Without
+ * one, those frames are discarded.
+ *
+ * HEADERS frames always carry a whole header block: blocks continued on
+ * CONTINUATION frames are handed over once complete, as a single HEADERS frame
+ * (with END_HEADERS and without padding or priority) whose buffer is only
+ * valid during the call.
+ */
+void
+http2_connection_set_streamcb(struct http2_connection *conn,
+    http2_stream_handler_f cb, void *arg)
+{
+	conn->cn_streamcb = cb;
+	conn->cn_streamarg = arg;
+}
+
+/**
+ * Sets function called, along with arg, once a SETTINGS frame from the remote
+ * peer is applied to cn_remsets, before it is acknowledged, so that changes
+ * to SETTINGS_INITIAL_WINDOW_SIZE reach open streams right away. On -1, a
+ * connection error, the connection is freed.
+ */
+void
+http2_connection_set_settingscb(struct http2_connection *conn,
+    int (*cb)(struct http2_connection *, void *), void *arg)
+{
+	conn->cn_settingscb = cb;
+	conn->cn_settingsarg = arg;
+}
+
+/**
+ * Sets function called, along with arg, once the frames queued are written
+ * after http2_connection_data_budget() found no room for more, so that DATA
+ * frames may be built again. On -1, the connection is freed.
+ */
+void
+http2_connection_set_draincb(struct http2_connection *conn,
+    int (*cb)(struct http2_connection *, void *), void *arg)
+{
+	conn->cn_draincb = cb;
+	conn->cn_drainarg = arg;
+}
+
+/**
+ * Enables adaptive frame sizing on connection.
+ *
+ * TCP_NOTSENT_LOWAT is set on the socket, so writing readiness is only
+ * reported when less than lowat bytes are still waiting to be sent by the
+ * kernel, and every write is limited to what fits on the congestion window
+ * (see http2_connection_send_budget()), and so is every DATA frame built
+ * (see http2_connection_data_budget()). This keeps data off the kernel's
+ * queue and frames off ours for as long as possible, so that urgent frames
+ * may still go ahead.
+ *
+ * lowat must be positive.
+ */
+int
+http2_connection_set_adaptive(struct http2_connection *conn, int lowat)
+{
+	if (lowat <= 0)
+		return -1;
+
+#if defined(TCP_NOTSENT_LOWAT) && defined(SIOCOUTQ) && defined(SIOCOUTQNSD)
+	if (setsockopt(conn->cn_sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+	    &lowat, sizeof(lowat)) < 0) {
+		prterrno("setsockopt");
+		return -1;
+	}
+	conn->cn_lowat = lowat;
+
+	prtinfo("(%d) Adaptive frame sizing enabled (lowat=%d).",
+	    conn->cn_sockfd, lowat);
+
+	return 0;
+#else
+	prterr("http2_connection_set_adaptive: not supported on this system.");
+	return -1;
+#endif
+}
+
+/**
+ * Sets timer wheel where connection's deadlines are kept; without one, there
+ * are none. The wheel must belong to the same event_base as the connection.
+ */
+void
+http2_connection_set_timers(struct http2_connection *conn,
+    struct timer_wheel *tw)
+{
+	conn->cn_timers = tw;
+
+	if (conn->cn_nnacks > 0 && timer_schedule(tw, &conn->cn_settings_timer,
+	    HTTP2_SETTINGS_ACK_TIMEOUT) < 0)
+		prterr("timer_schedule: failure.");
+}
+
+/**
+ * Returns the largest header list we take on connection: our
+ * SETTINGS_MAX_HEADER_LIST_SIZE, bounded by HTTP2_HEADER_BLOCK_MAX. It bounds
+ * both header blocks as received and the fields decoded from them.
+ */
+size_t
+http2_connection_header_max(struct http2_connection *conn)
+{
+	uint32_t max;
+
+	max = conn->cn_locsets.ss_values[HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE];
+
+	return max < HTTP2_HEADER_BLOCK_MAX ? max : HTTP2_HEADER_BLOCK_MAX;
+}
+
+/**
+ * Server side: connection must start with the client preface, which is read
+ * and checked before any frame.
+ */
+void
+http2_connection_expect_preface(struct http2_connection *conn)
+{
+	conn->cn_rxpreface = HTTP2_PREFACE_LEN;
+}
+
+/**
+ * Client side: the client preface is written ahead of the first frame sent,
+ * which must be our SETTINGS.
+ */
+void
+http2_connection_send_preface(struct http2_connection *conn)
+{
+	conn->cn_txpreface = HTTP2_PREFACE_LEN;
+}
+
+/**
+ * Returns how many bytes may be written to the socket right now.
+ *
+ * Without adaptive frame sizing there is no limit. Otherwise, it is the free
+ * space on the congestion window (cwnd * mss, or the peer's receive window if
+ * smaller, minus bytes not yet acknowledged by the remote peer), but never
+ * less than what brings the bytes not sent yet by the kernel up to lowat:
+ * about what the kernel takes at once with TCP_NOTSENT_LOWAT set. Once the window is full, writing readiness is
+ * thus only reported when acknowledgments let the kernel send some of them,
+ * and the connection still makes progress.
+ */
+ssize_t
+http2_connection_send_budget(struct http2_connection *conn)
+{
+#if defined(TCP_NOTSENT_LOWAT) && defined(SIOCOUTQ) && defined(SIOCOUTQNSD)
+	struct tcp_info ti;
+	socklen_t len;
+	ssize_t budget;
+	int outq, notsent;
+
+	if (conn->cn_lowat == 0)
+		return SSIZE_MAX;
+
+	len = sizeof(ti);
+	if (getsockopt(conn->cn_sockfd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) {
+		prterrno("getsockopt");
+		return -1;
+	}
+
+	/* Bytes on socket's output queue (not sent + not acknowledged) */
+	if (ioctl(conn->cn_sockfd, SIOCOUTQ, &outq) < 0) {
+		prterrno("ioctl");
+		return -1;
+	}
+
+	/* Bytes on it not sent yet */
+	if (ioctl(conn->cn_sockfd, SIOCOUTQNSD, &notsent) < 0) {
+		prterrno("ioctl");
+		return -1;
+	}
+
+	budget = (ssize_t)ti.tcpi_snd_cwnd * ti.tcpi_snd_mss;
+	if (len >= offsetof(struct tcp_info, tcpi_snd_wnd) +
+	    sizeof(ti.tcpi_snd_wnd) && ti.tcpi_snd_wnd < budget)
+		budget = ti.tcpi_snd_wnd;
+	budget -= outq;
+	if (budget < conn->cn_lowat - notsent)
+		budget = conn->cn_lowat - notsent;
+	if (budget < 0)
+		budget = 0;
+
+	return budget;
+#else
+	return SSIZE_MAX;
+#endif
+}
+
+/**
+ * Returns how many payload bytes the next DATA frame may take: the sending
+ * budget, less the frames already queued and its own header. On 0, the drain
+ * callback is called once the queue is written and the kernel takes more.
+ */
+ssize_t
+http2_connection_data_budget(struct http2_connection *conn)
+{
+	ssize_t budget;
+
+	budget = http2_connection_send_budget(conn);
+	if (budget < 0)
+		return -1;
+
+	budget -= conn->cn_txqueued + HTTP2_FRAME_HEADER_SIZE;
+	if (budget > 0)
+		return budget;
+
+	/* Queue may be empty already, the kernel holding what was sent */
+	conn->cn_drainwanted = 1;
+	if (conn->cn_txframe == NULL &&
+	    conn->cn_transport->tr_arm(conn, EV_WRITE) < 0) {
+		prterr("tr_arm: failure.");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Reads until the transport would block, so that its event, which is
+ * persistent, needs no rearming; after HTTP2_READ_BUDGET reads, it leaves the
+ * rest for a later loop iteration so as not to starve other connections.
+ */
 static void
 http2_connection_read(evutil_socket_t sockfd, short events, void *arg)
 {
 	struct http2_connection *conn;
+	int i, r;
+
+	conn = arg;
+
+	for (i = 0; i < HTTP2_READ_BUDGET; i++) {
+		r = http2_connection_read_step(conn);
+		if (r < 0)
+			goto error;
+		if (r == 0)
+			return;
+	}
+
+	/* Comes back later for what is left (transports with no descriptor
+	 * have to be told again) */
+	if (conn->cn_transport->tr_arm(conn, EV_READ) < 0) {
+		prterr("tr_arm: failure.");
+		goto error;
+	}
+	return;
+
+error:
+	http2_connection_free(conn);
+	return;
+}
+
+/**
+ * Reads once, handling the frame being received if that completes it. Returns
+ * 1 if there may be more to read, 0 if the transport would block and -1 on
+ * error.
+ */
+static int
+http2_connection_read_step(struct http2_connection *conn)
+{
 	struct http2_frame *fr;
 	ssize_t bytes;
 	size_t len;
 
-	conn = arg;
+	/* Client preface, possibly on several reads */
+	if (conn->cn_rxpreface > 0) {
+		char buf[HTTP2_PREFACE_LEN];
+
+		bytes = conn->cn_transport->tr_recv(conn, buf,
+		    conn->cn_rxpreface);
+		if (bytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			prterrno("recv");
+			return -1;
+		}
+		else if (bytes == 0) {
+			prterr("recv: connection was closed.");
+			return -1;
+		}
+		if (memcmp(buf, &HTTP2_PREFACE[HTTP2_PREFACE_LEN -
+		    conn->cn_rxpreface], bytes) != 0) {
+			/* TODO connection error: PROTOCOL_ERROR */
+			prtinfo("(%d) Connection error: invalid connection "
+			    "preface.", conn->cn_sockfd);
+			return -1;
+		}
+		conn->cn_rxpreface -= bytes;
+		return 1;
+	}
 
 	/* New frame received */
 	if (conn->cn_rxframe == NULL) {
-		char buf[HTTP2_FRAME_HEADER_SIZE];
+		uint8_t *buf;
 
-		/* Receives header */
-		bytes = recv(sockfd, buf, sizeof(buf), 0);
+		/* Receives header, possibly on several reads */
+		buf = conn->cn_rxhdr;
+		bytes = conn->cn_transport->tr_recv(conn,
+		    &buf[conn->cn_rxhdrlen],
+		    HTTP2_FRAME_HEADER_SIZE - conn->cn_rxhdrlen);
 		if (bytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
 			prterrno("recv");
-			goto error;
+			return -1;
 		}
 		else if (bytes == 0) {
 			prterr("recv: connection was closed.");
-			goto error;
-		}
-		else if (bytes < sizeof(buf)) {
-			/* TODO handle this */
-			prterr("recv: imcomplete reception of header.");
-			goto error;
+			return -1;
 		}
+		conn->cn_rxhdrlen += bytes;
+		if (conn->cn_rxhdrlen < HTTP2_FRAME_HEADER_SIZE)
+			return 1;
+		conn->cn_rxhdrlen = 0;
 
 		/* Creates a new frame */
 		conn->cn_rxframe = http2_frame_new(conn);
 		if (conn->cn_rxframe == NULL) {
 			prterr("http2_frame_new: failure.");
-			goto error;
+			return -1;
 		}
 
 		/* Fills frame header structure */
@@ -146,11 +531,31 @@ http2_connection_read(evutil_socket_t sockfd, short events, void *arg)
 		conn->cn_rxframe->fr_streamid =
 		    (buf[5] & 0x7F) << 24 | buf[6] << 16 | buf[7] << 8 | buf[8];
 
-		/* Allocates buffer */
-		conn->cn_rxframe->fr_buf = malloc(conn->cn_rxframe->fr_length);
-		if (conn->cn_rxframe->fr_buf == NULL) {
-			perror("malloc");
-			goto error;
+		/* Checks frame size against our SETTINGS_MAX_FRAME_SIZE */
+		if (conn->cn_rxframe->fr_length > conn->cn_rxmaxframe) {
+			/* TODO connection error: FRAME_SIZE_ERROR */
+			prtinfo("(%d) Connection error: "
+			    "frame larger than SETTINGS_MAX_FRAME_SIZE "
+			    "(size=%zu)",
+			    conn->cn_sockfd, conn->cn_rxframe->fr_length);
+			return -1;
+		}
+
+		/* Allocates buffer, unless the frame continues a header
+		 * block, which is checked before any of it is received */
+		if (conn->cn_hdrstream != 0 ||
+		    conn->cn_rxframe->fr_type == HTTP2_FRAME_CONTINUATION) {
+			if (http2_header_fragment(conn->cn_rxframe) < 0)
+				return -1;
+		}
+		else {
+			conn->cn_rxframe->fr_buf =
+			    malloc(conn->cn_rxframe->fr_length);
+			if (conn->cn_rxframe->fr_length != 0 &&
+			    conn->cn_rxframe->fr_buf == NULL) {
+				perror("malloc");
+				return -1;
+			}
 		}
 		conn->cn_rxframe->fr_buflen = 0;
 	}
@@ -160,14 +565,17 @@ http2_connection_read(evutil_socket_t sockfd, short events, void *arg)
 	/* Receives remaining bytes, if there is any to receive */
 	len = fr->fr_length - fr->fr_buflen;
 	if (len != 0) {
-		bytes = recv(sockfd, &fr->fr_buf[fr->fr_buflen], len, 0);
+		bytes = conn->cn_transport->tr_recv(conn,
+		    &fr->fr_buf[fr->fr_buflen], len);
 		if (bytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
 			prterrno("recv");
-			goto error;
+			return -1;
 		}
 		else if (bytes == 0) {
 			prterr("recv: connection was closed.");
-			goto error;
+			return -1;
 		}
 
 		fr->fr_buflen += bytes;
@@ -176,121 +584,249 @@ http2_connection_read(evutil_socket_t sockfd, short events, void *arg)
 	/* Checks buffer overflow */
 	if (fr->fr_buflen > fr->fr_length) {
 		prterr("http2_connection_read: frame buffer overflow!");
-		goto error;
+		return -1;
 	}
 
 	/* Handles fully received frame */
 	if (fr->fr_buflen == fr->fr_length) {
+		conn->cn_nrxframes++;
 		if (http2_frame_recv(fr) < 0) {
 			prterr("http2_frame_recv: failure.");
-			goto error;
+			return -1;
 		}
 		conn->cn_rxframe = NULL;
 	}
 
-	/* Rearms reading event */
-	if (event_add(conn->cn_rdevent, NULL) < 0) {
-		prterr("event_add: failure.");
-		goto error;
-	}
-	return;
-
-error:
-	http2_connection_free(conn);
-	return;
+	return 1;
 }
 
+/**
+ * Writes as many queued frames as the transport takes, gathering up to
+ * HTTP2_WRITE_IOV_MAX buffers (headers and payloads of consecutive frames) on
+ * each write. Frames are written whole: the sending budget only decides how
+ * many go, so that a frame queued ahead of the rest is never held behind one
+ * cut in two by us. Writing readiness is only waited for when the transport
+ * would block or the budget runs out. Once the queue is empty, the drain
+ * callback is called if due.
+ */
 static void
 http2_connection_write(evutil_socket_t sockfd, short events, void *arg)
 {
 	struct http2_connection *conn;
 	struct http2_frame *fr;
+	struct iovec iov[HTTP2_WRITE_IOV_MAX];
+	uint8_t hdrs[HTTP2_WRITE_IOV_MAX][HTTP2_FRAME_HEADER_SIZE];
 	ssize_t bytes;
-	size_t len;
+	ssize_t budget;
+	size_t len, total;
+	int niov, nhdrs, limited;
 
 	conn = arg;
-	fr = conn->cn_txframe;
+	sockfd = conn->cn_sockfd;
+
+	while (conn->cn_txframe != NULL) {
+		/* Gets how many bytes may be written without overfilling the
+		 * congestion window */
+		budget = http2_connection_send_budget(conn);
+		if (budget < 0) {
+			prterr("http2_connection_send_budget: failure.");
+			goto error;
+		}
+		/* Kernel holds lowat bytes it cannot send yet: it reports
+		 * readiness once acknowledgments let it */
+		if (budget == 0)
+			goto rearm;
+
+		/* Gathers what is left of the first frame, always, and the
+		 * next ones fitting on the budget; only the first may have
+		 * been partially sent, by a short write */
+		fr = conn->cn_txframe;
+		if (fr->fr_buflen == -1 && conn->cn_txhdrlen == 0)
+			http2_frame_header_pack(fr, conn->cn_txhdr);
+		niov = nhdrs = limited = 0;
+		total = 0;
+		if (conn->cn_txpreface > 0) {
+			iov[niov].iov_base = (char *)&HTTP2_PREFACE[
+			    HTTP2_PREFACE_LEN - conn->cn_txpreface];
+			iov[niov].iov_len = conn->cn_txpreface;
+			budget -= iov[niov].iov_len;
+			total += iov[niov++].iov_len;
+		}
+		for (; fr != NULL && niov + 2 <= HTTP2_WRITE_IOV_MAX;
+		    fr = fr->fr_next) {
+			size_t pos;
+
+			len = fr->fr_buflen == -1 ? HTTP2_FRAME_HEADER_SIZE +
+			    fr->fr_length : fr->fr_length - fr->fr_buflen;
+			if (fr == conn->cn_txframe && fr->fr_buflen == -1)
+				len -= conn->cn_txhdrlen;
+			if (fr != conn->cn_txframe &&
+			    (budget < 0 || len > (size_t)budget)) {
+				limited = 1;
+				break;
+			}
+			budget -= len;
+
+			if (fr->fr_buflen == -1) {
+				if (fr == conn->cn_txframe) {
+					iov[niov].iov_base =
+					    &conn->cn_txhdr[conn->cn_txhdrlen];
+					iov[niov].iov_len =
+					    HTTP2_FRAME_HEADER_SIZE -
+					    conn->cn_txhdrlen;
+				}
+				else {
+					http2_frame_header_pack(fr,
+					    hdrs[nhdrs]);
+					iov[niov].iov_base = hdrs[nhdrs++];
+					iov[niov].iov_len =
+					    HTTP2_FRAME_HEADER_SIZE;
+				}
+				total += iov[niov++].iov_len;
+				pos = 0;
+			}
+			else
+				pos = fr->fr_buflen;
+
+			if (pos < fr->fr_length) {
+				iov[niov].iov_base = &fr->fr_buf[pos];
+				iov[niov].iov_len = fr->fr_length - pos;
+				total += iov[niov++].iov_len;
+			}
+		}
 
-	/* If not sent, creates header and sends it */
-	if (fr->fr_buflen == -1) {
-		char buf[HTTP2_FRAME_HEADER_SIZE];
-
-		/* length */
-		buf[0] = (fr->fr_length & 0xFF0000U) >> 16;
-		buf[1] = (fr->fr_length & 0x00FF00U) >>  8;
-		buf[2] = (fr->fr_length & 0x0000FFU);
-		/* type */
-		buf[3] = fr->fr_type;
-		/* flags */
-		buf[4] = fr->fr_flags;
-		/* reserved bit + stream id */
-		buf[5] = (fr->fr_streamid & 0x7F000000U) >> 24;
-		buf[6] = (fr->fr_streamid & 0x00FF0000U) >> 16;
-		buf[7] = (fr->fr_streamid & 0x0000FF00U) >>  8;
-		buf[8] = (fr->fr_streamid & 0x000000FFU);
-		bytes = send(sockfd, buf, sizeof(buf), 0);
+		bytes = conn->cn_transport->tr_sendv(conn, iov, niov);
 		if (bytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				goto rearm;
 			prterrno("send");
 			goto error;
 		}
-		else if (bytes < sizeof(buf)) {
-			/* TODO handle this */
-			prterr("send: incomplete transmission of header.");
-			goto error;
+
+		/* Accounts written bytes frame by frame, freeing fully sent
+		 * ones */
+		len = bytes;
+		if (conn->cn_txpreface > 0) {
+			size_t n;
+
+			n = len < conn->cn_txpreface ? len : conn->cn_txpreface;
+			conn->cn_txpreface -= n;
+			len -= n;
+		}
+		conn->cn_txqueued -= len;
+		while (len > 0) {
+			struct http2_frame *next;
+			size_t n;
+
+			fr = conn->cn_txframe;
+
+			if (fr->fr_buflen == -1) {
+				n = HTTP2_FRAME_HEADER_SIZE - conn->cn_txhdrlen;
+				if (len < n) {
+					/* Header left partially sent is kept
+					 * on cn_txhdr */
+					if (conn->cn_txhdrlen == 0)
+						http2_frame_header_pack(fr,
+						    conn->cn_txhdr);
+					conn->cn_txhdrlen += len;
+					break;
+				}
+				len -= n;
+				conn->cn_txhdrlen = 0;
+				fr->fr_buflen = 0;
+
+				prtinfo("(%d) Header for frame of type 0x%02x "
+				    "was sent.", sockfd, fr->fr_type);
+			}
+
+			n = fr->fr_length - fr->fr_buflen;
+			if (len < n) {
+				fr->fr_buflen += len;
+				break;
+			}
+			len -= n;
+			fr->fr_buflen = fr->fr_length;
+
+			next = fr->fr_next;
+
+			prtinfo("(%d) Frame of type 0x%02x was fully sent. "
+			    "(size=%zu)", sockfd, fr->fr_type, fr->fr_length);
+
+			http2_frame_free(fr);
+			conn->cn_ntxframes++;
+
+			conn->cn_txframe = next;
+			if (next == NULL)
+				break;
 		}
-		fr->fr_buflen = 0;
 
-		prtinfo("(%d) Header for frame of type 0x%02x was sent.",
-		    sockfd, fr->fr_type);
+		/* Waits if the transport took less than given or the budget
+		 * ran out */
+		if ((size_t)bytes < total || limited)
+			goto rearm;
 	}
 
-	/* Sends remaining bytes */
-	len = fr->fr_length - fr->fr_buflen;
-	bytes = send(sockfd, &fr->fr_buf[fr->fr_buflen], len, 0);
-	if (bytes < 0) {
-		prterrno("send");
-		goto error;
+	/* Builders waiting for room may go on */
+	if (conn->cn_drainwanted) {
+		conn->cn_drainwanted = 0;
+		if (conn->cn_draincb != NULL &&
+		    conn->cn_draincb(conn, conn->cn_drainarg) < 0)
+			goto error;
 	}
 
-	fr->fr_buflen += bytes;
+	return;
 
-	/* Checks buffer overflow */
-	if (fr->fr_buflen > fr->fr_length) {
-		prterr("http2_connection_write: frame buffer overflow!");
+rearm:
+	/* Rearms writing event */
+	if (conn->cn_transport->tr_arm(conn, EV_WRITE) < 0) {
+		prterr("tr_arm: failure.");
 		goto error;
 	}
+	return;
 
-	/* Frees fully sent frame and sends next on list */
-	if (fr->fr_buflen == fr->fr_length) {
-		struct http2_frame *next;
-
-		next = fr->fr_next;
+error:
+	http2_connection_free(conn);
+	return;
+}
 
-		prtinfo("(%d) Frame of type 0x%02x was fully sent. (size=%d)",
-		    sockfd, fr->fr_type, fr->fr_length);
+/**
+ * Sockets may be in blocking mode (e.g. as returned by accept(2)), so every
+ * call is made non-blocking on its own.
+ */
+static ssize_t
+http2_socket_recv(struct http2_connection *conn, void *buf, size_t len)
+{
+	return recv(conn->cn_sockfd, buf, len, MSG_DONTWAIT);
+}
 
-		http2_frame_free(fr);
+/**
+ * Writing to a peer that reset the connection must not raise SIGPIPE, which
+ * would kill programs embedding the library: it fails with EPIPE instead.
+ */
+static ssize_t
+http2_socket_sendv(struct http2_connection *conn, const struct iovec *iov,
+    int niov)
+{
+	struct msghdr msg;
 
-		/* Returns without rearming writing event if no other frames
-		 * are to be sent */
-		if (next == NULL) {
-			conn->cn_txframe = NULL;
-			return;
-		}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = niov;
 
-		conn->cn_txframe = next;
-	}
+	return sendmsg(conn->cn_sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
 
-	/* Rearms writing event */
-	if (event_add(conn->cn_wrevent, NULL) < 0) {
-		prterr("event_add: failure.");
-		goto error;
-	}
-	return;
+static int
+http2_socket_arm(struct http2_connection *conn, short what)
+{
+	return event_add(what == EV_READ ? conn->cn_rdevent :
+	    conn->cn_wrevent, NULL);
+}
 
-error:
-	http2_connection_free(conn);
-	return;
+static void
+http2_socket_close(struct http2_connection *conn)
+{
+	close(conn->cn_sockfd);
 }
 
 struct http2_frame *
@@ -311,15 +847,86 @@ http2_frame_new(struct http2_connection *conn)
 }
 
 /**
- * http2_frame_free() does not and should not free next frames on list.
+ * Writes frame header, as sent on the wire, on buf (HTTP2_FRAME_HEADER_SIZE
+ * bytes).
+ */
+void
+http2_frame_header_pack(struct http2_frame *fr, uint8_t *buf)
+{
+	/* length */
+	buf[0] = (fr->fr_length & 0xFF0000U) >> 16;
+	buf[1] = (fr->fr_length & 0x00FF00U) >>  8;
+	buf[2] = (fr->fr_length & 0x0000FFU);
+	/* type */
+	buf[3] = fr->fr_type;
+	/* flags */
+	buf[4] = fr->fr_flags;
+	/* reserved bit + stream id */
+	buf[5] = (fr->fr_streamid & 0x7F000000U) >> 24;
+	buf[6] = (fr->fr_streamid & 0x00FF0000U) >> 16;
+	buf[7] = (fr->fr_streamid & 0x0000FF00U) >>  8;
+	buf[8] = (fr->fr_streamid & 0x000000FFU);
+}
+
+/**
+ * Inserts frame on connection's sending list.
+ *
+ * Urgent frames (those on stream 0, RST_STREAM and WINDOW_UPDATE) go ahead of
+ * DATA frames of other streams that have not started being sent yet;
+ * everything else goes to the end of the list. Frames of a single stream are
+ * never reordered, and header blocks never split, as no DATA frame comes
+ * within them.
  */
 static void
+http2_frame_enqueue(struct http2_connection *conn, struct http2_frame *fr)
+{
+	struct http2_frame **pos, **next;
+
+	fr->fr_next = NULL;
+
+	if (fr->fr_streamid == 0 || fr->fr_type == HTTP2_FRAME_RST_STREAM ||
+	    fr->fr_type == HTTP2_FRAME_WINDOW_UPDATE) {
+		/* First DATA frame not started yet after the last frame of
+		 * the same stream, if any */
+		pos = NULL;
+		for (next = &conn->cn_txframe; *next != NULL;
+		    next = &(*next)->fr_next) {
+			if ((*next)->fr_streamid == fr->fr_streamid)
+				pos = NULL;
+			else if (pos == NULL &&
+			    (*next)->fr_type == HTTP2_FRAME_DATA &&
+			    (*next)->fr_buflen == -1 &&
+			    (*next != conn->cn_txframe ||
+			    conn->cn_txhdrlen == 0))
+				pos = next;
+		}
+		if (pos == NULL)
+			pos = next;
+	}
+	else if (conn->cn_txframe == NULL)
+		pos = &conn->cn_txframe;
+	else
+		pos = &conn->cn_txlastframe->fr_next;
+
+	fr->fr_next = *pos;
+	*pos = fr;
+	if (fr->fr_next == NULL)
+		conn->cn_txlastframe = fr;
+}
+
+/**
+ * http2_frame_free() does not and should not free next frames on list.
+ */
+void
 http2_frame_free(struct http2_frame *fr)
 {
 	if (fr == NULL)
 		return;
 
-	free(fr->fr_buf);
+	if (fr->fr_buffree != NULL)
+		fr->fr_buffree(fr->fr_bufarg);
+	else
+		free(fr->fr_buf);
 	free(fr);
 }
 
@@ -331,14 +938,20 @@ http2_frame_recv(struct http2_frame *fr)
 	if (fr == NULL)
 		return -1;
 
-	prtinfo("(%d) RX frame: len=%d type=%02x flags=%02x stream=%d\n",
+	prtinfo("(%d) RX frame: len=%zu type=%02x flags=%02x stream=%d\n",
 	    fr->fr_conn->cn_sockfd, fr->fr_length, fr->fr_type,
 	    fr->fr_flags, fr->fr_streamid);
 
+	if (trace_recorder != NULL)
+		trace_frame(trace_recorder, fr, TRACE_RX);
+
 	/* Looks for and calls handler for this frame type */
-	for (fh = http2_frame_handlers; fh->fh_type != -1; fh++)
-		if (fh->fh_type == fr->fr_type)
-			return fh->fh_handler(fr);
+	for (fh = http2_frame_handlers; fh->fh_type != -1; fh++) {
+		if (fh->fh_type != fr->fr_type)
+			continue;
+
+		return fh->fh_handler(fr);
+	}
 
 	/* Not supported frames must be ignored and discarded */
 	prtinfo("(%d) Unsupported frame type - ignored.", fr->fr_conn->cn_sockfd);
@@ -346,37 +959,155 @@ http2_frame_recv(struct http2_frame *fr)
 	return 0;
 }
 
-static int
+/**
+ * Enqueues frame for sending.
+ *
+ * Nothing is written right away: the writing event is made active instead, so
+ * that the connection is flushed once all events ready on this loop iteration
+ * have run, with every frame queued meanwhile on as few writes as possible.
+ * Writing readiness is only waited for if the transport then would block.
+ */
+int
 http2_frame_send(struct http2_frame *fr)
 {
+	struct http2_connection *conn;
+
 	if (fr == NULL)
 		return -1;
 
+	conn = fr->fr_conn;
+
+	if (trace_recorder != NULL)
+		trace_frame(trace_recorder, fr, TRACE_TX);
+
 	/* Enqueues frame */
-	if (fr->fr_conn->cn_txframe == NULL)
-		fr->fr_conn->cn_txframe = fr;
-	else
-		fr->fr_conn->cn_txlastframe->fr_next = fr;
-	fr->fr_conn->cn_txlastframe = fr;
+	http2_frame_enqueue(conn, fr);
+	conn->cn_txqueued += HTTP2_FRAME_HEADER_SIZE + fr->fr_length;
+
+	prtinfo("(%d) Frame of type 0x%02x enqueued for sending. (size=%zu)",
+	    conn->cn_sockfd, fr->fr_type, fr->fr_length);
 
-	prtinfo("(%d) Frame of type 0x%02x enqueued for sending. (size=%d)",
-	    fr->fr_conn->cn_sockfd, fr->fr_type, fr->fr_length);
+	/* Schedules a flush, unless one is already due or the transport is
+	 * being waited for */
+	if (!event_pending(conn->cn_wrevent, EV_WRITE, NULL))
+		event_active(conn->cn_wrevent, EV_WRITE, 1);
 
-	/* Arms writing event */
-	if (event_add(fr->fr_conn->cn_wrevent, NULL) < 0) {
-		prterr("event_add: failure.");
-		http2_connection_free(fr->fr_conn);
+	return 0;
+}
+
+static int
+http2_frame_stream_handler(struct http2_frame *fr)
+{
+	struct http2_connection *conn;
+
+	conn = fr->fr_conn;
+
+	/* TODO connection error: PROTOCOL_ERROR */
+	if (fr->fr_streamid == 0 && fr->fr_type != HTTP2_FRAME_WINDOW_UPDATE) {
+		prtinfo("(%d) Connection error: frame of type 0x%02x on "
+		    "stream 0.", conn->cn_sockfd, fr->fr_type);
 		return -1;
 	}
 
+	if (conn->cn_streamcb == NULL) {
+		http2_frame_free(fr);
+		return 0;
+	}
+
+	return conn->cn_streamcb(fr, conn->cn_streamarg);
+}
+
+/**
+ * Hands complete header blocks over; others start being assembled on
+ * cn_hdrbuf, without padding and priority.
+ */
+static int
+http2_frame_headers_handler(struct http2_frame *fr)
+{
+	struct http2_connection *conn;
+	size_t pos, len;
+
+	conn = fr->fr_conn;
+
+	if (fr->fr_flags & HTTP2_FRAME_HEADERS_END_HEADERS ||
+	    fr->fr_streamid == 0)
+		return http2_frame_stream_handler(fr);
+
+	pos = 0;
+	len = fr->fr_length;
+	if (fr->fr_flags & HTTP2_FRAME_HEADERS_PADDED) {
+		if (len < 1 || (uint8_t)fr->fr_buf[0] >= len)
+			goto protocol_error;
+		len -= 1 + (uint8_t)fr->fr_buf[0];
+		pos++;
+	}
+	if (fr->fr_flags & HTTP2_FRAME_HEADERS_PRIORITY) {
+		if (len < 5)
+			goto protocol_error;
+		len -= 5;
+		pos += 5;
+	}
+
+	if (len > http2_connection_header_max(conn)) {
+		/* TODO connection error: ENHANCE_YOUR_CALM */
+		prtinfo("(%d) Connection error: header block larger than %zu "
+		    "bytes.", conn->cn_sockfd,
+		    http2_connection_header_max(conn));
+		return -1;
+	}
+	if (http2_header_reserve(conn, len) < 0)
+		return -1;
+	memcpy(conn->cn_hdrbuf, &fr->fr_buf[pos], len);
+	conn->cn_hdrlen = len;
+	conn->cn_hdrstream = fr->fr_streamid;
+	conn->cn_hdrflags = fr->fr_flags & HTTP2_FRAME_HEADERS_END_STREAM;
+	conn->cn_hdrnfrags = 0;
+
+	http2_frame_free(fr);
+
 	return 0;
+
+protocol_error:
+	/* TODO connection error: PROTOCOL_ERROR */
+	prtinfo("(%d) Connection error: HEADERS frame with wrong padding or "
+	    "priority.", conn->cn_sockfd);
+	return -1;
 }
 
+/**
+ * Fragment was received right onto cn_hdrbuf (see http2_header_fragment());
+ * the last one turns into a HEADERS frame with the whole block.
+ */
 static int
-http2_frame_settings_handler(struct http2_frame *fr)
+http2_frame_continuation_handler(struct http2_frame *fr)
 {
-	int pos;
+	struct http2_connection *conn;
+	int r;
+
+	conn = fr->fr_conn;
+	conn->cn_hdrlen += fr->fr_length;
+	conn->cn_hdrnfrags++;
 
+	if (!(fr->fr_flags & HTTP2_FRAME_CONTINUATION_END_HEADERS)) {
+		http2_frame_free(fr);
+		return 0;
+	}
+
+	fr->fr_type = HTTP2_FRAME_HEADERS;
+	fr->fr_flags = HTTP2_FRAME_HEADERS_END_HEADERS | conn->cn_hdrflags;
+	fr->fr_buf = conn->cn_hdrbuf;
+	fr->fr_length = conn->cn_hdrlen;
+
+	conn->cn_hdrstream = 0;
+	r = http2_frame_stream_handler(fr);
+	conn->cn_hdrlen = 0;
+
+	return r;
+}
+
+static int
+http2_frame_settings_handler(struct http2_frame *fr)
+{
 	/* Checks frame size */
 	if ((!(fr->fr_flags & HTTP2_FRAME_SETTINGS_ACK) &&
 	    fr->fr_length % HTTP2_FRAME_SETTINGS_PARAM_SIZE != 0) ||
@@ -385,7 +1116,7 @@ http2_frame_settings_handler(struct http2_frame *fr)
 		/* TODO connection error: FRAME_SIZE_ERROR */
 		prtinfo("(%d) Connection error: "
 		    "SETTINGS frame with wrong frame size "
-		    "(size=%d,ack=%d)",
+		    "(size=%zu,ack=%d)",
 		    fr->fr_conn->cn_sockfd, fr->fr_length,
 		    fr->fr_flags & HTTP2_FRAME_SETTINGS_ACK);
 		return -1;
@@ -402,36 +1133,54 @@ http2_frame_settings_handler(struct http2_frame *fr)
 		return -1;
 	}
 
-	/* On ACK reception, the new requested frames can be set definitely */
+	/* On ACK reception, the oldest local settings sent are now in effect */
 	if (fr->fr_flags & HTTP2_FRAME_SETTINGS_ACK) {
-		/* TODO set new settings definitely */
-		prtinfo("(%d) Previously sent SETTINGS frame acknowledged.",
-		    fr->fr_conn->cn_sockfd);
+		struct http2_connection *conn;
+
+		conn = fr->fr_conn;
+		if (conn->cn_nnacks == 0)
+			prtinfo("(%d) Unexpected SETTINGS ACK - ignored.",
+			    conn->cn_sockfd);
+		else {
+			conn->cn_locsets =
+			    conn->cn_locsets_nack[conn->cn_nackfirst];
+			conn->cn_rxmaxframe = conn->cn_locsets.ss_values[
+			    HTTP2_SETTINGS_MAX_FRAME_SIZE];
+			conn->cn_nackfirst =
+			    (conn->cn_nackfirst + 1) % HTTP2_SETTINGS_NACK_MAX;
+			conn->cn_nnacks--;
+			prtinfo("(%d) Previously sent SETTINGS frame "
+			    "acknowledged.", conn->cn_sockfd);
+
+			/* Next one waiting, if any, gets a full timeout */
+			if (conn->cn_timers != NULL) {
+				if (conn->cn_nnacks == 0)
+					timer_cancel(conn->cn_timers,
+					    &conn->cn_settings_timer);
+				else if (timer_schedule(conn->cn_timers,
+				    &conn->cn_settings_timer,
+				    HTTP2_SETTINGS_ACK_TIMEOUT) < 0) {
+					prterr("timer_schedule: failure.");
+					return -1;
+				}
+			}
+		}
+
+		http2_frame_free(fr);
 		return 0;
 	}
 
-	prtinfo("(%d) SETTINGS frame received with %d setting(s).",
+	prtinfo("(%d) SETTINGS frame received with %zu setting(s).",
 	    fr->fr_conn->cn_sockfd,
 	    fr->fr_length / HTTP2_FRAME_SETTINGS_PARAM_SIZE);
 
-	/* Saves remote's settings */
-	for (pos = 0; pos < fr->fr_length;
-	    pos += HTTP2_FRAME_SETTINGS_PARAM_SIZE) {
-		struct http2_setting set;
-		char *ptr;
-
-		ptr = &fr->fr_buf[pos];
-
-		set.set_id = ptr[0] << 8 | ptr[1];
-		set.set_value = ptr[2] << 24 | ptr[3] << 16 | ptr[4] << 8 | ptr[5];
-		/* TODO set settings!
-		http2_setting_set(set);
-		*/
-		prtinfo("(%d) New setting: "
-		    "[0x%04x] = 0x%08x.",
-		    fr->fr_conn->cn_sockfd,
-		    set.set_id, set.set_value);
-	}
+	if (http2_settings_apply(fr->fr_conn, (uint8_t *)fr->fr_buf,
+	    fr->fr_length) < 0)
+		return -1;
+	if (fr->fr_conn->cn_settingscb != NULL &&
+	    fr->fr_conn->cn_settingscb(fr->fr_conn,
+	    fr->fr_conn->cn_settingsarg) < 0)
+		return -1;
 
 	/* Sends ACK to remote peer */
 	if (http2_frame_settings_send(fr->fr_conn, NULL, 0, 1) < 0) {
@@ -447,11 +1196,34 @@ http2_frame_settings_handler(struct http2_frame *fr)
 	return 0;
 }
 
+/**
+ * Non-ACK frames carry set, whose values take effect locally only once the
+ * remote peer acknowledges them; meanwhile, they are kept as a snapshot on
+ * cn_locsets_nack.
+ */
 static int
 http2_frame_settings_send(struct http2_connection *conn,
     struct http2_setting *set, int nsets, int ack)
 {
+	struct http2_settings *snap;
 	struct http2_frame *fr;
+	int i;
+
+	if (!ack && conn->cn_nnacks == HTTP2_SETTINGS_NACK_MAX) {
+		prterr("http2_frame_settings_send: "
+		    "too many SETTINGS frames waiting for ACK.");
+		return -1;
+	}
+
+	for (i = 0; i < nsets; i++) {
+		if (set[i].set_id == 0 || set[i].set_id > HTTP2_SETTINGS_MAX ||
+		    http2_setting_check(&set[i]) < 0) {
+			prterr("http2_frame_settings_send: "
+			    "invalid setting [0x%04x] = 0x%08x.",
+			    set[i].set_id, set[i].set_value);
+			return -1;
+		}
+	}
 
 	fr = http2_frame_new(conn);
 	if (fr == NULL) {
@@ -467,8 +1239,51 @@ http2_frame_settings_send(struct http2_connection *conn,
 		fr->fr_length = 0;
 		fr->fr_flags = HTTP2_FRAME_SETTINGS_ACK;
 	}
-	else
+	else {
 		fr->fr_length = nsets * HTTP2_FRAME_SETTINGS_PARAM_SIZE;
+		fr->fr_buf = malloc(fr->fr_length);
+		if (fr->fr_length != 0 && fr->fr_buf == NULL) {
+			prterrno("malloc");
+			http2_frame_free(fr);
+			return -1;
+		}
+
+		/* Snapshot starts from the latest settings sent */
+		snap = &conn->cn_locsets_nack[(conn->cn_nackfirst +
+		    conn->cn_nnacks) % HTTP2_SETTINGS_NACK_MAX];
+		if (conn->cn_nnacks == 0)
+			*snap = conn->cn_locsets;
+		else
+			*snap = conn->cn_locsets_nack[(conn->cn_nackfirst +
+			    conn->cn_nnacks - 1) % HTTP2_SETTINGS_NACK_MAX];
+
+		for (i = 0; i < nsets; i++) {
+			uint8_t *ptr;
+
+			ptr = (uint8_t *)&fr->fr_buf[
+			    i * HTTP2_FRAME_SETTINGS_PARAM_SIZE];
+			ptr[0] = set[i].set_id >> 8;
+			ptr[1] = set[i].set_id;
+			ptr[2] = set[i].set_value >> 24;
+			ptr[3] = set[i].set_value >> 16;
+			ptr[4] = set[i].set_value >> 8;
+			ptr[5] = set[i].set_value;
+
+			snap->ss_values[set[i].set_id] = set[i].set_value;
+		}
+		conn->cn_nnacks++;
+
+		/* Times out if this is the only one waiting for ACK */
+		if (conn->cn_timers != NULL &&
+		    !conn->cn_settings_timer.tm_pending &&
+		    timer_schedule(conn->cn_timers, &conn->cn_settings_timer,
+		    HTTP2_SETTINGS_ACK_TIMEOUT) < 0) {
+			prterr("timer_schedule: failure.");
+			conn->cn_nnacks--;
+			http2_frame_free(fr);
+			return -1;
+		}
+	}
 
 	prtinfo("(%d) SETTINGS frame being sent (nsets=%d,ack=%d).",
 	    conn->cn_sockfd, nsets, ack);
@@ -481,9 +1296,195 @@ http2_frame_settings_send(struct http2_connection *conn,
 	return 0;
 }
 
+/**
+ * Checks frame, whose header was just received, while a header block may be
+ * being assembled: only CONTINUATION frames of that block are allowed, up to
+ * HTTP2_HEADER_FRAGMENTS_MAX of them and as long as the block stays within
+ * http2_connection_header_max(). Floods are so turned down before their
+ * payload is even received. The fragment is then received right after the
+ * block so far.
+ */
+static int
+http2_header_fragment(struct http2_frame *fr)
+{
+	struct http2_connection *conn;
+
+	conn = fr->fr_conn;
+
+	if (fr->fr_type != HTTP2_FRAME_CONTINUATION ||
+	    conn->cn_hdrstream == 0 || fr->fr_streamid != conn->cn_hdrstream) {
+		/* TODO connection error: PROTOCOL_ERROR */
+		prtinfo("(%d) Connection error: frame of type 0x%02x on "
+		    "stream %u while assembling header block of stream %u.",
+		    conn->cn_sockfd, fr->fr_type, fr->fr_streamid,
+		    conn->cn_hdrstream);
+		return -1;
+	}
+
+	if (conn->cn_hdrnfrags >= HTTP2_HEADER_FRAGMENTS_MAX ||
+	    fr->fr_length > http2_connection_header_max(conn) -
+	    conn->cn_hdrlen) {
+		/* TODO connection error: ENHANCE_YOUR_CALM */
+		prtinfo("(%d) Connection error: header block larger than %zu "
+		    "bytes or on more than %d frames.", conn->cn_sockfd,
+		    http2_connection_header_max(conn),
+		    HTTP2_HEADER_FRAGMENTS_MAX);
+		return -1;
+	}
+
+	if (http2_header_reserve(conn, conn->cn_hdrlen + fr->fr_length) < 0)
+		return -1;
+	fr->fr_buf = &conn->cn_hdrbuf[conn->cn_hdrlen];
+	fr->fr_buffree = http2_header_keep;
+
+	return 0;
+}
+
+/**
+ * Makes room for size bytes on cn_hdrbuf, which only grows. It is allocated
+ * even for empty blocks, as fragments are copied to it.
+ */
+static int
+http2_header_reserve(struct http2_connection *conn, size_t size)
+{
+	char *buf;
+	size_t n;
+
+	if (conn->cn_hdrbuf != NULL && size <= conn->cn_hdrbufsize)
+		return 0;
+
+	n = conn->cn_hdrbufsize == 0 ? 1024 : conn->cn_hdrbufsize;
+	while (n < size)
+		n *= 2;
+
+	buf = realloc(conn->cn_hdrbuf, n);
+	if (buf == NULL) {
+		prterrno("realloc");
+		return -1;
+	}
+	conn->cn_hdrbuf = buf;
+	conn->cn_hdrbufsize = n;
+
+	return 0;
+}
+
+/**
+ * Frames on cn_hdrbuf do not own their buffer.
+ */
+static void
+http2_header_keep(void *arg)
+{
+}
+
+/**
+ * Peer did not acknowledge our SETTINGS in time.
+ */
+static void
+http2_settings_timeout(struct timer *tm, void *arg)
+{
+	struct http2_connection *conn;
+
+	conn = arg;
+
+	/* TODO connection error: SETTINGS_TIMEOUT */
+	prtinfo("(%d) Connection error: SETTINGS frame not acknowledged in "
+	    "%d ms.", conn->cn_sockfd, HTTP2_SETTINGS_ACK_TIMEOUT);
+	http2_connection_free(conn);
+}
+
+/**
+ * Sets initial values (RFC 7540, Section 6.5.2).
+ */
+static void
+http2_settings_init(struct http2_settings *ss)
+{
+	ss->ss_values[0] = 0;
+	ss->ss_values[HTTP2_SETTINGS_HEADER_TABLE_SIZE] = 4096;
+	ss->ss_values[HTTP2_SETTINGS_ENABLE_PUSH] = 1;
+	ss->ss_values[HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS] = UINT32_MAX;
+	ss->ss_values[HTTP2_SETTINGS_INITIAL_WINDOW_SIZE] = 65535;
+	ss->ss_values[HTTP2_SETTINGS_MAX_FRAME_SIZE] =
+	    HTTP2_FRAME_MAX_SIZE_DEFAULT;
+	ss->ss_values[HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE] = UINT32_MAX;
+}
+
+/**
+ * Checks value of a known setting.
+ */
+static int
+http2_setting_check(struct http2_setting *set)
+{
+	switch (set->set_id) {
+	case HTTP2_SETTINGS_ENABLE_PUSH:
+		return set->set_value <= 1 ? 0 : -1;
+	case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+		return set->set_value <= 0x7FFFFFFFU ? 0 : -1;
+	case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+		return set->set_value >= HTTP2_FRAME_MAX_SIZE_DEFAULT &&
+		    set->set_value <= 0xFFFFFFU ? 0 : -1;
+	default:
+		return 0;
+	}
+}
+
 int
 http2_settings_send(struct http2_connection *conn, struct http2_setting *set, int nsets)
 {
 	return http2_frame_settings_send(conn, set, nsets, 0);
 }
 
+/**
+ * Checks and saves remote's settings, in order, from a SETTINGS payload of len
+ * bytes: that of a frame, or the HTTP2-Settings header field of an upgrade
+ * request, which needs no ACK (RFC 7540, Section 3.2.1).
+ */
+int
+http2_settings_apply(struct http2_connection *conn, const uint8_t *buf,
+    size_t len)
+{
+	size_t pos;
+
+	if (len % HTTP2_FRAME_SETTINGS_PARAM_SIZE != 0)
+		return -1;
+
+	for (pos = 0; pos < len; pos += HTTP2_FRAME_SETTINGS_PARAM_SIZE) {
+		struct http2_setting set;
+		const uint8_t *ptr;
+
+		ptr = &buf[pos];
+
+		set.set_id = ptr[0] << 8 | ptr[1];
+		set.set_value = (uint32_t)ptr[2] << 24 | ptr[3] << 16 |
+		    ptr[4] << 8 | ptr[5];
+
+		/* Unknown settings must be ignored */
+		if (set.set_id == 0 || set.set_id > HTTP2_SETTINGS_MAX) {
+			prtinfo("(%d) Unknown setting 0x%04x - ignored.",
+			    conn->cn_sockfd, set.set_id);
+			continue;
+		}
+
+		if (http2_setting_check(&set) < 0) {
+			/* TODO connection error: PROTOCOL_ERROR or
+			 * FLOW_CONTROL_ERROR */
+			prtinfo("(%d) Connection error: "
+			    "invalid value for setting "
+			    "[0x%04x] = 0x%08x",
+			    conn->cn_sockfd,
+			    set.set_id, set.set_value);
+			return -1;
+		}
+
+		conn->cn_remsets.ss_values[set.set_id] = set.set_value;
+		if (set.set_id == HTTP2_SETTINGS_MAX_FRAME_SIZE)
+			conn->cn_txmaxframe = set.set_value;
+
+		prtinfo("(%d) New setting: "
+		    "[0x%04x] = 0x%08x.",
+		    conn->cn_sockfd,
+		    set.set_id, set.set_value);
+	}
+
+	return 0;
+}
+
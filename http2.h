@@ -7,17 +7,86 @@
 
 #define HTTP2_FRAME_HEADER_SIZE 9
 
+/* Client connection preface, followed by a SETTINGS frame (RFC 7540,
+ * Section 3.5) */
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN 24
+
 /* Frames types */
+#define HTTP2_FRAME_DATA 0x00
+#define HTTP2_FRAME_HEADERS 0x01
+#define HTTP2_FRAME_RST_STREAM 0x03
 #define HTTP2_FRAME_SETTINGS 0x04
+#define HTTP2_FRAME_WINDOW_UPDATE 0x08
+#define HTTP2_FRAME_CONTINUATION 0x09
+
+/* DATA frame flags */
+#define HTTP2_FRAME_DATA_END_STREAM 0x01
+#define HTTP2_FRAME_DATA_PADDED 0x08
+
+/* HEADERS frame flags */
+#define HTTP2_FRAME_HEADERS_END_STREAM 0x01
+#define HTTP2_FRAME_HEADERS_END_HEADERS 0x04
+#define HTTP2_FRAME_HEADERS_PADDED 0x08
+#define HTTP2_FRAME_HEADERS_PRIORITY 0x20
+
+/* CONTINUATION frame flags */
+#define HTTP2_FRAME_CONTINUATION_END_HEADERS 0x04
 
 /* SETTINGS frame flags */
 #define HTTP2_FRAME_SETTINGS_ACK 0x01
 
+/* Initial (and smallest) SETTINGS_MAX_FRAME_SIZE */
+#define HTTP2_FRAME_MAX_SIZE_DEFAULT 16384
+
 #define HTTP2_FRAME_SETTINGS_PARAM_SIZE 6
+#define HTTP2_FRAME_RST_STREAM_SIZE 4
+#define HTTP2_FRAME_WINDOW_UPDATE_SIZE 4
+
+/* Largest flow-control window */
+#define HTTP2_WINDOW_MAX 0x7FFFFFFF
+
+/* Error codes (RST_STREAM and GOAWAY) */
+#define HTTP2_NO_ERROR 0x0
+#define HTTP2_PROTOCOL_ERROR 0x1
+#define HTTP2_INTERNAL_ERROR 0x2
+#define HTTP2_FLOW_CONTROL_ERROR 0x3
+#define HTTP2_REFUSED_STREAM 0x7
+#define HTTP2_CANCEL 0x8
+
+/* SETTINGS parameters */
+#define HTTP2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define HTTP2_SETTINGS_ENABLE_PUSH 0x2
+#define HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define HTTP2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define HTTP2_SETTINGS_MAX_FRAME_SIZE 0x5
+#define HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+#define HTTP2_SETTINGS_MAX 0x6
+
+/* How many sent SETTINGS frames may wait for an ACK */
+#define HTTP2_SETTINGS_NACK_MAX 4
+
+/* How long to wait for a SETTINGS ACK, in milliseconds */
+#define HTTP2_SETTINGS_ACK_TIMEOUT 10000
+
+#define HTTP2_CACHE_LINE_SIZE 64
+
+/* Largest header block assembled, unless our SETTINGS_MAX_HEADER_LIST_SIZE
+ * is lower, and most CONTINUATION frames it may span */
+#define HTTP2_HEADER_BLOCK_MAX 65536
+#define HTTP2_HEADER_FRAGMENTS_MAX 32
+
+/* Reads done on a connection per readiness notification, at most */
+#define HTTP2_READ_BUDGET 64
+
+/* Buffers gathered on a single write (header and payload of each frame) */
+#define HTTP2_WRITE_IOV_MAX 64
 
 struct http2_frame;
+struct iovec;
 
 typedef int (*http2_frame_handler_f)(struct http2_frame *);
+typedef int (*http2_stream_handler_f)(struct http2_frame *, void *);
 
 struct http2_frame_handler {
 	int fh_type;
@@ -31,6 +100,10 @@ struct http2_frame_handler {
  *   Informs how much of data on buffer was already filled/consumed.
  *   If fr_buflen == -1, header has not yet been received/sent. In this case, when
  *   receiving, buffer will not be allocated yet.
+ *
+ * fr_buffree:
+ *   If set, fr_buf is not owned by the frame (e.g. it points into a cached
+ *   response) and fr_buffree(fr_bufarg) is called instead of free(fr_buf).
  */
 struct http2_frame {
 	struct http2_connection *fr_conn;
@@ -40,6 +113,8 @@ struct http2_frame {
 	uint32_t fr_streamid;
 	char *fr_buf;
 	size_t fr_buflen;
+	void (*fr_buffree)(void *);
+	void *fr_bufarg;
 	struct http2_frame *fr_next;
 };
 
@@ -48,24 +123,121 @@ struct http2_setting {
 	uint32_t set_value;
 };
 
+/**
+ * Settings values, indexed by SETTINGS parameter ID (index 0 is not used)
+ */
+struct http2_settings {
+	uint32_t ss_values[HTTP2_SETTINGS_MAX + 1];
+};
+
+/**
+ * Transport under a connection
+ *
+ * tr_recv and tr_sendv behave like recv(2) and writev(2), never blocking and
+ * setting errno to EAGAIN when they would. tr_arm arms connection's EV_READ
+ * (cn_rdevent, persistent) or EV_WRITE (cn_wrevent) event. tr_close releases
+ * the transport.
+ */
+struct http2_transport {
+	ssize_t (*tr_recv)(struct http2_connection *, void *, size_t);
+	ssize_t (*tr_sendv)(struct http2_connection *, const struct iovec *,
+	    int);
+	int (*tr_arm)(struct http2_connection *, short);
+	void (*tr_close)(struct http2_connection *);
+};
+
+/**
+ * Connection structure
+ *
+ * Fields used on every frame come first, within the first two cache lines
+ * (the structure is allocated aligned to them): cn_rxmaxframe and
+ * cn_txmaxframe keep the SETTINGS_MAX_FRAME_SIZE values there, out of
+ * cn_locsets and cn_remsets. Less used state and the settings follow.
+ *
+ * cn_locsets_nack:
+ *   Ring of local settings sent but not yet acknowledged, each one a full
+ *   snapshot of what cn_locsets becomes once its ACK arrives.
+ *
+ * cn_hdrbuf:
+ *   Header block started by a HEADERS frame without END_HEADERS, joined with
+ *   its CONTINUATION frames, which are received right onto it. While
+ *   cn_hdrstream is not 0, no other frame may come.
+ */
 struct http2_connection {
 	int cn_sockfd;
-	struct event *cn_rdevent;
-	struct event *cn_wrevent;
-	struct http2_setting *cn_remsets; /* settings from remote peer */
-	struct http2_setting *cn_locsets; /* local settings */
-	struct http2_setting *cn_locsets_nack; /* local settings not ACK'ed */
+	uint32_t cn_hdrstream; /* stream of the header block being assembled */
 	struct http2_frame *cn_rxframe; /* currently being recepted frame */
 	struct http2_frame *cn_txframe; /* currently being sent frame */
 	struct http2_frame *cn_txlastframe; /* last frame to be sent on list */
+	struct event *cn_wrevent;
+	const struct http2_transport *cn_transport;
+	void *cn_trdata; /* transport's private data */
+	http2_stream_handler_f cn_streamcb; /* owner's handler of stream frames */
+	void *cn_streamarg;
+	size_t cn_txqueued; /* bytes on the frame queue not written yet */
+	uint64_t cn_nrxframes; /* frames received */
+	uint64_t cn_ntxframes; /* frames fully sent */
+	uint32_t cn_rxmaxframe; /* our SETTINGS_MAX_FRAME_SIZE, acknowledged */
+	uint32_t cn_txmaxframe; /* peer's SETTINGS_MAX_FRAME_SIZE */
+	uint8_t cn_rxhdr[HTTP2_FRAME_HEADER_SIZE]; /* header being received */
+	uint8_t cn_txhdr[HTTP2_FRAME_HEADER_SIZE]; /* header being sent */
+	uint8_t cn_rxhdrlen; /* bytes on cn_rxhdr */
+	uint8_t cn_txhdrlen; /* bytes of cn_txhdr already sent */
+	uint8_t cn_rxpreface; /* client preface bytes still to be received */
+	uint8_t cn_txpreface; /* client preface bytes still to be sent */
+
+	int cn_lowat; /* TCP_NOTSENT_LOWAT, 0 if adaptive sizing is off */
+	uint32_t cn_id; /* unique on the process */
+	struct event *cn_rdevent;
+	void (*cn_closecb)(struct http2_connection *, void *);
+	void *cn_closearg;
+	int (*cn_settingscb)(struct http2_connection *, void *);
+	void *cn_settingsarg;
+	int (*cn_draincb)(struct http2_connection *, void *);
+	void *cn_drainarg;
+	int cn_drainwanted; /* cn_draincb is due once the queue is written */
+	struct timer_wheel *cn_timers; /* wheel for deadlines, if any */
+	struct timer cn_settings_timer; /* oldest SETTINGS waiting for ACK */
+	char *cn_hdrbuf; /* header block being assembled, reused */
+	size_t cn_hdrbufsize;
+	size_t cn_hdrlen; /* bytes on cn_hdrbuf */
+	uint8_t cn_hdrflags; /* END_STREAM of its HEADERS frame */
+	uint8_t cn_hdrnfrags; /* CONTINUATION frames so far */
+
+	struct http2_settings cn_remsets; /* settings from remote peer */
+	struct http2_settings cn_locsets; /* local settings */
+	struct http2_settings cn_locsets_nack[HTTP2_SETTINGS_NACK_MAX];
+	uint8_t cn_nackfirst; /* oldest snapshot on cn_locsets_nack */
+	uint8_t cn_nnacks; /* snapshots on cn_locsets_nack */
 };
 
+extern const struct http2_transport http2_transport_socket;
+
 struct http2_connection *http2_connection_new(int, struct event_base *);
+struct http2_connection *http2_connection_new_transport(int,
+    const struct http2_transport *, void *, struct event_base *);
 void http2_connection_free(struct http2_connection *);
+void http2_connection_set_closecb(struct http2_connection *,
+    void (*)(struct http2_connection *, void *), void *);
+void http2_connection_set_streamcb(struct http2_connection *,
+    http2_stream_handler_f, void *);
+void http2_connection_set_settingscb(struct http2_connection *,
+    int (*)(struct http2_connection *, void *), void *);
+void http2_connection_set_draincb(struct http2_connection *,
+    int (*)(struct http2_connection *, void *), void *);
+ssize_t http2_connection_send_budget(struct http2_connection *);
+ssize_t http2_connection_data_budget(struct http2_connection *);
+size_t http2_connection_header_max(struct http2_connection *);
+void http2_connection_expect_preface(struct http2_connection *);
+void http2_connection_send_preface(struct http2_connection *);
 
 struct http2_frame *http2_frame_new(struct http2_connection *);
+void http2_frame_free(struct http2_frame *);
+int http2_frame_send(struct http2_frame *);
+void http2_frame_header_pack(struct http2_frame *, uint8_t *);
 
 int http2_settings_send(struct http2_connection *, struct http2_setting *, int);
+int http2_settings_apply(struct http2_connection *, const uint8_t *, size_t);
 
 #endif /* !__HTTP2_H__ */
 
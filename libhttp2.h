@@ -0,0 +1,135 @@
+/**
+ * libhttp2: embeddable HTTP/2 server endpoint and client pool
+ *
+ * The public interface of libhttp2.a and libhttp2.so, and the only header
+ * programs embedding them include. Unlike the library's own headers, it is
+ * self-contained, and its structures are opaque but for header fields and
+ * responses handed to pool callbacks. Nothing else is exported by the shared
+ * library.
+ *
+ * Everything runs on the caller's event_base, which the library never
+ * dispatches itself: any program driving its own libevent loop may embed it.
+ *
+ * Server endpoint
+ *   An endpoint serves requests on the connections handed over to it with
+ *   endpoint_accept() (HTTP/2 with prior knowledge, or HTTP/1.1, upgrades to
+ *   h2c included) or endpoint_attach() (HTTP/2 only). Complete requests
+ *   (header fields and body) are routed to the handler registered for their
+ *   method and the longest prefix of their path; those with no handler get a
+ *   404 response. A handler answers its request with endpoint_respond(), right
+ *   away or later on, from the same event loop. Handlers registered as
+ *   ENDPOINT_HEAVY run on the endpoint's worker pool instead, if it has one,
+ *   so that they do not stall the loop (see below).
+ *
+ * Client pool
+ *   A pool sends requests to one origin over as many connections to it as
+ *   needed, and hands responses to the callback given with each request.
+ *
+ * An endpoint's HTTP/2 connections may be tuned from its connection callback
+ * (adaptive frame sizing); an endpoint's connections and a pool's requests
+ * get deadlines from a timer wheel.
+ */
+
+#ifndef __LIBHTTP2_H__
+#define __LIBHTTP2_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct event_base;
+struct http2_connection;
+struct timer_wheel;
+struct worker_pool;
+struct endpoint;
+struct endpoint_request;
+struct pool;
+
+/* Header field; strings need not be NUL-terminated */
+struct hpack_field {
+	const char *hf_name;
+	size_t hf_namelen;
+	const char *hf_value;
+	size_t hf_valuelen;
+};
+
+/**
+ * Response to a pool request, valid only during the callback
+ *
+ * pr_status is -1 if the request failed (connection lost or stream reset), in
+ * which case the rest is empty. pr_fields does not hold pseudo-header fields.
+ */
+struct pool_response {
+	int pr_status;
+	struct hpack_field *pr_fields;
+	int pr_nfields;
+	char *pr_body;
+	size_t pr_bodylen;
+};
+
+typedef void (*endpoint_handler_f)(struct endpoint_request *, void *);
+
+/* endpoint_handle() flags */
+#define ENDPOINT_HEAVY 0x1 /* handler runs on the endpoint's worker pool */
+typedef void (*pool_response_f)(struct pool_response *, void *);
+
+#pragma GCC visibility push(default)
+
+/* Timer wheel (tick in milliseconds) and worker pool */
+struct timer_wheel *timer_wheel_new(struct event_base *, int);
+void timer_wheel_free(struct timer_wheel *);
+struct worker_pool *worker_pool_new(int, struct event_base *);
+void worker_pool_free(struct worker_pool *);
+
+/* Connection tuning */
+int http2_connection_set_adaptive(struct http2_connection *, int);
+void http2_connection_set_timers(struct http2_connection *,
+    struct timer_wheel *);
+
+/* Server endpoint */
+struct endpoint *endpoint_new(struct event_base *, int);
+void endpoint_free(struct endpoint *);
+int endpoint_handle(struct endpoint *, const char *, const char *,
+    endpoint_handler_f, void *, int);
+void endpoint_set_pool(struct endpoint *, struct worker_pool *);
+void endpoint_set_timers(struct endpoint *, struct timer_wheel *);
+void endpoint_set_conncb(struct endpoint *,
+    void (*)(struct http2_connection *, void *), void *);
+int endpoint_accept(struct endpoint *, int);
+struct http2_connection *endpoint_attach(struct endpoint *, int);
+int endpoint_respond(struct endpoint_request *, int, struct hpack_field *,
+    int, const char *, size_t);
+int endpoint_respond_encoded(struct endpoint_request *, int, const char *,
+    size_t, const char *, size_t, void (*)(void *), void *);
+
+/**
+ * Requests, as handed to handlers
+ *
+ * A request belongs to its handler until endpoint_respond() is called on it,
+ * which must happen exactly once, even if the stream is reset or the
+ * connection lost meanwhile. Its authority is NULL if absent, and its fields
+ * do not hold pseudo-header fields.
+ *
+ * Heavy handlers run on a worker thread: they must respond before returning
+ * and touch nothing but the request and their own data. Their response is
+ * sent once back on the event loop, so buffers given to
+ * endpoint_respond_encoded() must stay valid until released.
+ */
+const char *endpoint_request_method(const struct endpoint_request *);
+const char *endpoint_request_scheme(const struct endpoint_request *);
+const char *endpoint_request_authority(const struct endpoint_request *);
+const char *endpoint_request_path(const struct endpoint_request *);
+int endpoint_request_fields(const struct endpoint_request *,
+    const struct hpack_field **);
+const char *endpoint_request_body(const struct endpoint_request *, size_t *);
+
+/* Client pool */
+struct pool *pool_new(struct event_base *, const char *, const char *, int,
+    int);
+void pool_free(struct pool *);
+void pool_set_timeout(struct pool *, struct timer_wheel *, int);
+int pool_request(struct pool *, const char *, const char *,
+    struct hpack_field *, int, const char *, size_t, pool_response_f, void *);
+
+#pragma GCC visibility pop
+
+#endif /* !__LIBHTTP2_H__ */
@@ -0,0 +1,223 @@
+/**
+ * In-process loopback transport
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <event2/event.h>
+
+#include "util.h"
+#include "timer.h"
+#include "http2.h"
+
+#include "loopback.h"
+
+static ssize_t loopback_recv(struct http2_connection *, void *, size_t);
+static ssize_t loopback_sendv(struct http2_connection *, const struct iovec *,
+    int);
+static int loopback_arm(struct http2_connection *, short);
+static void loopback_close(struct http2_connection *);
+
+static void loopback_notify(struct http2_connection *, short);
+
+const struct http2_transport loopback_transport = {
+	loopback_recv,
+	loopback_sendv,
+	loopback_arm,
+	loopback_close,
+};
+
+/**
+ * Creates two connections linked to each other, the first on evbase_a and
+ * the second on evbase_b (which may be the same). The loopback itself is
+ * freed along with the last of them.
+ */
+int
+loopback_new(struct event_base *evbase_a, struct event_base *evbase_b,
+    struct http2_connection **conn_a, struct http2_connection **conn_b)
+{
+	struct loopback *lo;
+	int i;
+
+	lo = calloc(1, sizeof(*lo));
+	if (lo == NULL) {
+		prterrno("calloc");
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		lo->lo_ends[i].le_lo = lo;
+		lo->lo_ends[i].le_side = i;
+	}
+
+	lo->lo_conns[0] = http2_connection_new_transport(-1,
+	    &loopback_transport, &lo->lo_ends[0], evbase_a);
+	if (lo->lo_conns[0] == NULL) {
+		prterr("http2_connection_new_transport: failure.");
+		free(lo);
+		return -1;
+	}
+	lo->lo_conns[1] = http2_connection_new_transport(-1,
+	    &loopback_transport, &lo->lo_ends[1], evbase_b);
+	if (lo->lo_conns[1] == NULL) {
+		prterr("http2_connection_new_transport: failure.");
+		http2_connection_free(lo->lo_conns[0]);
+		return -1;
+	}
+
+	*conn_a = lo->lo_conns[0];
+	*conn_b = lo->lo_conns[1];
+
+	return 0;
+}
+
+static ssize_t
+loopback_recv(struct http2_connection *conn, void *buf, size_t len)
+{
+	struct loopback_end *le;
+	struct loopback_buf *lb;
+	size_t n, first;
+
+	le = conn->cn_trdata;
+	lb = &le->le_lo->lo_bufs[!le->le_side];
+
+	if (lb->lb_len == 0) {
+		if (lb->lb_closed)
+			return 0;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* Copies out, wrapping around the end of the buffer */
+	n = len < lb->lb_len ? len : lb->lb_len;
+	first = LOOPBACK_BUFSIZE - lb->lb_head;
+	if (first > n)
+		first = n;
+	memcpy(buf, &lb->lb_data[lb->lb_head], first);
+	memcpy((char *)buf + first, lb->lb_data, n - first);
+	lb->lb_head = (lb->lb_head + n) % LOOPBACK_BUFSIZE;
+	lb->lb_len -= n;
+
+	/* There is room for the writer now */
+	loopback_notify(le->le_lo->lo_conns[!le->le_side], EV_WRITE);
+
+	return n;
+}
+
+static ssize_t
+loopback_sendv(struct http2_connection *conn, const struct iovec *iov,
+    int niov)
+{
+	struct loopback_end *le;
+	struct loopback_buf *lb;
+	size_t total, n, tail, first;
+	int i;
+
+	le = conn->cn_trdata;
+	lb = &le->le_lo->lo_bufs[le->le_side];
+
+	if (le->le_lo->lo_conns[!le->le_side] == NULL) {
+		errno = EPIPE;
+		return -1;
+	}
+	if (lb->lb_len == LOOPBACK_BUFSIZE) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* Copies in each buffer while there is room, wrapping around the end
+	 * of the buffer */
+	total = 0;
+	for (i = 0; i < niov && lb->lb_len < LOOPBACK_BUFSIZE; i++) {
+		n = LOOPBACK_BUFSIZE - lb->lb_len;
+		if (n > iov[i].iov_len)
+			n = iov[i].iov_len;
+		tail = (lb->lb_head + lb->lb_len) % LOOPBACK_BUFSIZE;
+		first = LOOPBACK_BUFSIZE - tail;
+		if (first > n)
+			first = n;
+		memcpy(&lb->lb_data[tail], iov[i].iov_base, first);
+		memcpy(lb->lb_data, (const char *)iov[i].iov_base + first,
+		    n - first);
+		lb->lb_len += n;
+		total += n;
+	}
+
+	/* There is data for the reader now */
+	loopback_notify(le->le_lo->lo_conns[!le->le_side], EV_READ);
+
+	return total;
+}
+
+/**
+ * Arms event and, as nothing else will, activates it right away if the
+ * loopback is already ready for it.
+ */
+static int
+loopback_arm(struct http2_connection *conn, short what)
+{
+	struct loopback_end *le;
+	struct event *ev;
+	int ready;
+
+	le = conn->cn_trdata;
+
+	if (what == EV_READ) {
+		struct loopback_buf *lb;
+
+		ev = conn->cn_rdevent;
+		lb = &le->le_lo->lo_bufs[!le->le_side];
+		ready = lb->lb_len > 0 || lb->lb_closed;
+	}
+	else {
+		ev = conn->cn_wrevent;
+		ready = le->le_lo->lo_bufs[le->le_side].lb_len <
+		    LOOPBACK_BUFSIZE;
+	}
+
+	if (event_add(ev, NULL) < 0)
+		return -1;
+	if (ready)
+		event_active(ev, what, 1);
+
+	return 0;
+}
+
+static void
+loopback_close(struct http2_connection *conn)
+{
+	struct loopback_end *le;
+	struct loopback *lo;
+
+	le = conn->cn_trdata;
+	lo = le->le_lo;
+
+	lo->lo_conns[le->le_side] = NULL;
+	lo->lo_bufs[le->le_side].lb_closed = 1;
+
+	if (lo->lo_conns[!le->le_side] == NULL)
+		free(lo);
+	else
+		loopback_notify(lo->lo_conns[!le->le_side], EV_READ);
+}
+
+/**
+ * Activates connection's event if it is waiting for it.
+ */
+static void
+loopback_notify(struct http2_connection *conn, short what)
+{
+	struct event *ev;
+
+	if (conn == NULL)
+		return;
+
+	ev = what == EV_READ ? conn->cn_rdevent : conn->cn_wrevent;
+	if (event_pending(ev, what, NULL))
+		event_active(ev, what, 1);
+}
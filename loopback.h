@@ -0,0 +1,40 @@
+/**
+ * In-process loopback transport
+ *
+ * Links two connections on the same process through in-memory buffers, with
+ * no sockets or system calls involved: readiness is signalled by activating
+ * the peer's events directly. Both connections may be on the same event_base
+ * or on different ones driven by the same thread.
+ */
+
+#ifndef __LOOPBACK_H__
+#define __LOOPBACK_H__
+
+#define LOOPBACK_BUFSIZE 65536
+
+/* One direction of the loopback */
+struct loopback_buf {
+	char lb_data[LOOPBACK_BUFSIZE];
+	size_t lb_head; /* first byte to be read */
+	size_t lb_len; /* bytes waiting to be read */
+	int lb_closed; /* writer is gone */
+};
+
+/**
+ * Side i writes on lo_bufs[i] and reads from the other one.
+ */
+struct loopback {
+	struct loopback_buf lo_bufs[2];
+	struct http2_connection *lo_conns[2];
+	struct loopback_end {
+		struct loopback *le_lo;
+		int le_side;
+	} lo_ends[2];
+};
+
+extern const struct http2_transport loopback_transport;
+
+int loopback_new(struct event_base *, struct event_base *,
+    struct http2_connection **, struct http2_connection **);
+
+#endif /* !__LOOPBACK_H__ */
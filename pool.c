@@ -0,0 +1,1153 @@
+/**
+ * HTTP/2 client connection pool
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+#include "util.h"
+#include "timer.h"
+#include "http2.h"
+#include "hpack.h"
+#include "field.h"
+
+#include "pool.h"
+
+static void pool_dispatch(struct pool *);
+static struct pool_conn *pool_conn_pick(struct pool *);
+static struct pool_conn *pool_conn_new(struct pool *);
+static int pool_conn_connect(struct addrinfo *);
+static void pool_conn_closed(struct http2_connection *, void *);
+static int pool_conn_frame(struct http2_frame *, void *);
+static int pool_conn_settings(struct http2_connection *, void *);
+static uint32_t pool_conn_limit(struct pool_conn *);
+static int pool_conn_windows(struct pool_conn *);
+static int pool_conn_window_update(struct pool_conn *, uint32_t, uint32_t);
+static int pool_conn_rst_stream(struct pool_conn *, uint32_t, uint32_t);
+
+static int pool_stream_start(struct pool_conn *, struct pool_stream *);
+static int pool_stream_send_data(struct pool_stream *);
+static int pool_stream_headers(struct pool_stream *, struct http2_frame *);
+static int pool_stream_data(struct pool_stream *, struct http2_frame *);
+static int pool_stream_field(struct hpack_field *, void *);
+static int pool_stream_discard(struct hpack_field *, void *);
+static void pool_stream_timeout(struct timer *, void *);
+static void pool_stream_done(struct pool_stream *, int);
+static void pool_stream_free(struct pool_stream *);
+
+static void pool_body_unref(void *);
+
+/**
+ * Creates a pool of up to maxconns connections to host:port, with at most
+ * maxstreams concurrent streams on each (0 for as many as the peer allows).
+ * The origin is resolved right away.
+ */
+struct pool *
+pool_new(struct event_base *evbase, const char *host, const char *port,
+    int maxconns, int maxstreams)
+{
+	struct addrinfo h, *ai;
+	struct pool *p;
+	int e;
+
+	if (maxconns <= 0 || maxstreams < 0)
+		return NULL;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL) {
+		prterrno("calloc");
+		return NULL;
+	}
+	p->p_evbase = evbase;
+	p->p_maxconns = maxconns;
+	p->p_maxstreams = maxstreams;
+
+	memset(&h, 0, sizeof(h));
+	h.ai_family = AF_UNSPEC;
+	h.ai_socktype = SOCK_STREAM;
+	e = getaddrinfo(host, port, &h, &p->p_ai);
+	if (e) {
+		prterr("getaddrinfo: %s.", gai_strerror(e));
+		free(p);
+		return NULL;
+	}
+	p->p_addr = p->p_ai;
+	for (ai = p->p_ai; ai != NULL; ai = ai->ai_next)
+		p->p_naddrs++;
+
+	p->p_authority = malloc(strlen(host) + strlen(port) + 2);
+	if (p->p_authority == NULL) {
+		prterrno("malloc");
+		freeaddrinfo(p->p_ai);
+		free(p);
+		return NULL;
+	}
+	sprintf(p->p_authority, "%s:%s", host, port);
+
+	return p;
+}
+
+/**
+ * Frees pool, closing its connections. Requests not yet answered fail. It must
+ * not be called from a response callback.
+ */
+void
+pool_free(struct pool *p)
+{
+	struct pool_stream *ps;
+
+	if (p == NULL)
+		return;
+
+	p->p_closing = 1;
+
+	while ((ps = p->p_queue) != NULL) {
+		p->p_queue = ps->ps_next;
+		pool_stream_done(ps, -1);
+	}
+
+	/* Each connection fails its streams and leaves the list on close */
+	while (p->p_conns != NULL)
+		http2_connection_free(p->p_conns->pc_conn);
+
+	freeaddrinfo(p->p_ai);
+	free(p->p_authority);
+	free(p);
+}
+
+/**
+ * Gives requests sent from now on a deadline of timeout milliseconds, kept on
+ * tw, which must belong to the pool's event_base. Connections opened from now
+ * on also time out waiting for the peer to acknowledge their SETTINGS.
+ */
+void
+pool_set_timeout(struct pool *p, struct timer_wheel *tw, int timeout)
+{
+	p->p_timers = tw;
+	p->p_timeout = timeout;
+}
+
+/**
+ * Sends a request with the given method and path, the fields besides the
+ * pseudo-header ones and body (copied, NULL if none). cb(response, arg) is
+ * called once, when the response is complete or the request fails.
+ */
+int
+pool_request(struct pool *p, const char *method, const char *path,
+    struct hpack_field *hf, int nfields, const char *body, size_t bodylen,
+    pool_response_f cb, void *arg)
+{
+	struct hpack_field *fields;
+	struct pool_stream *ps;
+	ssize_t len;
+
+	ps = calloc(1, sizeof(*ps));
+	if (ps == NULL) {
+		prterrno("calloc");
+		return -1;
+	}
+	ps->ps_pool = p;
+	ps->ps_cb = cb;
+	ps->ps_cbarg = arg;
+	timer_init(&ps->ps_timer, pool_stream_timeout, ps);
+
+	/* Encodes header block, which is not tied to any connection, right
+	 * away; it must fit on a single frame */
+	fields = malloc((nfields + 4) * sizeof(*fields));
+	ps->ps_hdrblock = malloc(HTTP2_FRAME_MAX_SIZE_DEFAULT);
+	if (fields == NULL || ps->ps_hdrblock == NULL) {
+		prterrno("malloc");
+		goto error;
+	}
+
+	fields[0] = (struct hpack_field){ ":method", 7, method,
+	    strlen(method) };
+	fields[1] = (struct hpack_field){ ":scheme", 7, "http", 4 };
+	fields[2] = (struct hpack_field){ ":authority", 10, p->p_authority,
+	    strlen(p->p_authority) };
+	fields[3] = (struct hpack_field){ ":path", 5, path, strlen(path) };
+	if (nfields > 0)
+		memcpy(&fields[4], hf, nfields * sizeof(*hf));
+
+	len = hpack_encode(fields, nfields + 4, ps->ps_hdrblock,
+	    HTTP2_FRAME_MAX_SIZE_DEFAULT);
+	free(fields);
+	fields = NULL;
+	if (len < 0) {
+		prterr("hpack_encode: header block too large.");
+		goto error;
+	}
+	ps->ps_hdrlen = len;
+
+	if (bodylen != 0) {
+		ps->ps_body = malloc(sizeof(*ps->ps_body) + bodylen);
+		if (ps->ps_body == NULL) {
+			prterrno("malloc");
+			goto error;
+		}
+		ps->ps_body->pb_refcnt = 1;
+		ps->ps_body->pb_len = bodylen;
+		memcpy(ps->ps_body->pb_data, body, bodylen);
+	}
+
+	/* Deadline covers the time waiting on the queue too */
+	if (p->p_timers != NULL &&
+	    timer_schedule(p->p_timers, &ps->ps_timer, p->p_timeout) < 0) {
+		prterr("timer_schedule: failure.");
+		goto error;
+	}
+
+	/* Queues request and gives it a stream, if there is room for it */
+	if (p->p_queue == NULL)
+		p->p_queue = ps;
+	else
+		p->p_queuelast->ps_next = ps;
+	p->p_queuelast = ps;
+
+	pool_dispatch(p);
+
+	return 0;
+
+error:
+	free(fields);
+	pool_stream_free(ps);
+	return -1;
+}
+
+/**
+ * Opens streams for queued requests while there are connections with room for
+ * them, opening new connections if needed.
+ */
+static void
+pool_dispatch(struct pool *p)
+{
+	if (p->p_dispatching || p->p_closing)
+		return;
+	p->p_dispatching = 1;
+
+	while (p->p_queue != NULL) {
+		struct pool_conn *pc;
+		struct pool_stream *ps;
+
+		pc = pool_conn_pick(p);
+		if (pc == NULL) {
+			if (p->p_nconns >= p->p_maxconns)
+				break;
+			pc = pool_conn_new(p);
+		}
+
+		ps = p->p_queue;
+		p->p_queue = ps->ps_next;
+		ps->ps_next = NULL;
+
+		if (pc == NULL) {
+			prterr("pool_conn_new: failure.");
+			pool_stream_done(ps, -1);
+			continue;
+		}
+
+		/* On failure, connection is gone along with its streams */
+		if (pool_stream_start(pc, ps) < 0)
+			prterr("pool_stream_start: failure.");
+	}
+
+	p->p_dispatching = 0;
+}
+
+/**
+ * Picks the connection for a new stream: the warm one (which has heard from
+ * the peer) with the fewest streams, or else the connecting one with the
+ * fewest streams, among those with room for one more.
+ */
+static struct pool_conn *
+pool_conn_pick(struct pool *p)
+{
+	struct pool_conn *pc, *best;
+	int warm, bestwarm;
+
+	best = NULL;
+	bestwarm = 0;
+	for (pc = p->p_conns; pc != NULL; pc = pc->pc_next) {
+		if (pc->pc_nstreams >= pool_conn_limit(pc) ||
+		    pc->pc_nextid > POOL_STREAM_ID_MAX)
+			continue;
+
+		warm = pc->pc_conn->cn_nrxframes > 0;
+		if (best == NULL || warm > bestwarm || (warm == bestwarm &&
+		    pc->pc_nstreams < best->pc_nstreams)) {
+			best = pc;
+			bestwarm = warm;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * Opens a new connection to the origin. The socket is connected without
+ * blocking: frames are queued meanwhile and sent once it is writable.
+ *
+ * Addresses are tried in turn, from p_addr on, until one is connected to or
+ * being so. One that fails later on is only left for the next connections
+ * (see pool_conn_closed()).
+ */
+static struct pool_conn *
+pool_conn_new(struct pool *p)
+{
+	struct http2_setting set[2];
+	struct pool_conn *pc;
+	struct addrinfo *ai;
+	int fd;
+
+	ai = p->p_addr;
+	for (;;) {
+		fd = pool_conn_connect(ai);
+		if (fd >= 0)
+			break;
+
+		ai = ai->ai_next != NULL ? ai->ai_next : p->p_ai;
+		if (ai == p->p_addr)
+			return NULL;
+	}
+
+	pc = calloc(1, sizeof(*pc));
+	if (pc == NULL) {
+		prterrno("calloc");
+		close(fd);
+		return NULL;
+	}
+	pc->pc_pool = p;
+	pc->pc_nextid = 1;
+	pc->pc_window = POOL_WINDOW_DEFAULT;
+	pc->pc_initwindow = POOL_WINDOW_DEFAULT;
+	pc->pc_addr = ai;
+
+	pc->pc_conn = http2_connection_new(fd, p->p_evbase);
+	if (pc->pc_conn == NULL) {
+		prterr("http2_connection_new: failure.");
+		close(fd);
+		free(pc);
+		return NULL;
+	}
+	if (hpack_decoder_init(&pc->pc_hd, pc->pc_conn->cn_locsets.ss_values[
+	    HTTP2_SETTINGS_HEADER_TABLE_SIZE]) < 0) {
+		prterr("hpack_decoder_init: failure.");
+		http2_connection_free(pc->pc_conn);
+		free(pc);
+		return NULL;
+	}
+	http2_connection_set_closecb(pc->pc_conn, pool_conn_closed, pc);
+	http2_connection_set_streamcb(pc->pc_conn, pool_conn_frame, pc);
+	http2_connection_set_settingscb(pc->pc_conn, pool_conn_settings, pc);
+	if (p->p_timers != NULL)
+		http2_connection_set_timers(pc->pc_conn, p->p_timers);
+
+	pc->pc_next = p->p_conns;
+	p->p_conns = pc;
+	p->p_nconns++;
+
+	/* Sends client preface: the connection preface, then a SETTINGS frame,
+	 * server push disabled */
+	http2_connection_send_preface(pc->pc_conn);
+	set[0].set_id = HTTP2_SETTINGS_ENABLE_PUSH;
+	set[0].set_value = 0;
+	set[1].set_id = HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE;
+	set[1].set_value = HTTP2_HEADER_BLOCK_MAX;
+	if (http2_settings_send(pc->pc_conn, set, 2) < 0) {
+		prterr("http2_settings_send: failure.");
+		http2_connection_free(pc->pc_conn);
+		return NULL;
+	}
+
+	prtinfo("(%d) New connection to %s (%d on pool).",
+	    pc->pc_conn->cn_sockfd, p->p_authority, p->p_nconns);
+
+	return pc;
+}
+
+/**
+ * Returns a socket being connected to ai, -1 on failure.
+ */
+static int
+pool_conn_connect(struct addrinfo *ai)
+{
+	int fd;
+	int on;
+
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd < 0) {
+		prterrno("socket");
+		return -1;
+	}
+	if (evutil_make_socket_nonblocking(fd) < 0) {
+		prterr("evutil_make_socket_nonblocking: failure.");
+		close(fd);
+		return -1;
+	}
+	on = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		prterrno("setsockopt");
+
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+	    errno != EINPROGRESS) {
+		prterrno("connect");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Connection is being freed: its streams fail and queued requests may get a
+ * new connection.
+ *
+ * If the socket never got connected, none of its requests reached the peer.
+ * The next address is tried first from now on, and they go back ahead of the
+ * queue, unless they were tried on as many connections as there are
+ * addresses.
+ */
+static void
+pool_conn_closed(struct http2_connection *conn, void *arg)
+{
+	struct pool_conn *pc, **pos;
+	struct pool_stream *ps;
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	struct pool *p;
+	int unreached;
+
+	pc = arg;
+	p = pc->pc_pool;
+
+	sslen = sizeof(ss);
+	unreached = conn->cn_nrxframes == 0 && getpeername(conn->cn_sockfd,
+	    (struct sockaddr *)&ss, &sslen) < 0 && errno == ENOTCONN;
+	if (unreached) {
+		prtinfo("(%d) Connection to %s failed.", conn->cn_sockfd,
+		    p->p_authority);
+		if (pc->pc_addr == p->p_addr)
+			p->p_addr = p->p_addr->ai_next != NULL ?
+			    p->p_addr->ai_next : p->p_ai;
+	}
+
+	for (pos = &p->p_conns; *pos != pc; pos = &(*pos)->pc_next)
+		;
+	*pos = pc->pc_next;
+	p->p_nconns--;
+
+	/* Newest first: each one retried goes ahead of those after it */
+	while ((ps = pc->pc_streams) != NULL) {
+		pc->pc_streams = ps->ps_next;
+		if (!unreached || ps->ps_hdrblock == NULL ||
+		    ps->ps_ntries >= p->p_naddrs || p->p_closing) {
+			pool_stream_done(ps, -1);
+			continue;
+		}
+
+		pc->pc_nstreams--;
+		ps->ps_conn = NULL;
+		ps->ps_id = 0;
+		ps->ps_bodypos = 0;
+		ps->ps_next = p->p_queue;
+		p->p_queue = ps;
+		if (ps->ps_next == NULL)
+			p->p_queuelast = ps;
+	}
+
+	hpack_decoder_clear(&pc->pc_hd);
+	free(pc);
+
+	pool_dispatch(p);
+}
+
+/**
+ * Handles frames on connection's streams, plus WINDOW_UPDATE.
+ */
+static int
+pool_conn_frame(struct http2_frame *fr, void *arg)
+{
+	struct pool_conn *pc;
+	struct pool_stream *ps;
+	uint32_t incr;
+	uint8_t *ptr;
+
+	pc = arg;
+
+	for (ps = pc->pc_streams; ps != NULL; ps = ps->ps_next)
+		if (ps->ps_id == fr->fr_streamid)
+			break;
+
+	switch (fr->fr_type) {
+	case HTTP2_FRAME_HEADERS:
+		/* Blocks of closed streams must still be decoded */
+		if (pool_stream_headers(ps, fr) < 0)
+			return -1;
+		break;
+
+	case HTTP2_FRAME_DATA:
+		if (pool_stream_data(ps, fr) < 0)
+			return -1;
+		break;
+
+	case HTTP2_FRAME_RST_STREAM:
+		if (fr->fr_length != HTTP2_FRAME_RST_STREAM_SIZE) {
+			/* TODO connection error: FRAME_SIZE_ERROR */
+			prtinfo("(%d) Connection error: RST_STREAM frame with "
+			    "wrong frame size (size=%zu)",
+			    pc->pc_conn->cn_sockfd, fr->fr_length);
+			return -1;
+		}
+		ptr = (uint8_t *)fr->fr_buf;
+		prtinfo("(%d) Stream %u reset by peer (error=0x%x).",
+		    pc->pc_conn->cn_sockfd, fr->fr_streamid,
+		    (uint32_t)ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 |
+		    ptr[3]);
+		if (ps != NULL)
+			pool_stream_done(ps, -1);
+		break;
+
+	case HTTP2_FRAME_WINDOW_UPDATE:
+		if (fr->fr_length != HTTP2_FRAME_WINDOW_UPDATE_SIZE) {
+			/* TODO connection error: FRAME_SIZE_ERROR */
+			prtinfo("(%d) Connection error: WINDOW_UPDATE frame "
+			    "with wrong frame size (size=%zu)",
+			    pc->pc_conn->cn_sockfd, fr->fr_length);
+			return -1;
+		}
+		ptr = (uint8_t *)fr->fr_buf;
+		incr = ((uint32_t)ptr[0] & 0x7F) << 24 | ptr[1] << 16 |
+		    ptr[2] << 8 | ptr[3];
+		if (fr->fr_streamid == 0) {
+			if (incr == 0 || pc->pc_window + incr >
+			    HTTP2_WINDOW_MAX) {
+				/* TODO connection error: PROTOCOL_ERROR or
+				 * FLOW_CONTROL_ERROR */
+				prtinfo("(%d) Connection error: WINDOW_UPDATE "
+				    "frame with wrong increment (%u).",
+				    pc->pc_conn->cn_sockfd, incr);
+				return -1;
+			}
+			pc->pc_window += incr;
+		}
+		else if (ps != NULL) {
+			if (incr == 0 || ps->ps_window + incr >
+			    HTTP2_WINDOW_MAX) {
+				prtinfo("(%d) WINDOW_UPDATE frame with wrong "
+				    "increment (%u) on stream %u.",
+				    pc->pc_conn->cn_sockfd, incr, ps->ps_id);
+				if (pool_conn_rst_stream(pc, ps->ps_id,
+				    incr == 0 ? HTTP2_PROTOCOL_ERROR :
+				    HTTP2_FLOW_CONTROL_ERROR) < 0)
+					return -1;
+				pool_stream_done(ps, -1);
+			}
+			else
+				ps->ps_window += incr;
+		}
+
+		/* Sends bodies which were waiting for the window */
+		for (ps = pc->pc_streams; ps != NULL; ps = ps->ps_next)
+			if (pool_stream_send_data(ps) < 0)
+				return -1;
+		break;
+	}
+
+	http2_frame_free(fr);
+
+	return 0;
+}
+
+/**
+ * Peer's settings changed: bodies waiting for a larger window go on.
+ */
+static int
+pool_conn_settings(struct http2_connection *conn, void *arg)
+{
+	struct pool_conn *pc;
+	struct pool_stream *ps;
+
+	pc = arg;
+	if (pool_conn_windows(pc) < 0)
+		return -1;
+
+	for (ps = pc->pc_streams; ps != NULL; ps = ps->ps_next)
+		if (pool_stream_send_data(ps) < 0)
+			return -1;
+
+	return 0;
+}
+
+/**
+ * Returns how many streams may be open on connection.
+ */
+static uint32_t
+pool_conn_limit(struct pool_conn *pc)
+{
+	uint32_t limit;
+
+	limit = pc->pc_conn->cn_remsets.ss_values[
+	    HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS];
+	if (limit == UINT32_MAX)
+		limit = POOL_STREAMS_DEFAULT;
+	if (pc->pc_pool->p_maxstreams > 0 &&
+	    pc->pc_pool->p_maxstreams < limit)
+		limit = pc->pc_pool->p_maxstreams;
+
+	return limit;
+}
+
+/**
+ * Applies a change of the peer's SETTINGS_INITIAL_WINDOW_SIZE to the windows
+ * of open streams, none of which may go past HTTP2_WINDOW_MAX.
+ */
+static int
+pool_conn_windows(struct pool_conn *pc)
+{
+	struct pool_stream *ps;
+	int64_t delta;
+
+	delta = (int64_t)pc->pc_conn->cn_remsets.ss_values[
+	    HTTP2_SETTINGS_INITIAL_WINDOW_SIZE] - pc->pc_initwindow;
+	if (delta == 0)
+		return 0;
+
+	for (ps = pc->pc_streams; ps != NULL; ps = ps->ps_next) {
+		if (ps->ps_window + delta > HTTP2_WINDOW_MAX) {
+			/* TODO connection error: FLOW_CONTROL_ERROR */
+			prtinfo("(%d) Connection error: window of stream %u "
+			    "past its maximum.", pc->pc_conn->cn_sockfd,
+			    ps->ps_id);
+			return -1;
+		}
+	}
+	for (ps = pc->pc_streams; ps != NULL; ps = ps->ps_next)
+		ps->ps_window += delta;
+	pc->pc_initwindow += delta;
+
+	return 0;
+}
+
+static int
+pool_conn_window_update(struct pool_conn *pc, uint32_t streamid,
+    uint32_t increment)
+{
+	struct http2_frame *fr;
+
+	fr = http2_frame_new(pc->pc_conn);
+	if (fr == NULL) {
+		prterr("http2_frame_new: failure.");
+		return -1;
+	}
+	fr->fr_type = HTTP2_FRAME_WINDOW_UPDATE;
+	fr->fr_streamid = streamid;
+	fr->fr_length = HTTP2_FRAME_WINDOW_UPDATE_SIZE;
+	fr->fr_buf = malloc(fr->fr_length);
+	if (fr->fr_buf == NULL) {
+		prterrno("malloc");
+		http2_frame_free(fr);
+		return -1;
+	}
+	fr->fr_buf[0] = (increment >> 24) & 0x7F;
+	fr->fr_buf[1] = increment >> 16;
+	fr->fr_buf[2] = increment >> 8;
+	fr->fr_buf[3] = increment;
+
+	return http2_frame_send(fr);
+}
+
+static int
+pool_conn_rst_stream(struct pool_conn *pc, uint32_t streamid, uint32_t error)
+{
+	struct http2_frame *fr;
+
+	fr = http2_frame_new(pc->pc_conn);
+	if (fr == NULL) {
+		prterr("http2_frame_new: failure.");
+		return -1;
+	}
+	fr->fr_type = HTTP2_FRAME_RST_STREAM;
+	fr->fr_streamid = streamid;
+	fr->fr_length = HTTP2_FRAME_RST_STREAM_SIZE;
+	fr->fr_buf = malloc(fr->fr_length);
+	if (fr->fr_buf == NULL) {
+		prterrno("malloc");
+		http2_frame_free(fr);
+		return -1;
+	}
+	fr->fr_buf[0] = error >> 24;
+	fr->fr_buf[1] = error >> 16;
+	fr->fr_buf[2] = error >> 8;
+	fr->fr_buf[3] = error;
+
+	return http2_frame_send(fr);
+}
+
+/**
+ * Opens a stream for request on connection, sending its HEADERS frame and as
+ * much of its body as the windows allow.
+ */
+static int
+pool_stream_start(struct pool_conn *pc, struct pool_stream *ps)
+{
+	struct http2_frame *fr;
+
+	ps->ps_id = pc->pc_nextid;
+	pc->pc_nextid += 2;
+	ps->ps_conn = pc;
+	ps->ps_window = pc->pc_initwindow;
+	ps->ps_next = pc->pc_streams;
+	pc->pc_streams = ps;
+	pc->pc_nstreams++;
+	ps->ps_ntries++;
+
+	fr = http2_frame_new(pc->pc_conn);
+	if (fr == NULL) {
+		prterr("http2_frame_new: failure.");
+		return -1;
+	}
+	fr->fr_type = HTTP2_FRAME_HEADERS;
+	fr->fr_flags = HTTP2_FRAME_HEADERS_END_HEADERS;
+	if (ps->ps_body == NULL)
+		fr->fr_flags |= HTTP2_FRAME_HEADERS_END_STREAM;
+	fr->fr_streamid = ps->ps_id;
+	fr->fr_length = ps->ps_hdrlen;
+
+	/* Until the peer was heard from, the block is kept for the request to
+	 * be retried on another address (see pool_conn_closed()) */
+	if (pc->pc_conn->cn_nrxframes == 0) {
+		fr->fr_buf = malloc(ps->ps_hdrlen);
+		if (fr->fr_buf == NULL) {
+			prterrno("malloc");
+			http2_frame_free(fr);
+			return -1;
+		}
+		memcpy(fr->fr_buf, ps->ps_hdrblock, ps->ps_hdrlen);
+	}
+	else {
+		fr->fr_buf = ps->ps_hdrblock;
+		ps->ps_hdrblock = NULL;
+	}
+
+	prtinfo("(%d) Request on stream %u.", pc->pc_conn->cn_sockfd,
+	    ps->ps_id);
+
+	if (http2_frame_send(fr) < 0) {
+		prterr("http2_frame_send: failure.");
+		return -1;
+	}
+
+	return pool_stream_send_data(ps);
+}
+
+/**
+ * Sends what is left of request's body on DATA frames, as far as the stream
+ * and connection windows allow.
+ */
+static int
+pool_stream_send_data(struct pool_stream *ps)
+{
+	struct pool_conn *pc;
+	struct pool_body *pb;
+
+	pc = ps->ps_conn;
+	pb = ps->ps_body;
+	if (pb == NULL)
+		return 0;
+
+	while (ps->ps_bodypos < pb->pb_len) {
+		struct http2_frame *fr;
+		size_t len;
+
+		len = pb->pb_len - ps->ps_bodypos;
+		if (len > pc->pc_conn->cn_txmaxframe)
+			len = pc->pc_conn->cn_txmaxframe;
+		if (ps->ps_window < (int64_t)len)
+			len = ps->ps_window < 0 ? 0 : ps->ps_window;
+		if (pc->pc_window < (int64_t)len)
+			len = pc->pc_window < 0 ? 0 : pc->pc_window;
+		if (len == 0)
+			break;
+
+		fr = http2_frame_new(pc->pc_conn);
+		if (fr == NULL) {
+			prterr("http2_frame_new: failure.");
+			return -1;
+		}
+		fr->fr_type = HTTP2_FRAME_DATA;
+		fr->fr_streamid = ps->ps_id;
+		fr->fr_length = len;
+		fr->fr_buf = &pb->pb_data[ps->ps_bodypos];
+		fr->fr_buffree = pool_body_unref;
+		fr->fr_bufarg = pb;
+		pb->pb_refcnt++;
+
+		ps->ps_bodypos += len;
+		ps->ps_window -= len;
+		pc->pc_window -= len;
+		if (ps->ps_bodypos == pb->pb_len)
+			fr->fr_flags = HTTP2_FRAME_DATA_END_STREAM;
+
+		if (http2_frame_send(fr) < 0) {
+			prterr("http2_frame_send: failure.");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Handles HEADERS frame, with a whole header block, of stream ps, or of a
+ * stream no longer open if ps is NULL. Streams with malformed responses are
+ * reset and fail.
+ */
+static int
+pool_stream_headers(struct pool_stream *ps, struct http2_frame *fr)
+{
+	struct pool_conn *pc;
+	size_t pos, len;
+	int r;
+
+	pc = fr->fr_conn->cn_streamarg;
+
+	/* Skips padding and priority */
+	pos = 0;
+	len = fr->fr_length;
+	if (fr->fr_flags & HTTP2_FRAME_HEADERS_PADDED) {
+		if (len < 1 || (uint8_t)fr->fr_buf[0] >= len)
+			goto protocol_error;
+		len -= 1 + (uint8_t)fr->fr_buf[0];
+		pos++;
+	}
+	if (fr->fr_flags & HTTP2_FRAME_HEADERS_PRIORITY) {
+		if (len < 5)
+			goto protocol_error;
+		len -= 5;
+		pos += 5;
+	}
+
+	/* Response header blocks (interim ones too) start over, trailers
+	 * must not have pseudo-header fields */
+	if (ps != NULL) {
+		ps->ps_fieldstate = ps->ps_gotheaders ? FIELD_REGULAR : 0;
+		ps->ps_listsize = 0;
+	}
+
+	r = hpack_decode(&pc->pc_hd, &fr->fr_buf[pos], len,
+	    ps != NULL ? pool_stream_field : pool_stream_discard, ps);
+	if (r < 0) {
+		/* TODO connection error: COMPRESSION_ERROR */
+		prtinfo("(%d) Connection error: header block could not be "
+		    "decoded.", fr->fr_conn->cn_sockfd);
+		return -1;
+	}
+	if (ps == NULL)
+		return 0;
+
+	if (ps->ps_malformed || (!ps->ps_gotheaders &&
+	    !(ps->ps_fieldstate & FIELD_STATUS))) {
+		prtinfo("(%d) Malformed response on stream %u.",
+		    fr->fr_conn->cn_sockfd, ps->ps_id);
+		if (pool_conn_rst_stream(pc, ps->ps_id,
+		    HTTP2_PROTOCOL_ERROR) < 0)
+			return -1;
+		pool_stream_done(ps, -1);
+		return 0;
+	}
+
+	/* Interim (1xx) responses are followed by the final one */
+	if (!ps->ps_gotheaders) {
+		if (ps->ps_resp.pr_status >= 100 &&
+		    ps->ps_resp.pr_status < 200) {
+			int i;
+
+			for (i = 0; i < ps->ps_resp.pr_nfields; i++)
+				free((char *)ps->ps_resp.pr_fields[i].hf_name);
+			ps->ps_resp.pr_nfields = 0;
+			ps->ps_resp.pr_status = 0;
+		}
+		else
+			ps->ps_gotheaders = 1;
+	}
+
+	if (fr->fr_flags & HTTP2_FRAME_HEADERS_END_STREAM)
+		pool_stream_done(ps, ps->ps_gotheaders ?
+		    ps->ps_resp.pr_status : -1);
+
+	return 0;
+
+protocol_error:
+	/* TODO connection error: PROTOCOL_ERROR */
+	prtinfo("(%d) Connection error: HEADERS frame with wrong padding or "
+	    "priority.", fr->fr_conn->cn_sockfd);
+	return -1;
+}
+
+/**
+ * Handles DATA frame of stream ps (NULL if it is no longer open), giving back
+ * what it took from the windows.
+ */
+static int
+pool_stream_data(struct pool_stream *ps, struct http2_frame *fr)
+{
+	struct pool_conn *pc;
+	size_t pos, len;
+
+	pc = fr->fr_conn->cn_streamarg;
+
+	pos = 0;
+	len = fr->fr_length;
+	if (fr->fr_flags & HTTP2_FRAME_DATA_PADDED) {
+		if (len < 1 || (uint8_t)fr->fr_buf[0] >= len) {
+			/* TODO connection error: PROTOCOL_ERROR */
+			prtinfo("(%d) Connection error: DATA frame with wrong "
+			    "padding.", fr->fr_conn->cn_sockfd);
+			return -1;
+		}
+		len -= 1 + (uint8_t)fr->fr_buf[0];
+		pos++;
+	}
+
+	if (fr->fr_length != 0 &&
+	    pool_conn_window_update(pc, 0, fr->fr_length) < 0)
+		return -1;
+	if (ps == NULL)
+		return 0;
+
+	if (!ps->ps_gotheaders) {
+		prtinfo("(%d) DATA frame before response headers on stream %u.",
+		    fr->fr_conn->cn_sockfd, ps->ps_id);
+		if (pool_conn_rst_stream(pc, ps->ps_id,
+		    HTTP2_PROTOCOL_ERROR) < 0)
+			return -1;
+		pool_stream_done(ps, -1);
+		return 0;
+	}
+
+	if (len != 0) {
+		char *body;
+
+		body = realloc(ps->ps_resp.pr_body,
+		    ps->ps_resp.pr_bodylen + len);
+		if (body == NULL) {
+			prterrno("realloc");
+			return -1;
+		}
+		memcpy(&body[ps->ps_resp.pr_bodylen], &fr->fr_buf[pos], len);
+		ps->ps_resp.pr_body = body;
+		ps->ps_resp.pr_bodylen += len;
+	}
+
+	if (fr->fr_flags & HTTP2_FRAME_DATA_END_STREAM)
+		pool_stream_done(ps, ps->ps_resp.pr_status);
+	else if (fr->fr_length != 0 &&
+	    pool_conn_window_update(pc, ps->ps_id, fr->fr_length) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Adds a decoded field to stream's response; the status is kept apart. Name
+ * and value are copied together. Malformed fields, or those beyond the header
+ * list size we take, mark the response as malformed instead, decoding going
+ * on.
+ */
+static int
+pool_stream_field(struct hpack_field *hf, void *arg)
+{
+	struct pool_response *pr;
+	struct pool_stream *ps;
+	char *str;
+	int r;
+
+	ps = arg;
+	pr = &ps->ps_resp;
+
+	if (ps->ps_malformed)
+		return 0;
+
+	ps->ps_listsize += hf->hf_namelen + hf->hf_valuelen +
+	    HPACK_ENTRY_OVERHEAD;
+	r = field_check(hf, FIELD_RESPONSE, &ps->ps_fieldstate);
+	if (r < 0 || ps->ps_listsize >
+	    http2_connection_header_max(ps->ps_conn->pc_conn)) {
+		ps->ps_malformed = 1;
+		return 0;
+	}
+
+	if (r == FIELD_STATUS) {
+		if (hf->hf_valuelen != 3 ||
+		    hf->hf_value[0] < '1' || hf->hf_value[0] > '9' ||
+		    hf->hf_value[1] < '0' || hf->hf_value[1] > '9' ||
+		    hf->hf_value[2] < '0' || hf->hf_value[2] > '9') {
+			ps->ps_malformed = 1;
+			return 0;
+		}
+		pr->pr_status = (hf->hf_value[0] - '0') * 100 +
+		    (hf->hf_value[1] - '0') * 10 +
+		    (hf->hf_value[2] - '0');
+		return 0;
+	}
+
+	if (pr->pr_nfields == ps->ps_nfieldsmax) {
+		struct hpack_field *fields;
+		int n;
+
+		n = ps->ps_nfieldsmax == 0 ? 8 : ps->ps_nfieldsmax * 2;
+		fields = realloc(pr->pr_fields, n * sizeof(*fields));
+		if (fields == NULL) {
+			prterrno("realloc");
+			return -1;
+		}
+		pr->pr_fields = fields;
+		ps->ps_nfieldsmax = n;
+	}
+
+	str = malloc(hf->hf_namelen + hf->hf_valuelen);
+	if (str == NULL && hf->hf_namelen + hf->hf_valuelen != 0) {
+		prterrno("malloc");
+		return -1;
+	}
+	memcpy(str, hf->hf_name, hf->hf_namelen);
+	memcpy(&str[hf->hf_namelen], hf->hf_value, hf->hf_valuelen);
+
+	pr->pr_fields[pr->pr_nfields].hf_name = str;
+	pr->pr_fields[pr->pr_nfields].hf_namelen = hf->hf_namelen;
+	pr->pr_fields[pr->pr_nfields].hf_value = &str[hf->hf_namelen];
+	pr->pr_fields[pr->pr_nfields].hf_valuelen = hf->hf_valuelen;
+	pr->pr_nfields++;
+
+	return 0;
+}
+
+static int
+pool_stream_discard(struct hpack_field *hf, void *arg)
+{
+	return 0;
+}
+
+/**
+ * Request was not answered in time: it is taken off the queue or its stream is
+ * reset.
+ */
+static void
+pool_stream_timeout(struct timer *tm, void *arg)
+{
+	struct pool_stream *ps;
+	struct pool *p;
+
+	ps = arg;
+	p = ps->ps_pool;
+
+	prtinfo("Request timed out after %d ms.", p->p_timeout);
+
+	if (ps->ps_conn == NULL) {
+		struct pool_stream **pos, *prev;
+
+		prev = NULL;
+		for (pos = &p->p_queue; *pos != ps; pos = &(*pos)->ps_next)
+			prev = *pos;
+		*pos = ps->ps_next;
+		if (p->p_queuelast == ps)
+			p->p_queuelast = prev;
+	}
+	else if ((ps->ps_body == NULL ||
+	    ps->ps_bodypos == ps->ps_body->pb_len) &&
+	    pool_conn_rst_stream(ps->ps_conn, ps->ps_id, HTTP2_CANCEL) < 0)
+		prterr("pool_conn_rst_stream: failure.");
+
+	/* Streams with part of their body unsent are reset here */
+	pool_stream_done(ps, -1);
+}
+
+/**
+ * Completes request with status (-1 if it failed): takes its stream off the
+ * connection, if it had one, and hands the response to its callback. Streams
+ * done with part of their body still unsent are reset.
+ */
+static void
+pool_stream_done(struct pool_stream *ps, int status)
+{
+	struct pool_conn *pc;
+
+	pc = ps->ps_conn;
+	if (pc != NULL) {
+		struct pool_stream **pos;
+
+		for (pos = &pc->pc_streams; *pos != NULL && *pos != ps;
+		    pos = &(*pos)->ps_next)
+			;
+		if (*pos == ps) {
+			*pos = ps->ps_next;
+			if (ps->ps_body != NULL &&
+			    ps->ps_bodypos < ps->ps_body->pb_len &&
+			    pool_conn_rst_stream(pc, ps->ps_id,
+			    HTTP2_CANCEL) < 0)
+				prterr("pool_conn_rst_stream: failure.");
+		}
+		pc->pc_nstreams--;
+	}
+
+	if (status < 0) {
+		int i;
+
+		for (i = 0; i < ps->ps_resp.pr_nfields; i++)
+			free((char *)ps->ps_resp.pr_fields[i].hf_name);
+		ps->ps_resp.pr_nfields = 0;
+		free(ps->ps_resp.pr_body);
+		ps->ps_resp.pr_body = NULL;
+		ps->ps_resp.pr_bodylen = 0;
+	}
+	ps->ps_resp.pr_status = status;
+
+	if (ps->ps_cb != NULL)
+		ps->ps_cb(&ps->ps_resp, ps->ps_cbarg);
+
+	pool_stream_free(ps);
+
+	/* There is room for a queued request now */
+	if (pc != NULL)
+		pool_dispatch(pc->pc_pool);
+}
+
+static void
+pool_stream_free(struct pool_stream *ps)
+{
+	int i;
+
+	if (ps->ps_pool->p_timers != NULL)
+		timer_cancel(ps->ps_pool->p_timers, &ps->ps_timer);
+
+	for (i = 0; i < ps->ps_resp.pr_nfields; i++)
+		free((char *)ps->ps_resp.pr_fields[i].hf_name);
+	free(ps->ps_resp.pr_fields);
+	free(ps->ps_resp.pr_body);
+	free(ps->ps_hdrblock);
+	if (ps->ps_body != NULL)
+		pool_body_unref(ps->ps_body);
+	free(ps);
+}
+
+static void
+pool_body_unref(void *arg)
+{
+	struct pool_body *pb;
+
+	pb = arg;
+	if (--pb->pb_refcnt == 0)
+		free(pb);
+}
@@ -0,0 +1,96 @@
+/**
+ * HTTP/2 client connection pool
+ *
+ * A pool sends requests to one origin over as many connections to it as
+ * needed: each request goes on a new stream of the least loaded connection
+ * with room under the peer's SETTINGS_MAX_CONCURRENT_STREAMS (or the pool's
+ * own limit, if lower), warm connections first, and a new connection is only
+ * opened, without blocking, when all of them are full. Requests beyond
+ * p_maxconns full connections wait on the pool. Connections are kept for reuse
+ * until the pool is freed or the peer closes them.
+ *
+ * Everything runs on the caller's event_base, and responses are handed to the
+ * callback given with each request. With a timer wheel (pool_set_timeout()),
+ * requests also have a deadline.
+ *
+ * Internals of the pool, whose interface is part of libhttp2.h.
+ */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+/* Concurrent streams assumed until the peer sets its limit */
+#define POOL_STREAMS_DEFAULT 100
+
+/* Largest stream ID (client-initiated ones are odd) */
+#define POOL_STREAM_ID_MAX 0x7FFFFFFFU
+
+/* Initial flow-control window of connections and streams */
+#define POOL_WINDOW_DEFAULT 65535
+
+/* Request body, shared by the DATA frames carrying it */
+struct pool_body {
+	int pb_refcnt;
+	size_t pb_len;
+	char pb_data[];
+};
+
+/**
+ * Request, on a connection's list once its stream is open or on the pool's
+ * queue before that
+ */
+struct pool_stream {
+	uint32_t ps_id;
+	struct pool *ps_pool;
+	struct pool_conn *ps_conn;
+	pool_response_f ps_cb;
+	void *ps_cbarg;
+	char *ps_hdrblock; /* encoded request header block, until sent on a
+			    * connection which heard from the peer */
+	size_t ps_hdrlen;
+	struct pool_body *ps_body; /* NULL if there is no body */
+	size_t ps_bodypos; /* body bytes already on DATA frames */
+	int64_t ps_window; /* stream's sending window */
+	struct pool_response ps_resp;
+	int ps_nfieldsmax; /* room on ps_resp.pr_fields */
+	int ps_gotheaders; /* final (non-1xx) response headers received */
+	int ps_fieldstate; /* see field_check() */
+	size_t ps_listsize; /* of the header block being decoded */
+	int ps_malformed; /* some field was invalid */
+	struct timer ps_timer; /* request's deadline */
+	int ps_ntries; /* connections it was sent on */
+	struct pool_stream *ps_next;
+};
+
+struct pool_conn {
+	struct pool *pc_pool;
+	struct http2_connection *pc_conn;
+	struct hpack_decoder pc_hd;
+	struct pool_stream *pc_streams;
+	int pc_nstreams;
+	uint32_t pc_nextid;
+	int64_t pc_window; /* connection's sending window */
+	uint32_t pc_initwindow; /* peer's SETTINGS_INITIAL_WINDOW_SIZE applied */
+	struct addrinfo *pc_addr; /* connected to */
+	struct pool_conn *pc_next;
+};
+
+struct pool {
+	struct event_base *p_evbase;
+	struct addrinfo *p_ai; /* origin's addresses, resolved once */
+	struct addrinfo *p_addr; /* one new connections try first */
+	int p_naddrs;
+	char *p_authority;
+	int p_maxconns;
+	int p_maxstreams; /* per connection, 0 for the peer's limit */
+	struct timer_wheel *p_timers; /* for deadlines, NULL if none */
+	int p_timeout; /* request timeout, in ms */
+	struct pool_conn *p_conns;
+	int p_nconns;
+	struct pool_stream *p_queue; /* requests waiting for a stream */
+	struct pool_stream *p_queuelast;
+	int p_dispatching;
+	int p_closing;
+};
+
+#endif /* !__POOL_H__ */
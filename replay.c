@@ -0,0 +1,496 @@
+/**
+ * HTTP/2 traffic replay
+ *
+ * Feeds the frames of a trace recorded with trace_start() (e.g. by the server
+ * with -T) back into new connections, either at their original pace or as fast
+ * as possible. Each connection on the trace gets its own pair of connections
+ * linked by the in-process loopback: frames of the chosen direction are sent
+ * from one end and handled by the other, as a server would handle received ones (by
+ * an endpoint answering every request with 204) or a client sent ones (by
+ * decoding and checking response header blocks, as the pool does).
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+#include "util.h"
+#include "timer.h"
+#include "http2.h"
+#include "hpack.h"
+#include "field.h"
+#include "endpoint.h"
+#include "loopback.h"
+#include "trace.h"
+
+/* Frames on the way when replaying as fast as possible */
+#define REPLAY_WINDOW 256
+
+/* Streams taken at once by the endpoint receiving rx frames */
+#define REPLAY_MAX_STREAMS 100
+
+/**
+ * Connection from the trace and the pair replaying it
+ *
+ * The receiving end, which may close on a frame it finds invalid, is known
+ * from the loopback's side of the sender (see replay_receiver()).
+ */
+struct replay_conn {
+	uint32_t rc_id;
+	struct http2_connection *rc_sender;
+	struct hpack_decoder rc_hd; /* of the receiving end, for tx frames */
+};
+
+struct event_base *evbase;
+
+static int replay_dir = TRACE_RX;
+static struct endpoint *replay_endpoint; /* for rx frames */
+static struct replay_conn *replay_conns;
+static int replay_nconns;
+static uint64_t replay_nrequests; /* answered by replay_endpoint */
+static uint64_t replay_nblocks; /* response header blocks decoded */
+static uint64_t replay_nmalformed; /* of which malformed */
+
+static struct replay_conn *replay_conn_get(uint32_t);
+static struct http2_connection *replay_receiver(struct replay_conn *);
+static void replay_conn_closed(struct http2_connection *, void *);
+static uint64_t replay_inflight(void);
+static int replay_frame(struct replay_conn *, struct trace_record *);
+static void replay_payload_free(void *);
+static void replay_request(struct endpoint_request *, void *);
+static int replay_response_frame(struct http2_frame *, void *);
+static int replay_response_field(struct hpack_field *, void *);
+static uint64_t replay_now(void);
+static void replay_wakeup(evutil_socket_t, short, void *);
+static void usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	struct trace_record rec;
+	struct trace *tc;
+	struct event *evtimer;
+	uint64_t start, end, first;
+	uint64_t nframes;
+	int fast = 0;
+	int r;
+	int i;
+	int ch;
+
+	/* Parse arguments */
+	while ((ch = getopt(argc, argv, "d:fh")) != -1) {
+		switch (ch) {
+		case 'd':
+			if (strcmp(optarg, "rx") == 0)
+				replay_dir = TRACE_RX;
+			else if (strcmp(optarg, "tx") == 0)
+				replay_dir = TRACE_TX;
+			else
+				usage();
+			break;
+		case 'f':
+			fast = 1;
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc) {
+		prterr("missing trace file.");
+		usage();
+	}
+
+	tc = trace_open(argv[optind]);
+	if (tc == NULL) {
+		prterr("trace_open: failure.");
+		exit(1);
+	}
+
+	evbase = event_base_new();
+	if (evbase == NULL) {
+		prterr("event_base_new: failure.");
+		exit(1);
+	}
+	evtimer = evtimer_new(evbase, replay_wakeup, NULL);
+	if (evtimer == NULL) {
+		prterr("evtimer_new: failure.");
+		exit(1);
+	}
+
+	/* Received frames go to a server endpoint */
+	if (replay_dir == TRACE_RX) {
+		replay_endpoint = endpoint_new(evbase, REPLAY_MAX_STREAMS);
+		if (replay_endpoint == NULL || endpoint_handle(replay_endpoint,
+		    NULL, "/", replay_request, NULL, 0) < 0) {
+			prterr("endpoint_new: failure.");
+			exit(1);
+		}
+	}
+
+	printf("Replaying %s frames of %s %s\n",
+	    replay_dir == TRACE_RX ? "rx" : "tx", argv[optind],
+	    fast ? "as fast as possible" : "at original pace");
+
+	nframes = 0;
+	first = 0;
+	start = replay_now();
+	while ((r = trace_next(tc, &rec)) > 0) {
+		struct replay_conn *rc;
+
+		if (rec.rec_dir != replay_dir)
+			continue;
+		if (first == 0)
+			first = rec.rec_time;
+
+		rc = replay_conn_get(rec.rec_conn);
+		if (rc == NULL) {
+			prterr("replay_conn_get: failure.");
+			exit(1);
+		}
+
+		/* What is left of a closed connection is skipped */
+		if (rc->rc_sender == NULL || replay_receiver(rc) == NULL)
+			continue;
+
+		/* Waits for frame's time or for room on the window */
+		for (;;) {
+			uint64_t now;
+
+			now = replay_now();
+			if (fast ? replay_inflight() < REPLAY_WINDOW :
+			    now - start >= rec.rec_time - first)
+				break;
+
+			if (!fast) {
+				struct timeval tv;
+				uint64_t wait;
+
+				wait = rec.rec_time - first - (now - start);
+				tv.tv_sec = wait / 1000000000;
+				tv.tv_usec = wait % 1000000000 / 1000;
+				evtimer_add(evtimer, &tv);
+			}
+			if (event_base_loop(evbase, EVLOOP_ONCE) < 0) {
+				prterr("event_base_loop: failure.");
+				exit(1);
+			}
+		}
+
+		/* Connection may have been closed meanwhile */
+		if (rc->rc_sender == NULL || replay_receiver(rc) == NULL)
+			continue;
+		if (replay_frame(rc, &rec) < 0) {
+			prterr("replay_frame: failure.");
+			exit(1);
+		}
+		nframes++;
+	}
+	if (r < 0)
+		prterr("trace_next: trace is truncated.");
+
+	/* Lets remaining frames be handled */
+	while (replay_inflight() > 0)
+		if (event_base_loop(evbase, EVLOOP_ONCE) < 0)
+			break;
+	end = replay_now();
+
+	printf("%" PRIu64 " frames on %d connection(s) in %.3f ms",
+	    nframes, replay_nconns, (end - start) / 1e6);
+	if (nframes > 0)
+		printf(" (%.0f frames/s, %.1f ns/frame)",
+		    nframes * 1e9 / (end - start),
+		    (double)(end - start) / nframes);
+	printf("\n");
+	if (replay_dir == TRACE_RX)
+		printf("%" PRIu64 " request(s) answered\n", replay_nrequests);
+	else
+		printf("%" PRIu64 " response header block(s), %" PRIu64
+		    " malformed\n", replay_nblocks, replay_nmalformed);
+
+	for (i = 0; i < replay_nconns; i++) {
+		struct http2_connection *receiver;
+
+		receiver = replay_receiver(&replay_conns[i]);
+		http2_connection_free(replay_conns[i].rc_sender);
+		http2_connection_free(receiver);
+		hpack_decoder_clear(&replay_conns[i].rc_hd);
+	}
+	endpoint_free(replay_endpoint);
+	free(replay_conns);
+	event_free(evtimer);
+	event_base_free(evbase);
+	trace_close(tc);
+
+	return 0;
+}
+
+/**
+ * Returns connection replaying the one with ID id, creating it if needed.
+ */
+static struct replay_conn *
+replay_conn_get(uint32_t id)
+{
+	struct http2_connection *receiver;
+	struct replay_conn *rc;
+	int i;
+
+	for (i = 0; i < replay_nconns; i++)
+		if (replay_conns[i].rc_id == id)
+			return &replay_conns[i];
+
+	rc = realloc(replay_conns, (replay_nconns + 1) * sizeof(*rc));
+	if (rc == NULL) {
+		prterrno("realloc");
+		return NULL;
+	}
+	replay_conns = rc;
+	rc = &replay_conns[replay_nconns];
+	memset(rc, 0, sizeof(*rc));
+	rc->rc_id = id;
+
+	if (loopback_new(evbase, evbase, &rc->rc_sender, &receiver) < 0) {
+		prterr("loopback_new: failure.");
+		return NULL;
+	}
+	replay_nconns++;
+
+	/* Connections are tracked by their index as the array may move */
+	http2_connection_set_closecb(rc->rc_sender, replay_conn_closed,
+	    (void *)(intptr_t)(replay_nconns - 1));
+
+	if (replay_dir == TRACE_RX) {
+		if (endpoint_serve(replay_endpoint, receiver) < 0) {
+			prterr("endpoint_serve: failure.");
+			http2_connection_free(receiver);
+			return NULL;
+		}
+	}
+	else {
+		if (hpack_decoder_init(&rc->rc_hd, receiver->cn_locsets.ss_values[
+		    HTTP2_SETTINGS_HEADER_TABLE_SIZE]) < 0) {
+			prterr("hpack_decoder_init: failure.");
+			http2_connection_free(receiver);
+			return NULL;
+		}
+		http2_connection_set_streamcb(receiver, replay_response_frame,
+		    (void *)(intptr_t)(replay_nconns - 1));
+	}
+
+	return rc;
+}
+
+/**
+ * Returns the receiving end of rc, NULL once it is closed.
+ */
+static struct http2_connection *
+replay_receiver(struct replay_conn *rc)
+{
+	struct loopback_end *le;
+
+	if (rc->rc_sender == NULL)
+		return NULL;
+	le = rc->rc_sender->cn_trdata;
+
+	return le->le_lo->lo_conns[!le->le_side];
+}
+
+/**
+ * A replayed frame may be invalid for the receiving end, which then closes the
+ * connection, and the sending one along; what is left for it on the trace is
+ * skipped.
+ */
+static void
+replay_conn_closed(struct http2_connection *conn, void *arg)
+{
+	struct replay_conn *rc;
+
+	rc = &replay_conns[(intptr_t)arg];
+	if (replay_receiver(rc) == NULL)
+		prtinfo("Connection %u was closed by the receiving end.",
+		    rc->rc_id);
+	rc->rc_sender = NULL;
+}
+
+/**
+ * Frames sent by either end, queued ones included, and not handled yet by the
+ * other; those the receiving end answers on its own (e.g. SETTINGS) count
+ * too, as they are received along with replayed ones.
+ */
+static uint64_t
+replay_inflight(void)
+{
+	uint64_t n;
+	int i;
+
+	n = 0;
+	for (i = 0; i < replay_nconns; i++) {
+		struct http2_connection *receiver;
+		struct http2_frame *fr;
+		uint64_t sent;
+
+		receiver = replay_receiver(&replay_conns[i]);
+		if (receiver == NULL)
+			continue;
+
+		sent = replay_conns[i].rc_sender->cn_ntxframes;
+		for (fr = replay_conns[i].rc_sender->cn_txframe; fr != NULL;
+		    fr = fr->fr_next)
+			sent++;
+		n += sent - receiver->cn_nrxframes;
+	}
+
+	return n;
+}
+
+/**
+ * Sends recorded frame as is, its payload straight from the mapped trace.
+ */
+static int
+replay_frame(struct replay_conn *rc, struct trace_record *rec)
+{
+	struct http2_frame *fr;
+
+	fr = http2_frame_new(rc->rc_sender);
+	if (fr == NULL) {
+		prterr("http2_frame_new: failure.");
+		return -1;
+	}
+
+	fr->fr_type = rec->rec_type;
+	fr->fr_flags = rec->rec_flags;
+	fr->fr_streamid = rec->rec_streamid;
+	fr->fr_length = rec->rec_length;
+	fr->fr_buf = (char *)rec->rec_payload;
+	fr->fr_buffree = replay_payload_free;
+
+	if (http2_frame_send(fr) < 0) {
+		prterr("http2_frame_send: failure.");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Payloads belong to the mapped trace.
+ */
+static void
+replay_payload_free(void *arg)
+{
+}
+
+/**
+ * Answers every replayed request, whatever it is, with no body.
+ */
+static void
+replay_request(struct endpoint_request *er, void *arg)
+{
+	replay_nrequests++;
+	if (endpoint_respond(er, 204, NULL, 0, NULL, 0) < 0)
+		prterr("endpoint_respond: failure.");
+}
+
+/**
+ * Decodes response header blocks, checking their fields; any other frame is
+ * dropped.
+ */
+static int
+replay_response_frame(struct http2_frame *fr, void *arg)
+{
+	struct replay_conn *rc;
+	size_t pos, len;
+	int state;
+
+	rc = &replay_conns[(intptr_t)arg];
+
+	if (fr->fr_type != HTTP2_FRAME_HEADERS) {
+		http2_frame_free(fr);
+		return 0;
+	}
+
+	/* Skips padding and priority */
+	pos = 0;
+	len = fr->fr_length;
+	if (fr->fr_flags & HTTP2_FRAME_HEADERS_PADDED) {
+		if (len < 1 || (uint8_t)fr->fr_buf[0] >= len)
+			goto error;
+		len -= 1 + (uint8_t)fr->fr_buf[0];
+		pos++;
+	}
+	if (fr->fr_flags & HTTP2_FRAME_HEADERS_PRIORITY) {
+		if (len < 5)
+			goto error;
+		len -= 5;
+		pos += 5;
+	}
+
+	/* Fields are checked as those of responses; trailers pass too, as
+	 * :status is not required */
+	state = 0;
+	if (hpack_decode(&rc->rc_hd, &fr->fr_buf[pos], len,
+	    replay_response_field, &state) < 0)
+		goto error;
+	replay_nblocks++;
+	if (state < 0) {
+		prtinfo("Malformed header block on stream %u of connection "
+		    "%u.", fr->fr_streamid, rc->rc_id);
+		replay_nmalformed++;
+	}
+
+	http2_frame_free(fr);
+	return 0;
+
+error:
+	prtinfo("Header block on stream %u of connection %u could not be "
+	    "decoded.", fr->fr_streamid, rc->rc_id);
+	/* Frame goes along with the connection */
+	return -1;
+}
+
+/**
+ * Keeps the block's field state, which goes to -1 on the first malformed
+ * field.
+ */
+static int
+replay_response_field(struct hpack_field *hf, void *arg)
+{
+	int *state;
+
+	state = arg;
+	if (*state >= 0 && field_check(hf, FIELD_RESPONSE, state) < 0)
+		*state = -1;
+
+	return 0;
+}
+
+static uint64_t
+replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+replay_wakeup(evutil_socket_t fd, short events, void *arg)
+{
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-f] [-d rx|tx] trace\n", __progname);
+	exit(1);
+}
@@ -4,20 +4,30 @@
 
 #include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include <event2/event.h>
 
+#include "libhttp2.h"
 #include "defines.h"
+#include "timer.h"
 #include "http2.h"
+#include "hpack.h"
+#include "cache.h"
+#include "trace.h"
 #include "util.h"
+#include "worker.h"
 
 #include "server.h"
 
@@ -25,6 +35,24 @@
 struct event_base *evbase;
 struct event *evsock;
 
+/* TCP_NOTSENT_LOWAT for adaptive frame sizing, 0 if disabled */
+int server_lowat = 0;
+
+/* Pool compressing cached responses, if any */
+struct worker_pool *server_pool = NULL;
+
+/* Wheel for connections' deadlines */
+struct timer_wheel *server_timers;
+
+/* Endpoint serving requests of all connections */
+struct endpoint *server_endpoint;
+
+/* Responses, encoded once and shared by every connection */
+struct cache *server_cache;
+
+/* Body of responses */
+static const char server_body[] = "HTTP/2 minimalistic server\n";
+
 static void usage(void);
 
 int
@@ -33,14 +61,29 @@ main(int argc, char *argv[])
 	int sockfd;
 	int r;
 	char *server_port = SERVER_PORT_DEFAULT;
+	int nthreads = 0;
+	char *tracefile = NULL;
 	char ch;
 
 	/* Parse arguments */
-	while ((ch = getopt(argc, argv, "hp:a:")) != -1) {
+	while ((ch = getopt(argc, argv, "hp:a:l:t:T:")) != -1) {
 		switch (ch) {
 		case 'p':
 			server_port = optarg;
 			break;
+		case 'l':
+			server_lowat = atoi(optarg);
+			if (server_lowat <= 0)
+				usage();
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads <= 0)
+				usage();
+			break;
+		case 'T':
+			tracefile = optarg;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -49,6 +92,12 @@ main(int argc, char *argv[])
 
 	printf("HTTP/2 server\n");
 
+	/* Starts recording frames, if requested */
+	if (tracefile != NULL && trace_start(tracefile) < 0) {
+		prterr("trace_start: failure.");
+		exit(1);
+	}
+
 	/* Opens the listening socket */
 	sockfd = server_listen(server_port);
 	if (sockfd < 0) {
@@ -64,6 +113,51 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	/* Creates the wheel all connections' timers go on */
+	server_timers = timer_wheel_new(evbase, TIMER_TICK_DEFAULT);
+	if (server_timers == NULL) {
+		close(sockfd);
+		event_base_free(evbase);
+		prterr("timer_wheel_new: failure.");
+		exit(1);
+	}
+
+	/* Starts worker pool, if requested */
+	if (nthreads > 0) {
+		server_pool = worker_pool_new(nthreads, evbase);
+		if (server_pool == NULL) {
+			close(sockfd);
+			event_base_free(evbase);
+			prterr("worker_pool_new: failure.");
+			exit(1);
+		}
+	}
+
+	/* Creates the response cache, whose variants are compressed on the
+	 * worker pool, if any */
+	server_cache = cache_new(SERVER_CACHE_BUCKETS, SERVER_CACHE_SIZE);
+	if (server_cache == NULL) {
+		close(sockfd);
+		event_base_free(evbase);
+		prterr("cache_new: failure.");
+		exit(1);
+	}
+	if (server_pool != NULL)
+		cache_set_pool(server_cache, server_pool);
+
+	/* Creates the endpoint and its only handler, for any request */
+	server_endpoint = endpoint_new(evbase, SERVER_MAX_STREAMS_DEFAULT);
+	if (server_endpoint == NULL ||
+	    endpoint_handle(server_endpoint, NULL, "/", server_request,
+	    NULL, 0) < 0) {
+		close(sockfd);
+		event_base_free(evbase);
+		prterr("endpoint_new: failure.");
+		exit(1);
+	}
+	endpoint_set_timers(server_endpoint, server_timers);
+	endpoint_set_conncb(server_endpoint, server_conn, NULL);
+
 	/* Creates an event notification for the listening socket */
 	evsock = event_new(evbase, sockfd, EV_READ, server_accept, NULL);
 	if (evsock == NULL) {
@@ -85,18 +179,23 @@ main(int argc, char *argv[])
 		prterr("event_base_dispatch: failure.");
 
 	close(sockfd);
+	endpoint_free(server_endpoint);
+	worker_pool_free(server_pool);
+	cache_free(server_cache);
+	timer_wheel_free(server_timers);
 	event_base_free(evbase);
+	trace_stop();
 	return 0;
 }
 
 void
 server_accept(evutil_socket_t fd, short events, void *arg)
 {
-	struct http2_connection *conn;
 	struct sockaddr_in addr;
 	char ip[INET_ADDRSTRLEN];
 	socklen_t addrlen;
 	int connfd;
+	int on;
 
 	/* Rearms the listening socket's event */
 	event_add(evsock, NULL);
@@ -114,20 +213,97 @@ server_accept(evutil_socket_t fd, short events, void *arg)
 	prtinfo("(%d) new connection received from %s:%d\n",
 	    connfd, ip, ntohs(addr.sin_port));
 
-	/* Creates a new connection object */
-	conn = http2_connection_new(connfd, evbase);
-	if (conn == NULL) {
-		prterr("http2_connection_new: failure.");
+	/* Writes are already coalesced per loop iteration: Nagle's algorithm
+	 * would only delay them */
+	on = 1;
+	if (setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		prterrno("setsockopt");
+
+	/* Hands connection over to the endpoint, which tells HTTP/2 from
+	 * HTTP/1.1 on its first bytes */
+	if (endpoint_accept(server_endpoint, connfd) < 0) {
+		prterr("endpoint_accept: failure.");
 		close(connfd);
+	}
+}
+
+/**
+ * Tunes every HTTP/2 connection, prior knowledge or upgraded ones.
+ */
+void
+server_conn(struct http2_connection *conn, void *arg)
+{
+	/* Enables adaptive frame sizing, if requested */
+	if (server_lowat > 0 &&
+	    http2_connection_set_adaptive(conn, server_lowat) < 0)
+		prterr("http2_connection_set_adaptive: failure.");
+}
+
+/**
+ * Answers GET and HEAD requests for any path with a short text, from the
+ * cache: responses are stored on the first request for their path.
+ */
+void
+server_request(struct endpoint_request *er, void *arg)
+{
+	struct hpack_field fields[] = {
+		{ ":status", 7, "200", 3 },
+		{ "content-type", 12, "text/plain", 10 },
+		{ "content-length", 14, NULL, 0 },
+		{ "allow", 5, "GET, HEAD", 9 },
+	};
+	const struct hpack_field *hf;
+	struct cache_key key;
+	struct cache_entry *ce;
+	const char *method;
+	char lenbuf[24];
+	char *accept;
+	int i, n;
+
+	method = endpoint_request_method(er);
+	if (strcmp(method, "HEAD") != 0 && strcmp(method, "GET") != 0) {
+		if (endpoint_respond(er, 405, &fields[3], 1, NULL, 0) < 0)
+			prterr("endpoint_respond: failure.");
 		return;
 	}
 
-	/* Sends preface: first SETTINGS frame */
-	if (http2_settings_send(conn, NULL, 0) < 0) {
-		prterr("http2_settings_send: failure.");
-		http2_connection_free(conn);
+	/* Endpoint leaves body out of HEAD responses: both share GET's */
+	accept = NULL;
+	n = endpoint_request_fields(er, &hf);
+	for (i = 0; i < n && accept == NULL; i++)
+		if (hf[i].hf_namelen == 15 &&
+		    memcmp(hf[i].hf_name, "accept-encoding", 15) == 0)
+			accept = strndup(hf[i].hf_value, hf[i].hf_valuelen);
+	memset(&key, 0, sizeof(key));
+	key.ck_method = "GET";
+	key.ck_authority = endpoint_request_authority(er);
+	if (key.ck_authority == NULL)
+		key.ck_authority = "";
+	key.ck_path = endpoint_request_path(er);
+	key.ck_accept = accept;
+
+	ce = cache_lookup(server_cache, &key);
+	if (ce == NULL) {
+		fields[2].hf_value = lenbuf;
+		fields[2].hf_valuelen = snprintf(lenbuf, sizeof(lenbuf), "%zu",
+		    sizeof(server_body) - 1);
+		if (cache_insert(server_cache, &key, fields, 3, server_body,
+		    sizeof(server_body) - 1, SERVER_CACHE_TTL) < 0)
+			prterr("cache_insert: failure.");
+		ce = cache_lookup(server_cache, &key);
+	}
+	free(accept);
+
+	if (ce == NULL) {
+		if (endpoint_respond(er, 200, &fields[1], 1, server_body,
+		    sizeof(server_body) - 1) < 0)
+			prterr("endpoint_respond: failure.");
 		return;
 	}
+
+	if (cache_entry_respond(ce, er) < 0)
+		prterr("cache_entry_respond: failure.");
+	cache_entry_unref(ce);
 }
 
 int
@@ -181,7 +357,8 @@ usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s [-p port]\n", __progname);
+	fprintf(stderr, "usage: %s [-p port] [-l lowat] [-t threads] "
+	    "[-T tracefile]\n", __progname);
 	exit(1);
 }
 
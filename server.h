@@ -6,6 +6,8 @@
 #define __SERVER_H__
 
 void server_accept(evutil_socket_t, short, void *);
+void server_conn(struct http2_connection *, void *);
+void server_request(struct endpoint_request *, void *);
 int server_listen(char *);
 
 #endif /* !__SERVER_H__ */
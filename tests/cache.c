@@ -0,0 +1,371 @@
+/**
+ * Response cache tests
+ *
+ * Variants: a compressible response is stored with a vary field of its own,
+ * and once compressed on the worker pool, lookups have to pick the variant
+ * each accept-encoding asks for, weights included, every entry telling it
+ * varies on accept-encoding on that same vary field.
+ *
+ * Generations: a response stored twice while the worker is busy gets its
+ * first compression discarded, only variants of the second one being stored;
+ * storing it again with a body too small to compress drops them.
+ */
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+#include "compress.h"
+#include "hpack.h"
+#include "worker.h"
+#include "cache.h"
+
+/* Time, in milliseconds, variants may take */
+#define TEST_TIMEOUT 5000
+
+#define TEST_TTL 60
+
+struct test_accept {
+	const char *ta_accept;
+	int ta_encs[COMPRESS_NENCODINGS]; /* expected, first supported one */
+};
+
+static const struct test_accept accepts[] = {
+	{ NULL, { COMPRESS_IDENTITY } },
+	{ "gzip", { COMPRESS_GZIP } },
+	{ "x-gzip", { COMPRESS_GZIP } },
+	{ "identity", { COMPRESS_IDENTITY } },
+	{ "gzip;q=0", { COMPRESS_IDENTITY } },
+	{ "gzip;q=0.5, br", { COMPRESS_BROTLI, COMPRESS_GZIP } },
+	{ "br;q=0.1, gzip;q=0.9", { COMPRESS_GZIP } },
+	{ "br;q=0, gzip;q=0", { COMPRESS_IDENTITY } },
+	{ "*", { COMPRESS_BROTLI, COMPRESS_ZSTD, COMPRESS_GZIP } },
+	{ "*;q=0.5, gzip;q=0", { COMPRESS_BROTLI, COMPRESS_ZSTD } },
+};
+
+/* What an entry's header block says */
+struct test_fields {
+	int tf_nvary;
+	char tf_vary[64];
+	int tf_enc;
+};
+
+/* Job keeping the pool's only worker busy until released */
+struct test_block {
+	struct worker_job tb_job;
+	pthread_mutex_t tb_lock;
+	pthread_cond_t tb_cond;
+	int tb_released;
+};
+
+static struct event_base *evbase;
+static char body1[4096], body2[2048];
+
+static long
+test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+test_field(struct hpack_field *hf, void *arg)
+{
+	struct test_fields *tf;
+	int i;
+
+	tf = arg;
+	if (hf->hf_namelen == 4 && memcmp(hf->hf_name, "vary", 4) == 0) {
+		tf->tf_nvary++;
+		snprintf(tf->tf_vary, sizeof(tf->tf_vary), "%.*s",
+		    (int)hf->hf_valuelen, hf->hf_value);
+	}
+	if (hf->hf_namelen == 16 &&
+	    memcmp(hf->hf_name, "content-encoding", 16) == 0) {
+		for (i = 0; i < COMPRESS_NENCODINGS; i++) {
+			if (strlen(compress_name(i)) == hf->hf_valuelen &&
+			    memcmp(compress_name(i), hf->hf_value,
+			    hf->hf_valuelen) == 0)
+				tf->tf_enc = i;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Decodes entry's header block onto tf; returns -1 on failure.
+ */
+static int
+test_decode(struct cache_entry *ce, struct test_fields *tf)
+{
+	struct hpack_decoder hd;
+	int r;
+
+	memset(tf, 0, sizeof(*tf));
+	tf->tf_enc = COMPRESS_IDENTITY;
+	if (hpack_decoder_init(&hd, 4096) < 0)
+		return -1;
+	r = hpack_decode(&hd, ce->ce_buf, ce->ce_hdrlen, test_field, tf);
+	hpack_decoder_clear(&hd);
+
+	return r;
+}
+
+/**
+ * Looks path up with accept-encoding accept, returning the entry and its
+ * encoding on enc, -1 if there is no entry.
+ */
+static struct cache_entry *
+test_lookup(struct cache *c, const char *path, const char *accept, int *enc)
+{
+	struct cache_key key;
+	struct cache_entry *ce;
+	struct test_fields tf;
+
+	memset(&key, 0, sizeof(key));
+	key.ck_method = "GET";
+	key.ck_authority = "a";
+	key.ck_path = path;
+	key.ck_accept = accept;
+
+	*enc = -1;
+	ce = cache_lookup(c, &key);
+	if (ce != NULL && test_decode(ce, &tf) == 0)
+		*enc = tf.tf_enc;
+
+	return ce;
+}
+
+/**
+ * Runs the loop until path has a variant for every supported encoding;
+ * returns -1 on timeout.
+ */
+static int
+test_wait(struct cache *c, const char *path)
+{
+	struct cache_entry *ce;
+	long start;
+	int enc, got;
+
+	for (start = test_now(); test_now() - start < TEST_TIMEOUT; ) {
+		event_base_loop(evbase, EVLOOP_NONBLOCK);
+		for (enc = COMPRESS_IDENTITY + 1; enc < COMPRESS_NENCODINGS;
+		    enc++) {
+			if (!compress_supported(enc))
+				continue;
+			ce = test_lookup(c, path, compress_name(enc), &got);
+			cache_entry_unref(ce);
+			if (got != enc)
+				break;
+		}
+		if (enc == COMPRESS_NENCODINGS)
+			return 0;
+		usleep(1000);
+	}
+
+	return -1;
+}
+
+static int
+test_insert(struct cache *c, const char *path, const char *body,
+    size_t bodylen)
+{
+	struct hpack_field fields[] = {
+		{ ":status", 7, "200", 3 },
+		{ "content-type", 12, "text/plain", 10 },
+		{ "vary", 4, "user-agent", 10 },
+	};
+	struct cache_key key;
+
+	memset(&key, 0, sizeof(key));
+	key.ck_method = "GET";
+	key.ck_authority = "a";
+	key.ck_path = path;
+
+	return cache_insert(c, &key, fields, 3, body, bodylen, TEST_TTL);
+}
+
+static int
+test_variants(struct cache *c)
+{
+	const struct test_accept *ta;
+	struct cache_entry *ce;
+	struct test_fields tf;
+	const char *what;
+	int failures;
+	int enc, want;
+	int i, j;
+
+	if (test_insert(c, "/", body1, sizeof(body1)) < 0 ||
+	    test_wait(c, "/") < 0) {
+		fprintf(stderr, "FAIL: variants: not stored\n");
+		return 1;
+	}
+
+	failures = 0;
+	for (i = 0; i < sizeof(accepts) / sizeof(accepts[0]); i++) {
+		ta = &accepts[i];
+		what = ta->ta_accept != NULL ? ta->ta_accept :
+		    "no accept-encoding";
+		want = COMPRESS_IDENTITY;
+		for (j = 0; j < COMPRESS_NENCODINGS; j++) {
+			if (compress_supported(ta->ta_encs[j])) {
+				want = ta->ta_encs[j];
+				break;
+			}
+		}
+
+		ce = test_lookup(c, "/", ta->ta_accept, &enc);
+		if (ce == NULL || test_decode(ce, &tf) < 0) {
+			fprintf(stderr, "FAIL: variants: %s: no entry\n",
+			    what);
+			failures++;
+		}
+		else if (enc != want) {
+			fprintf(stderr, "FAIL: variants: %s: got %s, not %s\n",
+			    what, compress_name(enc),
+			    compress_name(want));
+			failures++;
+		}
+		else if (tf.tf_nvary != 1 ||
+		    strcmp(tf.tf_vary, "user-agent, accept-encoding") != 0) {
+			fprintf(stderr, "FAIL: variants: %s: %d vary field(s), "
+			    "\"%s\"\n", what, tf.tf_nvary,
+			    tf.tf_vary);
+			failures++;
+		}
+		cache_entry_unref(ce);
+	}
+
+	return failures;
+}
+
+static void
+test_block(struct worker_job *job)
+{
+	struct test_block *tb;
+
+	tb = (struct test_block *)job;
+	pthread_mutex_lock(&tb->tb_lock);
+	while (!tb->tb_released)
+		pthread_cond_wait(&tb->tb_cond, &tb->tb_lock);
+	pthread_mutex_unlock(&tb->tb_lock);
+}
+
+static void
+test_unblocked(struct worker_job *job)
+{
+}
+
+static int
+test_generations(struct cache *c, struct worker_pool *pool)
+{
+	static struct test_block tb;
+	struct cache_entry *id, *gz;
+	char *out;
+	ssize_t outlen;
+	int enc, failures;
+
+	pthread_mutex_init(&tb.tb_lock, NULL);
+	pthread_cond_init(&tb.tb_cond, NULL);
+	tb.tb_job.wj_work = test_block;
+	tb.tb_job.wj_done = test_unblocked;
+	if (worker_submit(pool, &tb.tb_job) < 0) {
+		fprintf(stderr, "FAIL: generations: setup\n");
+		return 1;
+	}
+
+	/* Both compressions wait for the worker, the first one outdated */
+	failures = 0;
+	if (test_insert(c, "/g", body1, sizeof(body1)) < 0 ||
+	    test_insert(c, "/g", body2, sizeof(body2)) < 0) {
+		fprintf(stderr, "FAIL: generations: not stored\n");
+		failures++;
+	}
+	pthread_mutex_lock(&tb.tb_lock);
+	tb.tb_released = 1;
+	pthread_cond_signal(&tb.tb_cond);
+	pthread_mutex_unlock(&tb.tb_lock);
+	if (failures != 0)
+		return failures;
+	if (test_wait(c, "/g") < 0) {
+		fprintf(stderr, "FAIL: generations: no variants\n");
+		return 1;
+	}
+
+	outlen = compress_body(COMPRESS_GZIP, body2, sizeof(body2), &out);
+	id = test_lookup(c, "/g", NULL, &enc);
+	gz = test_lookup(c, "/g", "gzip", &enc);
+	if (id == NULL || gz == NULL || enc != COMPRESS_GZIP || outlen < 0 ||
+	    gz->ce_gen != id->ce_gen || gz->ce_bodylen != outlen ||
+	    memcmp(&gz->ce_buf[gz->ce_hdrlen], out, outlen) != 0) {
+		fprintf(stderr, "FAIL: generations: variant of the replaced "
+		    "response kept\n");
+		failures++;
+	}
+	if (outlen >= 0)
+		free(out);
+	cache_entry_unref(id);
+	cache_entry_unref(gz);
+
+	/* Stored again, too small to compress: variants go */
+	if (test_insert(c, "/g", body2, COMPRESS_MIN_SIZE - 1) < 0) {
+		fprintf(stderr, "FAIL: generations: not stored again\n");
+		return failures + 1;
+	}
+	gz = test_lookup(c, "/g", "gzip", &enc);
+	if (gz == NULL || enc != COMPRESS_IDENTITY ||
+	    gz->ce_bodylen != COMPRESS_MIN_SIZE - 1) {
+		fprintf(stderr, "FAIL: generations: variants of the replaced "
+		    "response kept\n");
+		failures++;
+	}
+	cache_entry_unref(gz);
+
+	return failures;
+}
+
+int
+main(void)
+{
+	struct worker_pool *pool;
+	struct cache *c;
+	int failures;
+	size_t i;
+
+	for (i = 0; i < sizeof(body1); i++)
+		body1[i] = "cached response body\n"[i % 21];
+	for (i = 0; i < sizeof(body2); i++)
+		body2[i] = "another one, shorter\n"[i % 21];
+
+	evbase = event_base_new();
+	pool = evbase == NULL ? NULL : worker_pool_new(1, evbase);
+	c = cache_new(64, 1024 * 1024);
+	if (pool == NULL || c == NULL) {
+		fprintf(stderr, "FAIL: setup\n");
+		return 1;
+	}
+	cache_set_pool(c, pool);
+
+	failures = test_variants(c);
+	failures += test_generations(c, pool);
+
+	worker_pool_free(pool);
+	cache_free(c);
+	event_base_free(evbase);
+
+	return failures != 0;
+}
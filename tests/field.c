@@ -0,0 +1,153 @@
+/**
+ * Header field validation tests
+ *
+ * The vector kernels are static, so field.c is built in here. Each of them
+ * must agree with the byte at a time scan on random and edge-case inputs, and
+ * so must field_name_check() and field_value_check(), whatever kernel they
+ * pick on this CPU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../field.c"
+
+/* Longest input tested: a few chunks of the widest kernel, and then some */
+#define TEST_LEN_MAX 100
+#define TEST_ROUNDS 20000
+
+/* Octets around the boundaries of what the kernels take */
+static const uint8_t test_edges[] = {
+	0x00, 0x01, '\t', '\n', '\r', 0x1F, 0x20, 0x21, ':', '@', 'A', 'Z',
+	'[', '`', 'a', 'z', 0x7E, 0x7F, 0x80, 0x9A, 0xC1, 0xFF,
+};
+
+static int failures;
+
+/* Reference: offset of the first forbidden octet, or len */
+static size_t
+test_name_ref(const uint8_t *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (s[i] <= 0x20 || s[i] >= 0x7F ||
+		    (s[i] >= 'A' && s[i] <= 'Z') || s[i] == ':')
+			break;
+
+	return i;
+}
+
+static size_t
+test_value_ref(const uint8_t *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (s[i] == '\0' || s[i] == '\r' || s[i] == '\n')
+			break;
+
+	return i;
+}
+
+/**
+ * A kernel scanning whole chunks of width bytes must scan them all, or return
+ * -1 if a forbidden octet is among them.
+ */
+static void
+test_kernel(const char *what, ssize_t (*kernel)(const char *, size_t),
+    size_t width, const uint8_t *s, size_t len, size_t bad)
+{
+	ssize_t want, got;
+
+	want = len / width * width;
+	if (bad < (size_t)want)
+		want = -1;
+
+	got = kernel((const char *)s, len);
+	if (got != want) {
+		fprintf(stderr, "FAIL: %s on %zu bytes (forbidden at %zu): "
+		    "%zd, not %zd\n", what, len, bad, got, want);
+		failures++;
+	}
+}
+
+static void
+test_input(const uint8_t *s, size_t len)
+{
+	size_t name, value;
+	int want;
+
+	name = test_name_ref(s, len);
+	value = test_value_ref(s, len);
+
+#ifdef __SSE2__
+	test_kernel("field_name_sse2", field_name_sse2, 16, s, len, name);
+	test_kernel("field_value_sse2", field_value_sse2, 16, s, len, value);
+#endif
+#ifdef FIELD_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		test_kernel("field_name_avx2", field_name_avx2, 32, s, len,
+		    name);
+		test_kernel("field_value_avx2", field_value_avx2, 32, s, len,
+		    value);
+	}
+#endif
+
+	want = len == 0 || name < len ? -1 : 0;
+	if (field_name_check((const char *)s, len) != want) {
+		fprintf(stderr, "FAIL: field_name_check on %zu bytes\n", len);
+		failures++;
+	}
+
+	want = value < len || (len > 0 && (s[0] == ' ' || s[0] == '\t' ||
+	    s[len - 1] == ' ' || s[len - 1] == '\t')) ? -1 : 0;
+	if (field_value_check((const char *)s, len) != want) {
+		fprintf(stderr, "FAIL: field_value_check on %zu bytes\n", len);
+		failures++;
+	}
+}
+
+int
+main(void)
+{
+	uint8_t buf[TEST_LEN_MAX];
+	size_t len, pos;
+	int e, i;
+
+	/* Valid names and values, with each edge octet at each position */
+	for (len = 0; len <= TEST_LEN_MAX; len++) {
+		memset(buf, 'x', len);
+		test_input(buf, len);
+		for (pos = 0; pos < len; pos++) {
+			for (e = 0; e < sizeof(test_edges); e++) {
+				buf[pos] = test_edges[e];
+				test_input(buf, len);
+			}
+			buf[pos] = 'x';
+		}
+	}
+
+	/* Random octets, mostly valid ones so that forbidden ones come late */
+	srandom(1);
+	for (i = 0; i < TEST_ROUNDS; i++) {
+		len = random() % (TEST_LEN_MAX + 1);
+		for (pos = 0; pos < len; pos++) {
+			switch (random() % 8) {
+			case 0:
+				buf[pos] = random();
+				break;
+			case 1:
+				buf[pos] = test_edges[random() %
+				    sizeof(test_edges)];
+				break;
+			default:
+				buf[pos] = 'a' + random() % 26;
+				break;
+			}
+		}
+		test_input(buf, len);
+	}
+
+	return failures != 0;
+}
@@ -0,0 +1,270 @@
+/**
+ * HTTP/1.1 request parsing tests
+ *
+ * Requests, well-formed and malformed, are written to an endpoint over a
+ * socket pair and the status of its response checked. Only GET has handlers:
+ * one answering 200 to anything, and one for /abs answering 200 only to
+ * http://b/abs?q, and 500 otherwise. Heavy ones, on a worker pool, answer
+ * 200 to /heavy if off the event loop and nothing to /heavy/none.
+ */
+
+#include <sys/socket.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+
+/* Time, in seconds, a response may take */
+#define TEST_TIMEOUT 5
+
+struct test_case {
+	const char *tc_what;
+	const char *tc_req;
+	size_t tc_len; /* 0 for strlen(tc_req) */
+	int tc_status;
+};
+
+static const struct test_case tests[] = {
+	{ "valid", "GET / HTTP/1.1\r\nHost: a\r\n\r\n", 0, 200 },
+	{ "uppercase name", "GET / HTTP/1.1\r\nHOST: a\r\n\r\n", 0, 200 },
+	{ "leading empty lines", "\r\n\r\nGET / HTTP/1.1\r\nHost: a\r\n\r\n",
+	    0, 200 },
+	{ "HTTP/1.0 with no host", "GET / HTTP/1.0\r\n\r\n", 0, 200 },
+	{ "no handler", "POST /x HTTP/1.1\r\nHost: a\r\n"
+	    "Content-Length: 5\r\n\r\nhello", 0, 404 },
+	{ "no host", "GET / HTTP/1.1\r\n\r\n", 0, 400 },
+	{ "two hosts", "GET / HTTP/1.1\r\nHost: a\r\nHost: b\r\n\r\n", 0,
+	    400 },
+	{ "unknown version", "GET / HTTP/2.0\r\nHost: a\r\n\r\n", 0, 505 },
+	{ "no version", "GET /\r\nHost: a\r\n\r\n", 0, 400 },
+	{ "double space", "GET  / HTTP/1.1\r\nHost: a\r\n\r\n", 0, 400 },
+	{ "empty method", " / HTTP/1.1\r\nHost: a\r\n\r\n", 0, 400 },
+	{ "delimiter in method", "G(T / HTTP/1.1\r\nHost: a\r\n\r\n", 0,
+	    400 },
+	{ "absolute form", "GET http://b/abs?q HTTP/1.1\r\nHost: a\r\n\r\n",
+	    0, 200 },
+	{ "absolute form, no path", "GET HTTP://b HTTP/1.1\r\nHost: a\r\n\r\n",
+	    0, 200 },
+	{ "absolute form, no host", "GET http://b/ HTTP/1.1\r\n\r\n", 0, 400 },
+	{ "absolute form, empty authority", "GET http:///abs HTTP/1.1\r\n"
+	    "Host: a\r\n\r\n", 0, 400 },
+	{ "absolute form, userinfo", "GET http://u@b/ HTTP/1.1\r\n"
+	    "Host: a\r\n\r\n", 0, 400 },
+	{ "unknown scheme", "GET ftp://b/ HTTP/1.1\r\nHost: a\r\n\r\n", 0,
+	    400 },
+	{ "heavy handler", "GET /heavy HTTP/1.1\r\nHost: a\r\n\r\n", 0, 200 },
+	{ "heavy handler, no response", "GET /heavy/none HTTP/1.1\r\n"
+	    "Host: a\r\n\r\n", 0, 500 },
+	{ "control in target", "GET /\x01 HTTP/1.1\r\nHost: a\r\n\r\n", 0,
+	    400 },
+	{ "non-ASCII target", "GET /\xC3\xA9 HTTP/1.1\r\nHost: a\r\n\r\n", 0,
+	    400 },
+	{ "obsolete line folding", "GET / HTTP/1.1\r\nHost: a\r\n"
+	    " b\r\n\r\n", 0, 400 },
+	{ "no colon", "GET / HTTP/1.1\r\nHost: a\r\nfoo\r\n\r\n", 0, 400 },
+	{ "empty name", "GET / HTTP/1.1\r\nHost: a\r\n: b\r\n\r\n", 0, 400 },
+	{ "space before colon", "GET / HTTP/1.1\r\nHost : a\r\n\r\n", 0,
+	    400 },
+	{ "non-ASCII name", "GET / HTTP/1.1\r\nHost: a\r\nf\xC3\xA9: b\r\n"
+	    "\r\n", 0, 400 },
+	{ "CR in value", "GET / HTTP/1.1\r\nHost: a\r\nfoo: a\rb\r\n\r\n", 0,
+	    400 },
+	{ "NUL in value", "GET / HTTP/1.1\r\nHost: a\r\nfoo: a\0b\r\n\r\n",
+	    37, 400 },
+	{ "empty content-length", "GET / HTTP/1.1\r\nHost: a\r\n"
+	    "Content-Length:\r\n\r\n", 0, 400 },
+	{ "negative content-length", "GET / HTTP/1.1\r\nHost: a\r\n"
+	    "Content-Length: -1\r\n\r\n", 0, 400 },
+	{ "conflicting content-lengths", "GET / HTTP/1.1\r\nHost: a\r\n"
+	    "Content-Length: 1\r\nContent-Length: 2\r\n\r\nab", 0, 400 },
+	{ "content-length overflowing", "GET / HTTP/1.1\r\nHost: a\r\n"
+	    "Content-Length: 99999999999999999999999999\r\n\r\n", 0, 413 },
+	{ "chunked", "GET / HTTP/1.1\r\nHost: a\r\n"
+	    "Transfer-Encoding: chunked\r\n\r\n", 0, 501 },
+};
+
+struct test_state {
+	struct event_base *ts_evbase;
+	int ts_status;
+	char ts_buf[128];
+	size_t ts_len;
+};
+
+static void
+test_handler(struct endpoint_request *er, void *arg)
+{
+	endpoint_respond(er, 200, NULL, 0, "ok", 2);
+}
+
+/* Absolute form: authority and path come from the target */
+static void
+test_handler_abs(struct endpoint_request *er, void *arg)
+{
+	const char *authority;
+	int ok;
+
+	authority = endpoint_request_authority(er);
+	ok = authority != NULL && strcmp(authority, "b") == 0 &&
+	    strcmp(endpoint_request_path(er), "/abs?q") == 0;
+	endpoint_respond(er, ok ? 200 : 500, NULL, 0, NULL, 0);
+}
+
+/* Event loop's thread */
+static pthread_t test_loop;
+
+/* Heavy: fields and body are gone once it returns */
+static void
+test_handler_heavy(struct endpoint_request *er, void *arg)
+{
+	struct hpack_field hf;
+	char name[] = "x-heavy", body[] = "done";
+
+	if (pthread_equal(pthread_self(), test_loop)) {
+		endpoint_respond(er, 500, NULL, 0, NULL, 0);
+		return;
+	}
+	hf = (struct hpack_field){ name, strlen(name), body, strlen(body) };
+	endpoint_respond(er, 200, &hf, 1, body, strlen(body));
+}
+
+static void
+test_handler_none(struct endpoint_request *er, void *arg)
+{
+}
+
+/**
+ * Waits for the status line of the response, then leaves the loop.
+ */
+static void
+test_read(evutil_socket_t fd, short events, void *arg)
+{
+	struct test_state *ts;
+	ssize_t bytes;
+	char *eol;
+
+	ts = arg;
+	if (events & EV_TIMEOUT) {
+		event_base_loopbreak(ts->ts_evbase);
+		return;
+	}
+
+	bytes = recv(fd, &ts->ts_buf[ts->ts_len],
+	    sizeof(ts->ts_buf) - 1 - ts->ts_len, 0);
+	if (bytes <= 0) {
+		event_base_loopbreak(ts->ts_evbase);
+		return;
+	}
+	ts->ts_len += bytes;
+	ts->ts_buf[ts->ts_len] = '\0';
+
+	eol = strstr(ts->ts_buf, "\r\n");
+	if (eol == NULL && ts->ts_len < sizeof(ts->ts_buf) - 1)
+		return;
+	if (strncmp(ts->ts_buf, "HTTP/1.1 ", 9) == 0)
+		ts->ts_status = atoi(&ts->ts_buf[9]);
+	event_base_loopbreak(ts->ts_evbase);
+}
+
+/**
+ * Returns the status of the response to req, 0 if there was none.
+ */
+static int
+test_request(struct event_base *evbase, struct endpoint *ep, const char *req,
+    size_t len)
+{
+	struct test_state ts;
+	struct timeval tv;
+	struct event *ev;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 0;
+	}
+	if (endpoint_accept(ep, sv[0]) < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return 0;
+	}
+
+	memset(&ts, 0, sizeof(ts));
+	ts.ts_evbase = evbase;
+	ev = event_new(evbase, sv[1], EV_READ | EV_PERSIST, test_read, &ts);
+	tv.tv_sec = TEST_TIMEOUT;
+	tv.tv_usec = 0;
+	if (ev == NULL || event_add(ev, &tv) < 0 ||
+	    send(sv[1], req, len, 0) != len) {
+		if (ev != NULL)
+			event_free(ev);
+		close(sv[1]);
+		return 0;
+	}
+
+	event_base_dispatch(evbase);
+
+	/* Endpoint closes its side once it sees ours closed */
+	event_free(ev);
+	close(sv[1]);
+
+	return ts.ts_status;
+}
+
+int
+main(void)
+{
+	struct event_base *evbase;
+	struct worker_pool *pool;
+	struct endpoint *ep;
+	char big[16384];
+	size_t len;
+	int failures, status, i;
+
+	test_loop = pthread_self();
+	evbase = event_base_new();
+	pool = evbase == NULL ? NULL : worker_pool_new(2, evbase);
+	ep = pool == NULL ? NULL : endpoint_new(evbase, 100);
+	if (ep == NULL || endpoint_handle(ep, "GET", "/", test_handler,
+	    NULL, 0) < 0 || endpoint_handle(ep, "GET", "/abs", test_handler_abs,
+	    NULL, 0) < 0 || endpoint_handle(ep, "GET", "/heavy",
+	    test_handler_heavy, NULL, ENDPOINT_HEAVY) < 0 ||
+	    endpoint_handle(ep, "GET", "/heavy/none", test_handler_none, NULL,
+	    ENDPOINT_HEAVY) < 0) {
+		fprintf(stderr, "FAIL: setup\n");
+		return 1;
+	}
+	endpoint_set_pool(ep, pool);
+
+	failures = 0;
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		len = tests[i].tc_len != 0 ? tests[i].tc_len :
+		    strlen(tests[i].tc_req);
+		status = test_request(evbase, ep, tests[i].tc_req, len);
+		if (status != tests[i].tc_status) {
+			fprintf(stderr, "FAIL: %s: %d, not %d\n",
+			    tests[i].tc_what, status, tests[i].tc_status);
+			failures++;
+		}
+	}
+
+	/* Header never ending within the largest taken */
+	len = snprintf(big, sizeof(big), "GET / HTTP/1.1\r\nHost: a\r\n");
+	memset(&big[len], 'x', sizeof(big) - len);
+	status = test_request(evbase, ep, big, sizeof(big));
+	if (status != 431) {
+		fprintf(stderr, "FAIL: header too large: %d, not 431\n",
+		    status);
+		failures++;
+	}
+
+	endpoint_free(ep);
+	worker_pool_free(pool);
+	event_base_free(evbase);
+
+	return failures != 0;
+}
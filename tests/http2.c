@@ -0,0 +1,565 @@
+/**
+ * HTTP/2 endpoint tests
+ *
+ * Frame ordering: a bulk response is requested from an endpoint over TCP on
+ * the loopback interface, and not read until its sending stalls; then a
+ * malformed request makes the endpoint reset its stream. The RST_STREAM frame
+ * has to arrive ahead of the rest of the bulk response, and every frame whole.
+ * It runs both with and without adaptive frame sizing; with it, what the
+ * endpoint wrote before stalling also has to end on a frame boundary, no frame
+ * being cut to fit the sending budget. Its socket's send buffer is then left
+ * for the kernel to size, as it would be, so that writes are bound by the
+ * congestion window rather than cut short by a full buffer.
+ *
+ * Settings: a body waiting for a stream window opened by a later SETTINGS
+ * frame alone has to be sent, and a SETTINGS frame taking the window of an
+ * open stream past its maximum has to close the connection. The same goes
+ * for a request body sent by a client pool.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+
+/* Size of the bulk response */
+#define TEST_BODY_LEN (4 * 1024 * 1024)
+
+/* Time, in milliseconds, the response is left unread, then may take */
+#define TEST_STALL 200
+#define TEST_TIMEOUT 5000
+
+/* Time, in milliseconds, with nothing more to read once stalled */
+#define TEST_DRAIN 50
+
+/* Size of the pool's request body, past the default windows */
+#define TEST_POST_LEN 100000
+#define TEST_WINDOW 65535
+
+#define TEST_LOWAT 16384
+#define TEST_BUFSIZE 65536
+
+static char test_body[TEST_BODY_LEN];
+
+/* What was received */
+struct test_count {
+	size_t tc_total; /* body bytes */
+	size_t tc_after; /* body bytes after the RST_STREAM frame */
+	int tc_rst; /* RST_STREAM frame seen */
+	int tc_ended; /* END_STREAM seen */
+};
+
+static void
+test_handler(struct endpoint_request *er, void *arg)
+{
+	endpoint_respond(er, 200, NULL, 0, test_body, sizeof(test_body));
+}
+
+static void
+test_response(struct pool_response *pr, void *arg)
+{
+}
+
+static long
+test_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Appends a frame to buf, returning its length.
+ */
+static size_t
+test_frame(uint8_t *buf, int type, int flags, uint32_t streamid,
+    const uint8_t *payload, size_t len)
+{
+	buf[0] = len >> 16;
+	buf[1] = len >> 8;
+	buf[2] = len;
+	buf[3] = type;
+	buf[4] = flags;
+	buf[5] = streamid >> 24;
+	buf[6] = streamid >> 16;
+	buf[7] = streamid >> 8;
+	buf[8] = streamid;
+	memcpy(&buf[9], payload, len);
+
+	return 9 + len;
+}
+
+/**
+ * Connects two TCP sockets over the loopback interface, with receive buffer
+ * small enough for the response not to fit on it, and so the send buffer of
+ * the first one, unless told to leave it.
+ */
+static int
+test_socketpair(int sv[2], int autosize)
+{
+	struct sockaddr_in sin;
+	socklen_t len;
+	int lfd, size;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(sin);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&sin, len) < 0 ||
+	    listen(lfd, 1) < 0 ||
+	    getsockname(lfd, (struct sockaddr *)&sin, &len) < 0) {
+		perror("listen");
+		if (lfd >= 0)
+			close(lfd);
+		return -1;
+	}
+	size = TEST_BUFSIZE;
+	sv[1] = socket(AF_INET, SOCK_STREAM, 0);
+	if (sv[1] < 0 || setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size,
+	    sizeof(size)) < 0 ||
+	    connect(sv[1], (struct sockaddr *)&sin, len) < 0) {
+		perror("connect");
+		if (sv[1] >= 0)
+			close(sv[1]);
+		close(lfd);
+		return -1;
+	}
+	sv[0] = accept(lfd, NULL, NULL);
+	close(lfd);
+	if (sv[0] < 0 || (!autosize && setsockopt(sv[0], SOL_SOCKET,
+	    SO_SNDBUF, &size, sizeof(size)) < 0)) {
+		perror("accept");
+		if (sv[0] >= 0)
+			close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Parses the frames on in, from *pos on, accounting DATA ones of stream 1 and
+ * telling whether the RST_STREAM of stream 3 was seen; returns -1 on frames
+ * not expected.
+ */
+static int
+test_parse(const uint8_t *in, size_t inlen, size_t *pos, struct test_count *tc)
+{
+	uint32_t streamid;
+	size_t len;
+	int type;
+
+	while (inlen - *pos >= 9) {
+		len = in[*pos] << 16 | in[*pos + 1] << 8 | in[*pos + 2];
+		if (inlen - *pos < 9 + len)
+			break;
+		type = in[*pos + 3];
+		streamid = (uint32_t)(in[*pos + 5] & 0x7F) << 24 |
+		    in[*pos + 6] << 16 | in[*pos + 7] << 8 | in[*pos + 8];
+		if (type == 0x0 && streamid == 1) {
+			tc->tc_total += len;
+			if (tc->tc_rst)
+				tc->tc_after += len;
+			if (in[*pos + 4] & 0x1)
+				tc->tc_ended = 1;
+		}
+		else if (type == 0x3 && streamid == 3)
+			tc->tc_rst = 1;
+		else if (type != 0x1 && type != 0x4 && type != 0x8) {
+			fprintf(stderr, "frame of type 0x%02x on stream %u\n",
+			    type, streamid);
+			return -1;
+		}
+		*pos += 9 + len;
+	}
+
+	return 0;
+}
+
+/**
+ * Runs the frame ordering test, with adaptive frame sizing if adaptive;
+ * returns 0 if it passes.
+ */
+static int
+test_overtake(struct event_base *evbase, struct endpoint *ep, int adaptive)
+{
+	static const uint8_t settings[] = {
+		0x00, 0x04, 0x7F, 0xFF, 0xFF, 0xFF /* INITIAL_WINDOW_SIZE */
+	};
+	static const uint8_t update[] = { 0x7F, 0xFF, 0x00, 0x00 };
+	static const uint8_t get[] = { 0x82, 0x86, 0x84 }; /* GET http / */
+	static const uint8_t bad[] = { 0x82 }; /* no :scheme nor :path */
+	struct http2_connection *conn;
+	struct test_count tc;
+	uint8_t out[256], *in;
+	size_t outlen, inlen, pos;
+	const char *what;
+	ssize_t bytes;
+	long start;
+	int sv[2];
+
+	if (test_socketpair(sv, adaptive) < 0)
+		return 1;
+	conn = endpoint_attach(ep, sv[0]);
+	if (conn == NULL) {
+		close(sv[0]);
+		close(sv[1]);
+		return 1;
+	}
+	if (adaptive && http2_connection_set_adaptive(conn, TEST_LOWAT) < 0) {
+		fprintf(stderr, "SKIP: adaptive frame sizing\n");
+		close(sv[1]);
+		return 0;
+	}
+
+	/* Requests the bulk response, with all the window it may take */
+	outlen = sizeof("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n") - 1;
+	memcpy(out, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", outlen);
+	outlen += test_frame(&out[outlen], 0x4, 0x0, 0, settings,
+	    sizeof(settings));
+	outlen += test_frame(&out[outlen], 0x8, 0x0, 0, update,
+	    sizeof(update));
+	outlen += test_frame(&out[outlen], 0x1, 0x5, 1, get, sizeof(get));
+	if (send(sv[1], out, outlen, 0) != outlen) {
+		perror("send");
+		close(sv[1]);
+		return 1;
+	}
+
+	in = malloc(2 * TEST_BODY_LEN);
+	if (in == NULL) {
+		perror("malloc");
+		close(sv[1]);
+		return 1;
+	}
+	memset(&tc, 0, sizeof(tc));
+	inlen = pos = 0;
+	what = adaptive ? "adaptive" : "plain";
+
+	/* Leaves it unread until sending stalls, then takes what the endpoint
+	 * wrote, with it stopped */
+	for (start = test_now(); test_now() - start < TEST_STALL; ) {
+		event_base_loop(evbase, EVLOOP_NONBLOCK);
+		usleep(1000);
+	}
+	for (start = test_now(); test_now() - start < TEST_DRAIN; ) {
+		bytes = recv(sv[1], &in[inlen], 2 * TEST_BODY_LEN - inlen,
+		    MSG_DONTWAIT);
+		if (bytes > 0) {
+			inlen += bytes;
+			start = test_now();
+		}
+		else
+			usleep(1000);
+	}
+	if (test_parse(in, inlen, &pos, &tc) < 0) {
+		fprintf(stderr, "FAIL: %s: unexpected frame\n", what);
+		goto fail;
+	}
+	if (adaptive && pos != inlen) {
+		fprintf(stderr, "FAIL: %s: frame cut after %zu bytes\n", what,
+		    inlen);
+		goto fail;
+	}
+
+	/* Asks for a reset, then reads everything else */
+	outlen = test_frame(out, 0x1, 0x5, 3, bad, sizeof(bad));
+	if (send(sv[1], out, outlen, 0) != outlen) {
+		perror("send");
+		goto fail;
+	}
+	for (start = test_now(); !tc.tc_ended &&
+	    test_now() - start < TEST_TIMEOUT; ) {
+		event_base_loop(evbase, EVLOOP_NONBLOCK);
+		bytes = recv(sv[1], &in[inlen], 2 * TEST_BODY_LEN - inlen,
+		    MSG_DONTWAIT);
+		if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("recv");
+			goto fail;
+		}
+		if (bytes <= 0)
+			continue;
+		inlen += bytes;
+		if (test_parse(in, inlen, &pos, &tc) < 0) {
+			fprintf(stderr, "FAIL: %s: unexpected frame\n", what);
+			goto fail;
+		}
+	}
+	free(in);
+	close(sv[1]);
+
+	if (!tc.tc_ended || tc.tc_total != TEST_BODY_LEN) {
+		fprintf(stderr, "FAIL: %s: %zu of %d body bytes\n", what,
+		    tc.tc_total, TEST_BODY_LEN);
+		return 1;
+	}
+	if (!tc.tc_rst || tc.tc_after == 0) {
+		fprintf(stderr, "FAIL: %s: RST_STREAM %s\n", what,
+		    tc.tc_rst ? "behind the whole response" :
+		    "never received");
+		return 1;
+	}
+
+	/* Lets the endpoint see the connection closed */
+	event_base_loop(evbase, EVLOOP_NONBLOCK);
+
+	return 0;
+
+fail:
+	free(in);
+	close(sv[1]);
+	return 1;
+}
+
+/**
+ * Sends len bytes of out, then runs the loop and reads onto in until nothing
+ * more comes for TEST_DRAIN milliseconds; returns 1 once the connection is
+ * closed, 0 otherwise and -1 on failure.
+ */
+static int
+test_exchange(struct event_base *evbase, int fd, const uint8_t *out,
+    size_t outlen, uint8_t *in, size_t *inlen, size_t insize)
+{
+	ssize_t bytes;
+	long start;
+
+	if (send(fd, out, outlen, 0) != outlen) {
+		perror("send");
+		return -1;
+	}
+	for (start = test_now(); test_now() - start < TEST_DRAIN; ) {
+		event_base_loop(evbase, EVLOOP_NONBLOCK);
+		bytes = recv(fd, &in[*inlen], insize - *inlen, MSG_DONTWAIT);
+		if (bytes == 0)
+			return 1;
+		if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("recv");
+			return -1;
+		}
+		if (bytes > 0) {
+			*inlen += bytes;
+			start = test_now();
+		}
+		else
+			usleep(1000);
+	}
+
+	return 0;
+}
+
+/**
+ * Runs the settings test; returns 0 if it passes.
+ */
+static int
+test_settings(struct event_base *evbase, struct endpoint *ep)
+{
+	static const uint8_t closed[] = {
+		0x00, 0x04, 0x00, 0x00, 0x00, 0x00 /* INITIAL_WINDOW_SIZE */
+	};
+	static const uint8_t opened[] = {
+		0x00, 0x04, 0x00, 0x00, 0x00, 0x10
+	};
+	static const uint8_t past[] = {
+		0x00, 0x04, 0x00, 0x00, 0x00, 0x11
+	};
+	static const uint8_t update[] = { 0x7F, 0xFF, 0x00, 0x00 };
+	static const uint8_t fill[] = { 0x7F, 0xFF, 0xFF, 0xEF };
+	static const uint8_t get[] = { 0x82, 0x86, 0x84 };
+	struct test_count tc;
+	uint8_t out[256], in[4096];
+	size_t outlen, inlen, pos;
+	int sv[2], r;
+
+	if (test_socketpair(sv, 1) < 0)
+		return 1;
+	if (endpoint_attach(ep, sv[0]) == NULL) {
+		close(sv[0]);
+		close(sv[1]);
+		return 1;
+	}
+	memset(&tc, 0, sizeof(tc));
+	inlen = pos = 0;
+
+	/* Request with no stream window: no body */
+	outlen = sizeof("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n") - 1;
+	memcpy(out, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", outlen);
+	outlen += test_frame(&out[outlen], 0x4, 0x0, 0, closed,
+	    sizeof(closed));
+	outlen += test_frame(&out[outlen], 0x8, 0x0, 0, update,
+	    sizeof(update));
+	outlen += test_frame(&out[outlen], 0x1, 0x5, 1, get, sizeof(get));
+	r = test_exchange(evbase, sv[1], out, outlen, in, &inlen, sizeof(in));
+	if (r == 0 && test_parse(in, inlen, &pos, &tc) < 0)
+		r = -1;
+	if (r != 0 || tc.tc_total != 0) {
+		fprintf(stderr, "FAIL: settings: %zu body bytes with no "
+		    "window\n", tc.tc_total);
+		goto fail;
+	}
+
+	/* Window opened by SETTINGS alone */
+	outlen = test_frame(out, 0x4, 0x0, 0, opened, sizeof(opened));
+	r = test_exchange(evbase, sv[1], out, outlen, in, &inlen, sizeof(in));
+	if (r == 0 && test_parse(in, inlen, &pos, &tc) < 0)
+		r = -1;
+	if (r != 0 || tc.tc_total != 0x10) {
+		fprintf(stderr, "FAIL: settings: %zu body bytes, not %d, once "
+		    "the window opened\n", tc.tc_total, 0x10);
+		goto fail;
+	}
+
+	/* Open stream with the largest window, then one more byte */
+	outlen = test_frame(out, 0x1, 0x4, 3, get, sizeof(get));
+	outlen += test_frame(&out[outlen], 0x8, 0x0, 3, fill, sizeof(fill));
+	outlen += test_frame(&out[outlen], 0x4, 0x0, 0, past, sizeof(past));
+	r = test_exchange(evbase, sv[1], out, outlen, in, &inlen, sizeof(in));
+	if (r != 1) {
+		fprintf(stderr, "FAIL: settings: window past its maximum "
+		    "taken\n");
+		goto fail;
+	}
+
+	close(sv[1]);
+	event_base_loop(evbase, EVLOOP_NONBLOCK);
+	return 0;
+
+fail:
+	close(sv[1]);
+	return 1;
+}
+
+/**
+ * Runs the settings test on a client pool's request body; returns 0 if it
+ * passes.
+ */
+static int
+test_pool(struct event_base *evbase)
+{
+	static const uint8_t opened[] = {
+		0x00, 0x04, 0x00, 0x01, 0x86, 0xA0 /* TEST_POST_LEN */
+	};
+	static const uint8_t update[] = { 0x00, 0x10, 0x00, 0x00 };
+	struct sockaddr_in sin;
+	struct test_count tc;
+	struct pool *pool;
+	uint8_t out[256], *in;
+	size_t outlen, inlen, pos;
+	char port[8];
+	socklen_t len;
+	int lfd, fd, r;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(sin);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&sin, len) < 0 ||
+	    listen(lfd, 1) < 0 ||
+	    getsockname(lfd, (struct sockaddr *)&sin, &len) < 0) {
+		perror("listen");
+		if (lfd >= 0)
+			close(lfd);
+		return 1;
+	}
+	snprintf(port, sizeof(port), "%d", ntohs(sin.sin_port));
+
+	pool = pool_new(evbase, "127.0.0.1", port, 1, 0);
+	in = malloc(2 * TEST_POST_LEN);
+	if (pool == NULL || in == NULL || pool_request(pool, "POST", "/",
+	    NULL, 0, test_body, TEST_POST_LEN, test_response, NULL) < 0) {
+		fprintf(stderr, "FAIL: pool: setup\n");
+		pool_free(pool);
+		free(in);
+		close(lfd);
+		return 1;
+	}
+	fd = accept(lfd, NULL, NULL);
+	close(lfd);
+	if (fd < 0) {
+		perror("accept");
+		pool_free(pool);
+		free(in);
+		return 1;
+	}
+	memset(&tc, 0, sizeof(tc));
+	inlen = 0;
+	pos = sizeof("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n") - 1;
+
+	/* Body sent as far as the default windows allow */
+	r = test_exchange(evbase, fd, out, 0, in, &inlen, 2 * TEST_POST_LEN);
+	if (r == 0 && (inlen < pos || test_parse(in, inlen, &pos, &tc) < 0))
+		r = -1;
+	if (r != 0 || tc.tc_total != TEST_WINDOW) {
+		fprintf(stderr, "FAIL: pool: %zu body bytes, not %d, on the "
+		    "default window\n", tc.tc_total, TEST_WINDOW);
+		goto fail;
+	}
+
+	/* Rest of it once SETTINGS alone opens the stream window */
+	outlen = test_frame(out, 0x4, 0x0, 0, opened, 0);
+	outlen += test_frame(&out[outlen], 0x8, 0x0, 0, update,
+	    sizeof(update));
+	outlen += test_frame(&out[outlen], 0x4, 0x0, 0, opened,
+	    sizeof(opened));
+	r = test_exchange(evbase, fd, out, outlen, in, &inlen,
+	    2 * TEST_POST_LEN);
+	if (r == 0 && test_parse(in, inlen, &pos, &tc) < 0)
+		r = -1;
+	if (r != 0 || tc.tc_total != TEST_POST_LEN || !tc.tc_ended) {
+		fprintf(stderr, "FAIL: pool: %zu body bytes, not %d, once the "
+		    "window opened\n", tc.tc_total, TEST_POST_LEN);
+		goto fail;
+	}
+
+	pool_free(pool);
+	close(fd);
+	free(in);
+	return 0;
+
+fail:
+	pool_free(pool);
+	close(fd);
+	free(in);
+	return 1;
+}
+
+int
+main(void)
+{
+	struct event_base *evbase;
+	struct endpoint *ep;
+	int failures;
+
+	evbase = event_base_new();
+	ep = evbase == NULL ? NULL : endpoint_new(evbase, 100);
+	if (ep == NULL || endpoint_handle(ep, "GET", "/", test_handler, NULL,
+	    0) < 0) {
+		fprintf(stderr, "FAIL: setup\n");
+		return 1;
+	}
+
+	failures = test_overtake(evbase, ep, 0);
+	failures += test_overtake(evbase, ep, 1);
+	failures += test_settings(evbase, ep);
+	failures += test_pool(evbase);
+
+	endpoint_free(ep);
+	event_base_free(evbase);
+
+	return failures != 0;
+}
@@ -0,0 +1,108 @@
+/**
+ * Replay tests
+ *
+ * Traces with well-formed and undecodable header blocks, in both directions,
+ * are written and replayed with ./replay, which must handle the former and
+ * close the connections of the latter, with no crash.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+#include "util.h"
+#include "timer.h"
+#include "http2.h"
+#include "trace.h"
+
+#define TEST_TRACE "tests/replay.trace"
+
+/* Header blocks: 0xbf refers past the end of the (empty) dynamic table */
+static const char test_bad[] = { (char)0xbf };
+static const char test_request[] = { (char)0x82, (char)0x86, (char)0x84 };
+static const char test_response[] = { (char)0x88 };
+
+static void
+test_record(uint32_t connid, int dir, const char *block, size_t len)
+{
+	struct http2_connection conn;
+	struct http2_frame fr;
+
+	memset(&conn, 0, sizeof(conn));
+	conn.cn_id = connid;
+	memset(&fr, 0, sizeof(fr));
+	fr.fr_conn = &conn;
+	fr.fr_type = HTTP2_FRAME_HEADERS;
+	fr.fr_flags = HTTP2_FRAME_HEADERS_END_HEADERS |
+	    HTTP2_FRAME_HEADERS_END_STREAM;
+	fr.fr_streamid = 1;
+	fr.fr_length = len;
+	fr.fr_buf = (char *)block;
+
+	trace_frame(trace_recorder, &fr, dir);
+}
+
+/**
+ * Replays the trace in direction dir; the line of totals must hold want.
+ */
+static int
+test_replay(const char *dir, const char *want)
+{
+	char cmd[128], line[256];
+	FILE *fp;
+	int found, status;
+
+	snprintf(cmd, sizeof(cmd), "./replay -f -d %s %s 2>/dev/null", dir,
+	    TEST_TRACE);
+	fp = popen(cmd, "r");
+	if (fp == NULL) {
+		perror("popen");
+		return -1;
+	}
+	found = 0;
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (strstr(line, want) != NULL)
+			found = 1;
+	status = pclose(fp);
+
+	if (status != 0 || !found) {
+		fprintf(stderr, "FAIL: replay -d %s: status %d, %s\"%s\"\n",
+		    dir, status, found ? "" : "no ", want);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+main(void)
+{
+	int failures;
+
+	/* One connection per block, as the bad ones close theirs */
+	if (trace_start(TEST_TRACE) < 0) {
+		fprintf(stderr, "FAIL: trace_start\n");
+		return 1;
+	}
+	test_record(1, TRACE_RX, test_request, sizeof(test_request));
+	test_record(2, TRACE_RX, test_bad, sizeof(test_bad));
+	test_record(3, TRACE_TX, test_response, sizeof(test_response));
+	test_record(4, TRACE_TX, test_bad, sizeof(test_bad));
+	trace_stop();
+
+	failures = 0;
+	if (test_replay("rx", "1 request(s) answered") < 0)
+		failures++;
+	if (test_replay("tx", "1 response header block(s), 0 malformed") < 0)
+		failures++;
+
+	unlink(TEST_TRACE);
+
+	return failures != 0;
+}
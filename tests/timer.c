@@ -0,0 +1,134 @@
+/**
+ * Timer wheel tests
+ *
+ * Timers are checked to run exactly on the tick they are due, whichever level
+ * they were put on; the wheel steps one tick at a time even when its libevent
+ * timer is late, so this does not depend on scheduling delays.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+#include "timer.h"
+
+/* Longest delay tested, in ticks: past a few cascades of level 1 */
+#define TEST_TICKS (4 * TIMER_SLOTS + 8)
+
+struct test_timer {
+	struct timer tt_timer;
+	struct timer_wheel *tt_wheel;
+	int tt_nfired;
+	uint64_t tt_firedat; /* wheel's tick when run */
+};
+
+static int failures;
+
+static void
+test_fire(struct timer *tm, void *arg)
+{
+	struct test_timer *tt;
+
+	tt = arg;
+	tt->tt_nfired++;
+	tt->tt_firedat = tt->tt_wheel->tw_now;
+}
+
+static void
+test_check(int cond, const char *what, int i)
+{
+	if (cond)
+		return;
+	fprintf(stderr, "FAIL: %s (timer %d)\n", what, i);
+	failures++;
+}
+
+/**
+ * Every delay up to TEST_TICKS, so that some timers are due on each tick
+ * where upper levels are cascaded.
+ */
+static void
+test_expiry(struct event_base *evbase, struct timer_wheel *tw)
+{
+	struct test_timer tt[TEST_TICKS + 1];
+	int i;
+
+	for (i = 1; i <= TEST_TICKS; i++) {
+		memset(&tt[i], 0, sizeof(tt[i]));
+		tt[i].tt_wheel = tw;
+		timer_init(&tt[i].tt_timer, test_fire, &tt[i]);
+		if (timer_schedule(tw, &tt[i].tt_timer, i * tw->tw_tick) < 0)
+			test_check(0, "timer_schedule", i);
+	}
+
+	/* Loop is left once the wheel has no timers left */
+	event_base_dispatch(evbase);
+
+	for (i = 1; i <= TEST_TICKS; i++) {
+		test_check(tt[i].tt_nfired == 1, "ran once", i);
+		test_check(tt[i].tt_firedat == tt[i].tt_timer.tm_expire,
+		    "ran on its tick", i);
+	}
+}
+
+/**
+ * Canceled timers never run; rescheduled ones run once, on their new tick.
+ */
+static void
+test_cancel(struct event_base *evbase, struct timer_wheel *tw)
+{
+	struct test_timer tt[TEST_TICKS + 1];
+	int i;
+
+	for (i = 1; i <= TEST_TICKS; i++) {
+		memset(&tt[i], 0, sizeof(tt[i]));
+		tt[i].tt_wheel = tw;
+		timer_init(&tt[i].tt_timer, test_fire, &tt[i]);
+		timer_schedule(tw, &tt[i].tt_timer, i * tw->tw_tick);
+	}
+	for (i = 1; i <= TEST_TICKS; i++) {
+		if (i % 3 == 0)
+			timer_cancel(tw, &tt[i].tt_timer);
+		else if (i % 3 == 1)
+			timer_schedule(tw, &tt[i].tt_timer,
+			    (TEST_TICKS + 1 - i) * tw->tw_tick);
+	}
+
+	event_base_dispatch(evbase);
+
+	for (i = 1; i <= TEST_TICKS; i++) {
+		if (i % 3 == 0) {
+			test_check(tt[i].tt_nfired == 0, "canceled", i);
+			continue;
+		}
+		test_check(tt[i].tt_nfired == 1, "ran once", i);
+		test_check(tt[i].tt_firedat == tt[i].tt_timer.tm_expire,
+		    "ran on its tick", i);
+	}
+}
+
+int
+main(void)
+{
+	struct event_base *evbase;
+	struct timer_wheel *tw;
+
+	evbase = event_base_new();
+	tw = timer_wheel_new(evbase, 1);
+	if (evbase == NULL || tw == NULL) {
+		fprintf(stderr, "FAIL: setup\n");
+		return 1;
+	}
+
+	test_expiry(evbase, tw);
+	test_cancel(evbase, tw);
+
+	timer_wheel_free(tw);
+	event_base_free(evbase);
+
+	return failures != 0;
+}
@@ -0,0 +1,289 @@
+/**
+ * Hierarchical timer wheel
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+#include "util.h"
+
+#include "timer.h"
+
+/* Ticks covered by all levels together */
+#define TIMER_RANGE (1ULL << (TIMER_SLOTS_BITS * TIMER_LEVELS))
+
+static void timer_wheel_tick(evutil_socket_t, short, void *);
+static void timer_wheel_step(struct timer_wheel *);
+static uint64_t timer_wheel_target(struct timer_wheel *);
+static void timer_insert(struct timer_wheel *, struct timer *, int);
+static void timer_unlink(struct timer *);
+static uint64_t timer_now(void);
+
+/**
+ * Creates a wheel on evbase with a tick of tick milliseconds, the resolution
+ * of its timers.
+ */
+struct timer_wheel *
+timer_wheel_new(struct event_base *evbase, int tick)
+{
+	struct timer_wheel *tw;
+	int i, j;
+
+	if (tick <= 0)
+		return NULL;
+
+	tw = calloc(1, sizeof(*tw));
+	if (tw == NULL) {
+		prterrno("calloc");
+		return NULL;
+	}
+
+	for (i = 0; i < TIMER_LEVELS; i++)
+		for (j = 0; j < TIMER_SLOTS; j++) {
+			tw->tw_slots[i][j].tl_next = &tw->tw_slots[i][j];
+			tw->tw_slots[i][j].tl_prev = &tw->tw_slots[i][j];
+		}
+	tw->tw_tick = tick;
+	tw->tw_start = timer_now();
+
+	tw->tw_ev = event_new(evbase, -1, EV_PERSIST, timer_wheel_tick, tw);
+	if (tw->tw_ev == NULL) {
+		prterr("event_new: failure.");
+		free(tw);
+		return NULL;
+	}
+
+	return tw;
+}
+
+/**
+ * Frees wheel. Timers still pending are dropped without running.
+ */
+void
+timer_wheel_free(struct timer_wheel *tw)
+{
+	int i, j;
+
+	if (tw == NULL)
+		return;
+
+	for (i = 0; i < TIMER_LEVELS; i++)
+		for (j = 0; j < TIMER_SLOTS; j++)
+			while (tw->tw_slots[i][j].tl_next !=
+			    &tw->tw_slots[i][j])
+				timer_unlink((struct timer *)
+				    tw->tw_slots[i][j].tl_next);
+
+	event_free(tw->tw_ev);
+	free(tw);
+}
+
+void
+timer_init(struct timer *tm, timer_f cb, void *arg)
+{
+	memset(tm, 0, sizeof(*tm));
+	tm->tm_cb = cb;
+	tm->tm_arg = arg;
+}
+
+/**
+ * Schedules timer to expire in ms milliseconds (rounded up to whole ticks),
+ * rescheduling it if it is already pending.
+ */
+int
+timer_schedule(struct timer_wheel *tw, struct timer *tm, int ms)
+{
+	uint64_t ticks;
+
+	if (tm->tm_pending)
+		timer_unlink(tm);
+	else {
+		/* First timer: wheel catches up with the time it was idle and
+		 * starts ticking */
+		if (tw->tw_ntimers == 0) {
+			struct timeval tv;
+
+			tw->tw_now = timer_wheel_target(tw);
+			tv.tv_sec = tw->tw_tick / 1000;
+			tv.tv_usec = tw->tw_tick % 1000 * 1000;
+			if (event_add(tw->tw_ev, &tv) < 0) {
+				prterr("event_add: failure.");
+				return -1;
+			}
+		}
+		tw->tw_ntimers++;
+	}
+
+	/* Counted from the current time, which may be ahead of the wheel if
+	 * its ticks are late */
+	ticks = ms <= 0 ? 1 : (ms + tw->tw_tick - 1) / tw->tw_tick;
+	tm->tm_expire = timer_wheel_target(tw) + ticks;
+	timer_insert(tw, tm, 0);
+
+	return 0;
+}
+
+void
+timer_cancel(struct timer_wheel *tw, struct timer *tm)
+{
+	if (!tm->tm_pending)
+		return;
+
+	timer_unlink(tm);
+	if (--tw->tw_ntimers == 0)
+		event_del(tw->tw_ev);
+}
+
+static void
+timer_wheel_tick(evutil_socket_t fd, short events, void *arg)
+{
+	struct timer_wheel *tw;
+	uint64_t target;
+
+	tw = arg;
+
+	/* Ticks may come late: runs every tick missed */
+	target = timer_wheel_target(tw);
+	while (tw->tw_now < target && tw->tw_ntimers > 0)
+		timer_wheel_step(tw);
+	tw->tw_now = target;
+}
+
+/**
+ * Advances wheel by one tick: cascades the slots of upper levels which are
+ * now due and runs the timers on the current slot of level 0.
+ */
+static void
+timer_wheel_step(struct timer_wheel *tw)
+{
+	struct timer_link expired, *slot;
+	int level;
+
+	tw->tw_now++;
+
+	/* Levels whose slot index wrapped around have their next slot moved
+	 * down, upper levels first */
+	for (level = 1; level < TIMER_LEVELS; level++)
+		if ((tw->tw_now >> (TIMER_SLOTS_BITS * (level - 1))) &
+		    (TIMER_SLOTS - 1))
+			break;
+	for (level--; level > 0; level--) {
+		struct timer_link moved;
+
+		slot = &tw->tw_slots[level][(tw->tw_now >>
+		    (TIMER_SLOTS_BITS * level)) & (TIMER_SLOTS - 1)];
+		if (slot->tl_next == slot)
+			continue;
+
+		/* Takes the whole slot first, as timers may go back to it */
+		moved.tl_next = slot->tl_next;
+		moved.tl_prev = slot->tl_prev;
+		moved.tl_next->tl_prev = &moved;
+		moved.tl_prev->tl_next = &moved;
+		slot->tl_next = slot->tl_prev = slot;
+
+		while (moved.tl_next != &moved) {
+			struct timer *tm;
+
+			tm = (struct timer *)moved.tl_next;
+			timer_unlink(tm);
+			timer_insert(tw, tm, 1);
+		}
+	}
+
+	/* Runs expired timers, off the slot so that callbacks may schedule
+	 * or cancel any timer */
+	slot = &tw->tw_slots[0][tw->tw_now & (TIMER_SLOTS - 1)];
+	if (slot->tl_next == slot)
+		return;
+
+	expired.tl_next = slot->tl_next;
+	expired.tl_prev = slot->tl_prev;
+	expired.tl_next->tl_prev = &expired;
+	expired.tl_prev->tl_next = &expired;
+	slot->tl_next = slot->tl_prev = slot;
+
+	while (expired.tl_next != &expired) {
+		struct timer *tm;
+
+		tm = (struct timer *)expired.tl_next;
+		timer_unlink(tm);
+		if (--tw->tw_ntimers == 0)
+			event_del(tw->tw_ev);
+
+		tm->tm_cb(tm, tm->tm_arg);
+	}
+}
+
+/**
+ * Returns the tick wheel should be on now.
+ */
+static uint64_t
+timer_wheel_target(struct timer_wheel *tw)
+{
+	return (timer_now() - tw->tw_start) / tw->tw_tick;
+}
+
+/**
+ * Puts timer on the slot for its expiration tick: the lowest level whose range
+ * reaches it. Timers beyond all levels wait on the last slot reached and are
+ * placed again when it is cascaded. The level 0 slot of the current tick has
+ * already run, except while cascading, which happens right before it runs:
+ * timers cascaded on their very tick go there.
+ */
+static void
+timer_insert(struct timer_wheel *tw, struct timer *tm, int cascading)
+{
+	struct timer_link *slot;
+	uint64_t expire, delta, first;
+	int level;
+
+	expire = tm->tm_expire;
+	first = cascading ? tw->tw_now : tw->tw_now + 1;
+	if (expire < first)
+		expire = first;
+	delta = expire - tw->tw_now;
+	if (delta >= TIMER_RANGE) {
+		delta = TIMER_RANGE - 1;
+		expire = tw->tw_now + delta;
+	}
+
+	for (level = 0; level < TIMER_LEVELS - 1; level++)
+		if (delta < 1ULL << (TIMER_SLOTS_BITS * (level + 1)))
+			break;
+
+	slot = &tw->tw_slots[level][(expire >> (TIMER_SLOTS_BITS * level)) &
+	    (TIMER_SLOTS - 1)];
+
+	tm->tm_link.tl_next = slot;
+	tm->tm_link.tl_prev = slot->tl_prev;
+	slot->tl_prev->tl_next = &tm->tm_link;
+	slot->tl_prev = &tm->tm_link;
+	tm->tm_pending = 1;
+}
+
+static void
+timer_unlink(struct timer *tm)
+{
+	tm->tm_link.tl_prev->tl_next = tm->tm_link.tl_next;
+	tm->tm_link.tl_next->tl_prev = tm->tm_link.tl_prev;
+	tm->tm_link.tl_next = tm->tm_link.tl_prev = NULL;
+	tm->tm_pending = 0;
+}
+
+static uint64_t
+timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
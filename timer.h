@@ -0,0 +1,60 @@
+/**
+ * Hierarchical timer wheel
+ *
+ * Timers of an event loop hang from TIMER_LEVELS wheels of TIMER_SLOTS slots
+ * each: level 0 holds timers due within TIMER_SLOTS ticks, one slot per tick,
+ * and every next level covers TIMER_SLOTS times the range of the previous
+ * one, with coarser slots which are moved down a level ("cascaded") as time
+ * comes near. Scheduling, rescheduling and canceling are O(1). The wheel is
+ * driven by a single libevent timer, armed only while timers are pending.
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOTS_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOTS_BITS)
+
+/* Default tick, in milliseconds */
+#define TIMER_TICK_DEFAULT 10
+
+struct timer;
+
+typedef void (*timer_f)(struct timer *, void *);
+
+/* Link on a slot's circular list; slots hold just the list head */
+struct timer_link {
+	struct timer_link *tl_next;
+	struct timer_link *tl_prev;
+};
+
+/**
+ * Timer structure
+ *
+ * Embedded by users on their own structures and set up with timer_init().
+ * tm_cb runs on the event loop thread once the timer expires; it may free the
+ * timer or schedule it again.
+ */
+struct timer {
+	struct timer_link tm_link; /* first, so links convert to timers */
+	uint64_t tm_expire; /* tick it expires on */
+	timer_f tm_cb;
+	void *tm_arg;
+	int tm_pending;
+};
+
+struct timer_wheel {
+	struct timer_link tw_slots[TIMER_LEVELS][TIMER_SLOTS];
+	uint64_t tw_now; /* ticks since tw_start */
+	uint64_t tw_start; /* monotonic time of tick 0, in ms */
+	int tw_tick; /* in ms */
+	int tw_ntimers; /* timers pending */
+	struct event *tw_ev;
+};
+
+void timer_init(struct timer *, timer_f, void *);
+int timer_schedule(struct timer_wheel *, struct timer *, int);
+void timer_cancel(struct timer_wheel *, struct timer *);
+
+#endif /* !__TIMER_H__ */
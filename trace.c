@@ -0,0 +1,329 @@
+/**
+ * Frame-level traffic capture
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+#include "util.h"
+#include "timer.h"
+#include "http2.h"
+
+#include "trace.h"
+
+static uint64_t trace_now(void);
+static int trace_grow(struct trace *, size_t);
+static void trace_put32(char *, uint32_t);
+static void trace_put64(char *, uint64_t);
+static uint32_t trace_get32(const char *);
+static uint64_t trace_get64(const char *);
+
+struct trace *trace_recorder = NULL;
+
+/**
+ * Starts recording every frame received and sent on the process to a new
+ * trace file at path.
+ */
+int
+trace_start(const char *path)
+{
+	struct trace *tc;
+
+	if (trace_recorder != NULL) {
+		prterr("trace_start: already recording.");
+		return -1;
+	}
+
+	tc = calloc(1, sizeof(*tc));
+	if (tc == NULL) {
+		prterrno("calloc");
+		return -1;
+	}
+
+	tc->tc_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (tc->tc_fd < 0) {
+		prterrno("open");
+		free(tc);
+		return -1;
+	}
+	tc->tc_writing = 1;
+	pthread_mutex_init(&tc->tc_lock, NULL);
+
+	if (trace_grow(tc, TRACE_FILE_HEADER_SIZE) < 0) {
+		prterr("trace_grow: failure.");
+		trace_close(tc);
+		return -1;
+	}
+
+	memcpy(tc->tc_map, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	trace_put32(&tc->tc_map[sizeof(TRACE_MAGIC)], TRACE_VERSION);
+	tc->tc_len = TRACE_FILE_HEADER_SIZE;
+	trace_put64(&tc->tc_map[TRACE_FILE_LENGTH_OFFSET], tc->tc_len);
+	tc->tc_start = trace_now();
+
+	trace_recorder = tc;
+
+	prtinfo("Recording frames to %s.", path);
+
+	return 0;
+}
+
+void
+trace_stop(void)
+{
+	struct trace *tc;
+
+	tc = trace_recorder;
+	trace_recorder = NULL;
+	trace_close(tc);
+}
+
+void
+trace_frame(struct trace *tc, struct http2_frame *fr, int dir)
+{
+	uint8_t hdr[HTTP2_FRAME_HEADER_SIZE];
+	uint64_t now;
+	char *rec;
+
+	now = trace_now();
+	http2_frame_header_pack(fr, hdr);
+
+	pthread_mutex_lock(&tc->tc_lock);
+
+	if (trace_grow(tc, TRACE_RECORD_HEADER_SIZE + fr->fr_length) < 0) {
+		prterr("trace_grow: failure.");
+		pthread_mutex_unlock(&tc->tc_lock);
+		return;
+	}
+
+	rec = &tc->tc_map[tc->tc_len];
+	trace_put64(&rec[0], now - tc->tc_start);
+	trace_put32(&rec[8], fr->fr_conn->cn_id);
+	rec[12] = dir;
+	memcpy(&rec[13], hdr, sizeof(hdr));
+	if (fr->fr_length != 0)
+		memcpy(&rec[TRACE_RECORD_HEADER_SIZE], fr->fr_buf,
+		    fr->fr_length);
+	tc->tc_len += TRACE_RECORD_HEADER_SIZE + fr->fr_length;
+	trace_put64(&tc->tc_map[TRACE_FILE_LENGTH_OFFSET], tc->tc_len);
+
+	pthread_mutex_unlock(&tc->tc_lock);
+}
+
+/**
+ * Opens a trace file for reading.
+ */
+struct trace *
+trace_open(const char *path)
+{
+	struct trace *tc;
+	struct stat st;
+
+	tc = calloc(1, sizeof(*tc));
+	if (tc == NULL) {
+		prterrno("calloc");
+		return NULL;
+	}
+	pthread_mutex_init(&tc->tc_lock, NULL);
+
+	tc->tc_fd = open(path, O_RDONLY);
+	if (tc->tc_fd < 0) {
+		prterrno("open");
+		goto error;
+	}
+	if (fstat(tc->tc_fd, &st) < 0) {
+		prterrno("fstat");
+		goto error;
+	}
+	if (st.st_size < TRACE_FILE_HEADER_SIZE) {
+		prterr("trace_open: %s is not a trace file.", path);
+		goto error;
+	}
+
+	tc->tc_mapsize = st.st_size;
+	tc->tc_map = mmap(NULL, tc->tc_mapsize, PROT_READ, MAP_PRIVATE,
+	    tc->tc_fd, 0);
+	if (tc->tc_map == MAP_FAILED) {
+		prterrno("mmap");
+		tc->tc_map = NULL;
+		goto error;
+	}
+
+	if (memcmp(tc->tc_map, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+	    trace_get32(&tc->tc_map[sizeof(TRACE_MAGIC)]) != TRACE_VERSION) {
+		prterr("trace_open: %s is not a trace file (version %d).",
+		    path, TRACE_VERSION);
+		goto error;
+	}
+	tc->tc_pos = TRACE_FILE_HEADER_SIZE;
+
+	/* File may be longer than the trace if recording was not stopped */
+	tc->tc_len = trace_get64(&tc->tc_map[TRACE_FILE_LENGTH_OFFSET]);
+	if (tc->tc_len < TRACE_FILE_HEADER_SIZE ||
+	    tc->tc_len > tc->tc_mapsize)
+		tc->tc_len = tc->tc_mapsize;
+
+	return tc;
+
+error:
+	trace_close(tc);
+	return NULL;
+}
+
+/**
+ * Reads next record. Returns 1 if there was one, 0 at the end of the trace
+ * and -1 if it is truncated. Pointers on rec point into the mapped file and are
+ * valid until the trace is closed.
+ */
+int
+trace_next(struct trace *tc, struct trace_record *rec)
+{
+	const char *ptr;
+	const uint8_t *hdr;
+
+	if (tc->tc_pos == tc->tc_len)
+		return 0;
+	if (tc->tc_len - tc->tc_pos < TRACE_RECORD_HEADER_SIZE)
+		return -1;
+
+	ptr = &tc->tc_map[tc->tc_pos];
+	hdr = (const uint8_t *)&ptr[13];
+
+	rec->rec_time = trace_get64(&ptr[0]);
+	rec->rec_conn = trace_get32(&ptr[8]);
+	rec->rec_dir = ptr[12];
+	rec->rec_header = hdr;
+	rec->rec_length = hdr[0] << 16 | hdr[1] << 8 | hdr[2];
+	rec->rec_type = hdr[3];
+	rec->rec_flags = hdr[4];
+	rec->rec_streamid =
+	    (hdr[5] & 0x7F) << 24 | hdr[6] << 16 | hdr[7] << 8 | hdr[8];
+	rec->rec_payload = &ptr[TRACE_RECORD_HEADER_SIZE];
+
+	if (tc->tc_len - tc->tc_pos - TRACE_RECORD_HEADER_SIZE <
+	    rec->rec_length)
+		return -1;
+	tc->tc_pos += TRACE_RECORD_HEADER_SIZE + rec->rec_length;
+
+	return 1;
+}
+
+/**
+ * Closes trace; when writing, file is cut down to what was recorded.
+ */
+void
+trace_close(struct trace *tc)
+{
+	if (tc == NULL)
+		return;
+
+	if (tc->tc_map != NULL)
+		munmap(tc->tc_map, tc->tc_mapsize);
+	if (tc->tc_fd >= 0) {
+		if (tc->tc_writing && ftruncate(tc->tc_fd, tc->tc_len) < 0)
+			prterrno("ftruncate");
+		close(tc->tc_fd);
+	}
+
+	pthread_mutex_destroy(&tc->tc_lock);
+	free(tc);
+}
+
+static uint64_t
+trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Makes sure there is room for len more bytes on the mapping, extending the
+ * file and mapping it again if needed.
+ */
+static int
+trace_grow(struct trace *tc, size_t len)
+{
+	size_t size;
+	char *map;
+
+	if (tc->tc_mapsize - tc->tc_len >= len)
+		return 0;
+
+	for (size = tc->tc_mapsize; size - tc->tc_len < len;
+	    size += TRACE_GROW_SIZE)
+		;
+
+	if (ftruncate(tc->tc_fd, size) < 0) {
+		prterrno("ftruncate");
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, tc->tc_fd,
+	    0);
+	if (map == MAP_FAILED) {
+		prterrno("mmap");
+		return -1;
+	}
+
+	if (tc->tc_map != NULL)
+		munmap(tc->tc_map, tc->tc_mapsize);
+	tc->tc_map = map;
+	tc->tc_mapsize = size;
+
+	return 0;
+}
+
+static void
+trace_put32(char *buf, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		buf[i] = v >> (8 * i);
+}
+
+static void
+trace_put64(char *buf, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		buf[i] = v >> (8 * i);
+}
+
+static uint32_t
+trace_get32(const char *buf)
+{
+	uint32_t v;
+	int i;
+
+	for (i = 3, v = 0; i >= 0; i--)
+		v = v << 8 | (uint8_t)buf[i];
+
+	return v;
+}
+
+static uint64_t
+trace_get64(const char *buf)
+{
+	uint64_t v;
+	int i;
+
+	for (i = 7, v = 0; i >= 0; i--)
+		v = v << 8 | (uint8_t)buf[i];
+
+	return v;
+}
@@ -0,0 +1,65 @@
+/**
+ * Frame-level traffic capture
+ *
+ * A trace file is a header (TRACE_MAGIC, version and length of the trace, kept
+ * up to date after every record so that a trace survives its process being
+ * killed) followed by one record per frame received or enqueued for sending:
+ *
+ *   time (8 bytes, ns since trace start) | connection ID (4) | direction (1) |
+ *   frame header (9, as on the wire) | payload (length from frame header)
+ *
+ * Integers other than the frame header are little-endian. Files are written
+ * and read through mmap(2).
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#define TRACE_MAGIC "H2TRACE"
+#define TRACE_VERSION 1
+#define TRACE_FILE_HEADER_SIZE 24
+#define TRACE_FILE_LENGTH_OFFSET 16
+#define TRACE_RECORD_HEADER_SIZE (13 + HTTP2_FRAME_HEADER_SIZE)
+
+/* File grows by this much each time it fills up */
+#define TRACE_GROW_SIZE (64 * 1024 * 1024)
+
+/* Directions */
+#define TRACE_RX 0
+#define TRACE_TX 1
+
+struct trace {
+	int tc_fd;
+	char *tc_map;
+	size_t tc_mapsize;
+	size_t tc_len; /* bytes used (written, or on file when reading) */
+	size_t tc_pos; /* next record to be read */
+	uint64_t tc_start; /* monotonic time of trace start, in ns */
+	int tc_writing;
+	pthread_mutex_t tc_lock; /* recorders may run on several threads */
+};
+
+struct trace_record {
+	uint64_t rec_time;
+	uint32_t rec_conn;
+	uint8_t rec_dir;
+	const uint8_t *rec_header; /* frame header, as on the wire */
+	uint8_t rec_type;
+	uint8_t rec_flags;
+	uint32_t rec_streamid;
+	size_t rec_length;
+	const char *rec_payload;
+};
+
+/* Trace being recorded, if any */
+extern struct trace *trace_recorder;
+
+int trace_start(const char *);
+void trace_stop(void);
+void trace_frame(struct trace *, struct http2_frame *, int);
+
+struct trace *trace_open(const char *);
+int trace_next(struct trace *, struct trace_record *);
+void trace_close(struct trace *);
+
+#endif /* !__TRACE_H__ */
@@ -0,0 +1,264 @@
+/**
+ * Worker thread pool for CPU-heavy jobs
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <event2/event.h>
+
+#include "libhttp2.h"
+#include "util.h"
+
+#include "worker.h"
+
+static void *worker_thread(void *);
+static void worker_done_push(struct worker_pool *, struct worker_job *);
+static struct worker_job *worker_done_pop(struct worker_pool *);
+static void worker_done_read(evutil_socket_t, short, void *);
+static void worker_done_drain(struct worker_pool *);
+
+struct worker_pool *
+worker_pool_new(int nthreads, struct event_base *evbase)
+{
+	struct worker_pool *wp;
+	int i;
+
+	if (nthreads <= 0)
+		return NULL;
+
+	/* Allocates structure */
+	wp = calloc(1, sizeof(*wp));
+	if (wp == NULL) {
+		prterrno("calloc");
+		return NULL;
+	}
+	wp->wp_threads = calloc(nthreads, sizeof(*wp->wp_threads));
+	if (wp->wp_threads == NULL) {
+		prterrno("calloc");
+		free(wp);
+		return NULL;
+	}
+
+	pthread_mutex_init(&wp->wp_lock, NULL);
+	pthread_cond_init(&wp->wp_cond, NULL);
+
+	/* Completion queue starts with only the stub on it */
+	atomic_init(&wp->wp_donestub.wj_donenext, NULL);
+	atomic_init(&wp->wp_donehead, &wp->wp_donestub);
+	wp->wp_donetail = &wp->wp_donestub;
+
+	/* Creates the eventfd used to wake up the event loop and its event */
+	wp->wp_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wp->wp_evfd < 0) {
+		prterrno("eventfd");
+		goto error;
+	}
+	wp->wp_evdone = event_new(evbase, wp->wp_evfd, EV_READ | EV_PERSIST,
+	    worker_done_read, wp);
+	if (wp->wp_evdone == NULL) {
+		prterr("event_new: failure.");
+		goto error;
+	}
+	if (event_add(wp->wp_evdone, NULL) < 0) {
+		prterr("event_add: failure.");
+		goto error;
+	}
+
+	/* Starts worker threads */
+	for (i = 0; i < nthreads; i++) {
+		errno = pthread_create(&wp->wp_threads[i], NULL, worker_thread, wp);
+		if (errno != 0) {
+			prterrno("pthread_create");
+			goto error;
+		}
+		wp->wp_nthreads++;
+	}
+
+	prtinfo("Worker pool started with %d thread(s).", nthreads);
+
+	return wp;
+
+error:
+	worker_pool_free(wp);
+	return NULL;
+}
+
+/**
+ * Jobs already submitted are run and completed before the pool is freed.
+ */
+void
+worker_pool_free(struct worker_pool *wp)
+{
+	int i;
+
+	if (wp == NULL)
+		return;
+
+	/* Stops worker threads once there are no more jobs waiting */
+	pthread_mutex_lock(&wp->wp_lock);
+	wp->wp_stop = 1;
+	pthread_cond_broadcast(&wp->wp_cond);
+	pthread_mutex_unlock(&wp->wp_lock);
+
+	for (i = 0; i < wp->wp_nthreads; i++)
+		pthread_join(wp->wp_threads[i], NULL);
+
+	/* Completes what is still on completion queue */
+	worker_done_drain(wp);
+
+	if (wp->wp_evdone != NULL)
+		event_free(wp->wp_evdone);
+	if (wp->wp_evfd >= 0)
+		close(wp->wp_evfd);
+
+	pthread_cond_destroy(&wp->wp_cond);
+	pthread_mutex_destroy(&wp->wp_lock);
+
+	free(wp->wp_threads);
+	free(wp);
+}
+
+int
+worker_submit(struct worker_pool *wp, struct worker_job *job)
+{
+	if (wp == NULL || job == NULL)
+		return -1;
+
+	job->wj_next = NULL;
+
+	pthread_mutex_lock(&wp->wp_lock);
+	if (wp->wp_stop) {
+		pthread_mutex_unlock(&wp->wp_lock);
+		return -1;
+	}
+	if (wp->wp_jobs == NULL)
+		wp->wp_jobs = job;
+	else
+		wp->wp_lastjob->wj_next = job;
+	wp->wp_lastjob = job;
+	pthread_cond_signal(&wp->wp_cond);
+	pthread_mutex_unlock(&wp->wp_lock);
+
+	return 0;
+}
+
+static void *
+worker_thread(void *arg)
+{
+	struct worker_pool *wp;
+	struct worker_job *job;
+	uint64_t one = 1;
+
+	wp = arg;
+
+	for (;;) {
+		/* Waits for a job */
+		pthread_mutex_lock(&wp->wp_lock);
+		while (wp->wp_jobs == NULL && !wp->wp_stop)
+			pthread_cond_wait(&wp->wp_cond, &wp->wp_lock);
+		job = wp->wp_jobs;
+		if (job == NULL) {
+			pthread_mutex_unlock(&wp->wp_lock);
+			break;
+		}
+		wp->wp_jobs = job->wj_next;
+		pthread_mutex_unlock(&wp->wp_lock);
+
+		job->wj_work(job);
+
+		/* Hands job back to the event loop and wakes it up */
+		worker_done_push(wp, job);
+		if (write(wp->wp_evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			prterrno("write");
+	}
+
+	return NULL;
+}
+
+/**
+ * Completion queue is an intrusive MPSC queue (D. Vyukov's design): producers
+ * only exchange the head pointer and link the previous head to the new job,
+ * the single consumer walks from the tail. A stub job keeps it never empty.
+ */
+static void
+worker_done_push(struct worker_pool *wp, struct worker_job *job)
+{
+	struct worker_job *prev;
+
+	atomic_store_explicit(&job->wj_donenext, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&wp->wp_donehead, job,
+	    memory_order_acq_rel);
+	atomic_store_explicit(&prev->wj_donenext, job, memory_order_release);
+}
+
+/**
+ * Returns NULL when the queue is empty or when a producer is halfway through
+ * a push; in the latter case, its eventfd write will bring us back later.
+ */
+static struct worker_job *
+worker_done_pop(struct worker_pool *wp)
+{
+	struct worker_job *tail, *next;
+
+	tail = wp->wp_donetail;
+	next = atomic_load_explicit(&tail->wj_donenext, memory_order_acquire);
+
+	/* Skips stub */
+	if (tail == &wp->wp_donestub) {
+		if (next == NULL)
+			return NULL;
+		wp->wp_donetail = next;
+		tail = next;
+		next = atomic_load_explicit(&tail->wj_donenext,
+		    memory_order_acquire);
+	}
+
+	if (next != NULL) {
+		wp->wp_donetail = next;
+		return tail;
+	}
+
+	/* tail is the last job: pushes stub back behind it before popping */
+	if (tail != atomic_load_explicit(&wp->wp_donehead, memory_order_acquire))
+		return NULL;
+	worker_done_push(wp, &wp->wp_donestub);
+
+	next = atomic_load_explicit(&tail->wj_donenext, memory_order_acquire);
+	if (next != NULL) {
+		wp->wp_donetail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+static void
+worker_done_read(evutil_socket_t fd, short events, void *arg)
+{
+	struct worker_pool *wp;
+	uint64_t count;
+
+	wp = arg;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		prterrno("read");
+
+	worker_done_drain(wp);
+}
+
+static void
+worker_done_drain(struct worker_pool *wp)
+{
+	struct worker_job *job;
+
+	while ((job = worker_done_pop(wp)) != NULL)
+		job->wj_done(job);
+}
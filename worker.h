@@ -0,0 +1,51 @@
+/**
+ * Worker thread pool for CPU-heavy jobs
+ *
+ * Jobs run on a fixed set of threads and, once done, are handed back to the
+ * event loop owning the pool through a lock-free MPSC queue and an eventfd.
+ * Only the event loop thread runs completion callbacks.
+ */
+
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+struct worker_job;
+
+typedef void (*worker_job_f)(struct worker_job *);
+
+/**
+ * Job structure
+ *
+ * Embedded by users on their own structures. wj_work runs on a worker thread
+ * and wj_done runs on the event loop thread afterwards; it is the last one to
+ * touch the job, so it may free it.
+ */
+struct worker_job {
+	worker_job_f wj_work;
+	worker_job_f wj_done;
+	struct worker_job *wj_next; /* next job waiting for a worker */
+	struct worker_job *_Atomic wj_donenext; /* next job on completion queue */
+};
+
+struct worker_pool {
+	/* Submission side: jobs waiting for a worker thread */
+	pthread_mutex_t wp_lock;
+	pthread_cond_t wp_cond;
+	struct worker_job *wp_jobs; /* first job waiting */
+	struct worker_job *wp_lastjob; /* last job waiting */
+	int wp_stop;
+
+	/* Completion side: MPSC queue consumed by the event loop only */
+	struct worker_job *_Atomic wp_donehead; /* last pushed (producers) */
+	struct worker_job *wp_donetail; /* next to pop (consumer) */
+	struct worker_job wp_donestub;
+	int wp_evfd;
+	struct event *wp_evdone;
+
+	pthread_t *wp_threads;
+	int wp_nthreads;
+};
+
+int worker_submit(struct worker_pool *, struct worker_job *);
+
+#endif /* !__WORKER_H__ */